@@ -0,0 +1,1277 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "array.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARRAY_X86
+#include <immintrin.h>
+#endif
+
+#define INTS(array) ((int32_t *)(array)->elements)
+#define FLOATS(array) ((float *)(array)->elements)
+#define BYTES(array) ((int8_t *)(array)->elements)
+
+// Float reductions keep this many partial sums: four AVX2 registers' worth,
+// enough to hide the latency of the adds.
+#define REDUCE_LANES 32
+
+typedef struct
+{
+  int32_t (*sumInt)(const int32_t *a, int n);
+  float (*sumFloat)(const float *a, int n);
+  void (*rangeInt)(const int32_t *a, int n, int32_t *min, int32_t *max);
+  void (*rangeFloat)(const float *a, int n, float *min, float *max);
+  int32_t (*dotInt)(const int32_t *a, const int32_t *b, int n);
+  float (*dotFloat)(const float *a, const float *b, int n);
+  void (*addInt)(int32_t *out, const int32_t *a, const int32_t *b, int n);
+  void (*addFloat)(float *out, const float *a, const float *b, int n);
+  void (*addByte)(int8_t *out, const int8_t *a, const int8_t *b, int n);
+  void (*mulInt)(int32_t *out, const int32_t *a, const int32_t *b, int n);
+  void (*mulFloat)(float *out, const float *a, const float *b, int n);
+  void (*compareInt)(uint8_t *mask, const int32_t *a, int n, int32_t x,
+                     ArrayOp op);
+  void (*compareFloat)(uint8_t *mask, const float *a, int n, float x,
+                       ArrayOp op);
+} ArrayKernels;
+
+// Scalar kernels. Integer arithmetic wraps, as it does in the interpreter.
+
+static int32_t sumIntScalar(const int32_t *a, int n)
+{
+  uint32_t sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += (uint32_t)a[i];
+  return (int32_t)sum;
+}
+
+static float reduceLanes(float *acc)
+{
+  // Folds the lanes in halves, the same pairing the vector kernels get from
+  // adding their registers and then the halves of the last one.
+  for (int width = REDUCE_LANES / 2; width >= 4; width /= 2)
+  {
+    for (int lane = 0; lane < width; lane++)
+      acc[lane] += acc[lane + width];
+  }
+  return (acc[0] + acc[2]) + (acc[1] + acc[3]);
+}
+
+static float sumFloatScalar(const float *a, int n)
+{
+  float acc[REDUCE_LANES] = {0};
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    for (int lane = 0; lane < REDUCE_LANES; lane++)
+      acc[lane] += a[i + lane];
+  }
+
+  float sum = reduceLanes(acc);
+  for (; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+
+static void rangeIntScalar(const int32_t *a, int n, int32_t *min, int32_t *max)
+{
+  int32_t low = a[0], high = a[0];
+  for (int i = 1; i < n; i++)
+  {
+    if (a[i] < low)
+      low = a[i];
+    if (a[i] > high)
+      high = a[i];
+  }
+  *min = low;
+  *max = high;
+}
+
+static void rangeFloatScalar(const float *a, int n, float *min, float *max)
+{
+  float low = a[0], high = a[0];
+  for (int i = 1; i < n; i++)
+  {
+    if (a[i] < low)
+      low = a[i];
+    if (a[i] > high)
+      high = a[i];
+  }
+  *min = low;
+  *max = high;
+}
+
+static int32_t dotIntScalar(const int32_t *a, const int32_t *b, int n)
+{
+  uint32_t sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += (uint32_t)a[i] * (uint32_t)b[i];
+  return (int32_t)sum;
+}
+
+static float dotFloatScalar(const float *a, const float *b, int n)
+{
+  float acc[REDUCE_LANES] = {0};
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    for (int lane = 0; lane < REDUCE_LANES; lane++)
+      acc[lane] += a[i + lane] * b[i + lane];
+  }
+
+  float sum = reduceLanes(acc);
+  for (; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+static void addIntScalar(int32_t *out, const int32_t *a, const int32_t *b,
+                         int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+}
+
+static void addFloatScalar(float *out, const float *a, const float *b, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = a[i] + b[i];
+}
+
+static void addByteScalar(int8_t *out, const int8_t *a, const int8_t *b, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = (int8_t)(a[i] + b[i]);
+}
+
+static void mulIntScalar(int32_t *out, const int32_t *a, const int32_t *b,
+                         int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = (int32_t)((uint32_t)a[i] * (uint32_t)b[i]);
+}
+
+static void mulFloatScalar(float *out, const float *a, const float *b, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = a[i] * b[i];
+}
+
+static void compareIntScalar(uint8_t *mask, const int32_t *a, int n, int32_t x,
+                             ArrayOp op)
+{
+  for (int i = 0; i < n; i++)
+  {
+    switch (op)
+    {
+    case ARRAY_LESS:
+      mask[i] = a[i] < x;
+      break;
+    case ARRAY_GREATER:
+      mask[i] = a[i] > x;
+      break;
+    default:
+      mask[i] = a[i] == x;
+      break;
+    }
+  }
+}
+
+static void compareFloatScalar(uint8_t *mask, const float *a, int n, float x,
+                               ArrayOp op)
+{
+  for (int i = 0; i < n; i++)
+  {
+    switch (op)
+    {
+    case ARRAY_LESS:
+      mask[i] = a[i] < x;
+      break;
+    case ARRAY_GREATER:
+      mask[i] = a[i] > x;
+      break;
+    default:
+      mask[i] = a[i] == x;
+      break;
+    }
+  }
+}
+
+static const ArrayKernels scalarKernels = {
+    sumIntScalar,     sumFloatScalar, rangeIntScalar,   rangeFloatScalar,
+    dotIntScalar,     dotFloatScalar, addIntScalar,     addFloatScalar,
+    addByteScalar,    mulIntScalar,   mulFloatScalar,   compareIntScalar,
+    compareFloatScalar,
+};
+
+#ifdef ARRAY_X86
+
+// SSE2 kernels. Every loop handles whole vectors and leaves the remainder to
+// the scalar kernel.
+
+__attribute__((target("sse2"))) static int32_t sumIntSse2(const int32_t *a,
+                                                          int n)
+{
+  __m128i acc0 = _mm_setzero_si128();
+  __m128i acc1 = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    acc0 = _mm_add_epi32(acc0, _mm_loadu_si128((const __m128i *)(a + i)));
+    acc1 = _mm_add_epi32(acc1, _mm_loadu_si128((const __m128i *)(a + i + 4)));
+  }
+
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+  return (int32_t)((uint32_t)sumIntScalar(lanes, 4) +
+                   (uint32_t)sumIntScalar(a + i, n - i));
+}
+
+__attribute__((target("sse2"))) static float reduceSse2(__m128 *acc)
+{
+  for (int count = REDUCE_LANES / 8; count >= 1; count /= 2)
+  {
+    #pragma GCC unroll 8
+    for (int i = 0; i < count; i++)
+      acc[i] = _mm_add_ps(acc[i], acc[i + count]);
+  }
+  __m128 r = acc[0];
+  __m128 pairs = _mm_add_ps(r, _mm_movehl_ps(r, r));
+  return _mm_cvtss_f32(
+      _mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+__attribute__((target("sse2"))) static float sumFloatSse2(const float *a,
+                                                         int n)
+{
+  __m128 acc[REDUCE_LANES / 4];
+  #pragma GCC unroll 8
+  for (int k = 0; k < REDUCE_LANES / 4; k++)
+    acc[k] = _mm_setzero_ps();
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    #pragma GCC unroll 8
+    for (int k = 0; k < REDUCE_LANES / 4; k++)
+      acc[k] = _mm_add_ps(acc[k], _mm_loadu_ps(a + i + 4 * k));
+  }
+
+  float sum = reduceSse2(acc);
+  for (; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+
+__attribute__((target("sse2"))) static __m128i selectSse2(__m128i mask,
+                                                         __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2"))) static void
+rangeIntSse2(const int32_t *a, int n, int32_t *min, int32_t *max)
+{
+  if (n < 4)
+  {
+    rangeIntScalar(a, n, min, max);
+    return;
+  }
+
+  // SSE2 has no 32-bit min/max, so both are built from a compare and a
+  // select.
+  __m128i low = _mm_loadu_si128((const __m128i *)a);
+  __m128i high = low;
+  int i = 4;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    low = selectSse2(_mm_cmplt_epi32(v, low), v, low);
+    high = selectSse2(_mm_cmpgt_epi32(v, high), v, high);
+  }
+
+  int32_t lows[8], highs[8];
+  _mm_storeu_si128((__m128i *)lows, low);
+  _mm_storeu_si128((__m128i *)highs, high);
+  int tail = n - i;
+  memcpy(lows + 4, a + i, tail * sizeof(int32_t));
+  memcpy(highs + 4, a + i, tail * sizeof(int32_t));
+
+  int32_t unused;
+  rangeIntScalar(lows, 4 + tail, min, &unused);
+  rangeIntScalar(highs, 4 + tail, &unused, max);
+}
+
+__attribute__((target("sse2"))) static void
+rangeFloatSse2(const float *a, int n, float *min, float *max)
+{
+  if (n < 4)
+  {
+    rangeFloatScalar(a, n, min, max);
+    return;
+  }
+
+  __m128 low = _mm_loadu_ps(a);
+  __m128 high = low;
+  int i = 4;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 v = _mm_loadu_ps(a + i);
+    low = _mm_min_ps(low, v);
+    high = _mm_max_ps(high, v);
+  }
+
+  float lows[8], highs[8];
+  _mm_storeu_ps(lows, low);
+  _mm_storeu_ps(highs, high);
+  int tail = n - i;
+  memcpy(lows + 4, a + i, tail * sizeof(float));
+  memcpy(highs + 4, a + i, tail * sizeof(float));
+
+  float unused;
+  rangeFloatScalar(lows, 4 + tail, min, &unused);
+  rangeFloatScalar(highs, 4 + tail, &unused, max);
+}
+
+__attribute__((target("sse2"))) static __m128i mulInt32Sse2(__m128i a,
+                                                           __m128i b)
+{
+  // Multiplies the even and odd lanes separately and keeps the low halves;
+  // the low 32 bits do not depend on signedness.
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2"))) static int32_t
+dotIntSse2(const int32_t *a, const int32_t *b, int n)
+{
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi32(acc, mulInt32Sse2(va, vb));
+  }
+
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return (int32_t)((uint32_t)sumIntScalar(lanes, 4) +
+                   (uint32_t)dotIntScalar(a + i, b + i, n - i));
+}
+
+__attribute__((target("sse2"))) static float
+dotFloatSse2(const float *a, const float *b, int n)
+{
+  __m128 acc[REDUCE_LANES / 4];
+  #pragma GCC unroll 8
+  for (int k = 0; k < REDUCE_LANES / 4; k++)
+    acc[k] = _mm_setzero_ps();
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    #pragma GCC unroll 8
+    for (int k = 0; k < REDUCE_LANES / 4; k++)
+      acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(_mm_loadu_ps(a + i + 4 * k),
+                                             _mm_loadu_ps(b + i + 4 * k)));
+  }
+
+  float sum = reduceSse2(acc);
+  for (; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("sse2"))) static void
+addIntSse2(int32_t *out, const int32_t *a, const int32_t *b, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi32(va, vb));
+  }
+  addIntScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+addFloatSse2(float *out, const float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i,
+                  _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  addFloatScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+addByteSse2(int8_t *out, const int8_t *a, const int8_t *b, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(va, vb));
+  }
+  addByteScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+mulIntSse2(int32_t *out, const int32_t *a, const int32_t *b, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(out + i), mulInt32Sse2(va, vb));
+  }
+  mulIntScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+mulFloatSse2(float *out, const float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i,
+                  _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  mulFloatScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static __m128i
+compareInt4Sse2(const int32_t *a, __m128i x, ArrayOp op)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)a);
+  switch (op)
+  {
+  case ARRAY_LESS:
+    return _mm_cmplt_epi32(v, x);
+  case ARRAY_GREATER:
+    return _mm_cmpgt_epi32(v, x);
+  default:
+    return _mm_cmpeq_epi32(v, x);
+  }
+}
+
+__attribute__((target("sse2"))) static __m128i
+packMaskSse2(__m128i c0, __m128i c1, __m128i c2, __m128i c3)
+{
+  // Each compare lane is 0 or -1; saturating packs keep that, and the final
+  // and turns -1 into 1.
+  __m128i packed = _mm_packs_epi16(_mm_packs_epi32(c0, c1),
+                                   _mm_packs_epi32(c2, c3));
+  return _mm_and_si128(packed, _mm_set1_epi8(1));
+}
+
+__attribute__((target("sse2"))) static void
+compareIntSse2(uint8_t *mask, const int32_t *a, int n, int32_t x, ArrayOp op)
+{
+  __m128i scalar = _mm_set1_epi32(x);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i packed = packMaskSse2(compareInt4Sse2(a + i, scalar, op),
+                                  compareInt4Sse2(a + i + 4, scalar, op),
+                                  compareInt4Sse2(a + i + 8, scalar, op),
+                                  compareInt4Sse2(a + i + 12, scalar, op));
+    _mm_storeu_si128((__m128i *)(mask + i), packed);
+  }
+  compareIntScalar(mask + i, a + i, n - i, x, op);
+}
+
+__attribute__((target("sse2"))) static __m128i
+compareFloat4Sse2(const float *a, __m128 x, ArrayOp op)
+{
+  __m128 v = _mm_loadu_ps(a);
+  switch (op)
+  {
+  case ARRAY_LESS:
+    return _mm_castps_si128(_mm_cmplt_ps(v, x));
+  case ARRAY_GREATER:
+    return _mm_castps_si128(_mm_cmpgt_ps(v, x));
+  default:
+    return _mm_castps_si128(_mm_cmpeq_ps(v, x));
+  }
+}
+
+__attribute__((target("sse2"))) static void
+compareFloatSse2(uint8_t *mask, const float *a, int n, float x, ArrayOp op)
+{
+  __m128 scalar = _mm_set1_ps(x);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i packed = packMaskSse2(compareFloat4Sse2(a + i, scalar, op),
+                                  compareFloat4Sse2(a + i + 4, scalar, op),
+                                  compareFloat4Sse2(a + i + 8, scalar, op),
+                                  compareFloat4Sse2(a + i + 12, scalar, op));
+    _mm_storeu_si128((__m128i *)(mask + i), packed);
+  }
+  compareFloatScalar(mask + i, a + i, n - i, x, op);
+}
+
+static const ArrayKernels sse2Kernels = {
+    sumIntSse2,   sumFloatSse2, rangeIntSse2, rangeFloatSse2,   dotIntSse2,
+    dotFloatSse2, addIntSse2,   addFloatSse2, addByteSse2,      mulIntSse2,
+    mulFloatSse2, compareIntSse2, compareFloatSse2,
+};
+
+// AVX2 kernels.
+
+__attribute__((target("avx2"))) static int32_t sumIntAvx2(const int32_t *a,
+                                                          int n)
+{
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    acc0 =
+        _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *)(a + i)));
+    acc1 = _mm256_add_epi32(acc1,
+                            _mm256_loadu_si256((const __m256i *)(a + i + 8)));
+  }
+
+  int32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc0, acc1));
+  return (int32_t)((uint32_t)sumIntScalar(lanes, 8) +
+                   (uint32_t)sumIntScalar(a + i, n - i));
+}
+
+__attribute__((target("avx2"))) static float reduceAvx2(__m256 *acc)
+{
+  for (int count = REDUCE_LANES / 16; count >= 1; count /= 2)
+  {
+    #pragma GCC unroll 8
+    for (int i = 0; i < count; i++)
+      acc[i] = _mm256_add_ps(acc[i], acc[i + count]);
+  }
+  __m128 low = _mm256_castps256_ps128(acc[0]);
+  __m128 high = _mm256_extractf128_ps(acc[0], 1);
+  __m128 r = _mm_add_ps(low, high);
+  __m128 pairs = _mm_add_ps(r, _mm_movehl_ps(r, r));
+  return _mm_cvtss_f32(
+      _mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+__attribute__((target("avx2"))) static float sumFloatAvx2(const float *a,
+                                                         int n)
+{
+  __m256 acc[REDUCE_LANES / 8];
+  #pragma GCC unroll 8
+  for (int k = 0; k < REDUCE_LANES / 8; k++)
+    acc[k] = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    #pragma GCC unroll 8
+    for (int k = 0; k < REDUCE_LANES / 8; k++)
+      acc[k] = _mm256_add_ps(acc[k], _mm256_loadu_ps(a + i + 8 * k));
+  }
+
+  float sum = reduceAvx2(acc);
+  for (; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+
+__attribute__((target("avx2"))) static void
+rangeIntAvx2(const int32_t *a, int n, int32_t *min, int32_t *max)
+{
+  if (n < 8)
+  {
+    rangeIntScalar(a, n, min, max);
+    return;
+  }
+
+  __m256i low = _mm256_loadu_si256((const __m256i *)a);
+  __m256i high = low;
+  int i = 8;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    low = _mm256_min_epi32(low, v);
+    high = _mm256_max_epi32(high, v);
+  }
+
+  int32_t lows[16], highs[16];
+  _mm256_storeu_si256((__m256i *)lows, low);
+  _mm256_storeu_si256((__m256i *)highs, high);
+  int tail = n - i;
+  memcpy(lows + 8, a + i, tail * sizeof(int32_t));
+  memcpy(highs + 8, a + i, tail * sizeof(int32_t));
+
+  int32_t unused;
+  rangeIntScalar(lows, 8 + tail, min, &unused);
+  rangeIntScalar(highs, 8 + tail, &unused, max);
+}
+
+__attribute__((target("avx2"))) static void
+rangeFloatAvx2(const float *a, int n, float *min, float *max)
+{
+  if (n < 8)
+  {
+    rangeFloatScalar(a, n, min, max);
+    return;
+  }
+
+  __m256 low = _mm256_loadu_ps(a);
+  __m256 high = low;
+  int i = 8;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256 v = _mm256_loadu_ps(a + i);
+    low = _mm256_min_ps(low, v);
+    high = _mm256_max_ps(high, v);
+  }
+
+  float lows[16], highs[16];
+  _mm256_storeu_ps(lows, low);
+  _mm256_storeu_ps(highs, high);
+  int tail = n - i;
+  memcpy(lows + 8, a + i, tail * sizeof(float));
+  memcpy(highs + 8, a + i, tail * sizeof(float));
+
+  float unused;
+  rangeFloatScalar(lows, 8 + tail, min, &unused);
+  rangeFloatScalar(highs, 8 + tail, &unused, max);
+}
+
+__attribute__((target("avx2"))) static int32_t
+dotIntAvx2(const int32_t *a, const int32_t *b, int n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(va, vb));
+  }
+
+  int32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return (int32_t)((uint32_t)sumIntScalar(lanes, 8) +
+                   (uint32_t)dotIntScalar(a + i, b + i, n - i));
+}
+
+__attribute__((target("avx2"))) static float
+dotFloatAvx2(const float *a, const float *b, int n)
+{
+  // Multiply and add stay separate instructions so the rounding matches the
+  // other kernels.
+  __m256 acc[REDUCE_LANES / 8];
+  #pragma GCC unroll 8
+  for (int k = 0; k < REDUCE_LANES / 8; k++)
+    acc[k] = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+  {
+    #pragma GCC unroll 8
+    for (int k = 0; k < REDUCE_LANES / 8; k++)
+    {
+      __m256 product = _mm256_mul_ps(_mm256_loadu_ps(a + i + 8 * k),
+                                     _mm256_loadu_ps(b + i + 8 * k));
+      acc[k] = _mm256_add_ps(acc[k], product);
+    }
+  }
+
+  float sum = reduceAvx2(acc);
+  for (; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("avx2"))) static void
+addIntAvx2(int32_t *out, const int32_t *a, const int32_t *b, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi32(va, vb));
+  }
+  addIntScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+addFloatAvx2(float *out, const float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i),
+                                            _mm256_loadu_ps(b + i)));
+  addFloatScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+addByteAvx2(int8_t *out, const int8_t *a, const int8_t *b, int n)
+{
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi8(va, vb));
+  }
+  addByteScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+mulIntAvx2(int32_t *out, const int32_t *a, const int32_t *b, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_mullo_epi32(va, vb));
+  }
+  mulIntScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+mulFloatAvx2(float *out, const float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                            _mm256_loadu_ps(b + i)));
+  mulFloatScalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static __m256i
+compareInt8Avx2(const int32_t *a, __m256i x, ArrayOp op)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i *)a);
+  switch (op)
+  {
+  case ARRAY_LESS:
+    return _mm256_cmpgt_epi32(x, v);
+  case ARRAY_GREATER:
+    return _mm256_cmpgt_epi32(v, x);
+  default:
+    return _mm256_cmpeq_epi32(v, x);
+  }
+}
+
+__attribute__((target("avx2"))) static __m256i
+packMaskAvx2(__m256i c0, __m256i c1, __m256i c2, __m256i c3)
+{
+  // The packs work within 128-bit lanes, which leaves the 4-byte groups
+  // interleaved; the permute puts them back in element order.
+  __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(c0, c1),
+                                      _mm256_packs_epi32(c2, c3));
+  packed = _mm256_permutevar8x32_epi32(
+      packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+  return _mm256_and_si256(packed, _mm256_set1_epi8(1));
+}
+
+__attribute__((target("avx2"))) static void
+compareIntAvx2(uint8_t *mask, const int32_t *a, int n, int32_t x, ArrayOp op)
+{
+  __m256i scalar = _mm256_set1_epi32(x);
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i packed = packMaskAvx2(compareInt8Avx2(a + i, scalar, op),
+                                  compareInt8Avx2(a + i + 8, scalar, op),
+                                  compareInt8Avx2(a + i + 16, scalar, op),
+                                  compareInt8Avx2(a + i + 24, scalar, op));
+    _mm256_storeu_si256((__m256i *)(mask + i), packed);
+  }
+  compareIntScalar(mask + i, a + i, n - i, x, op);
+}
+
+__attribute__((target("avx2"))) static __m256i
+compareFloat8Avx2(const float *a, __m256 x, ArrayOp op)
+{
+  __m256 v = _mm256_loadu_ps(a);
+  switch (op)
+  {
+  case ARRAY_LESS:
+    return _mm256_castps_si256(_mm256_cmp_ps(v, x, _CMP_LT_OQ));
+  case ARRAY_GREATER:
+    return _mm256_castps_si256(_mm256_cmp_ps(v, x, _CMP_GT_OQ));
+  default:
+    return _mm256_castps_si256(_mm256_cmp_ps(v, x, _CMP_EQ_OQ));
+  }
+}
+
+__attribute__((target("avx2"))) static void
+compareFloatAvx2(uint8_t *mask, const float *a, int n, float x, ArrayOp op)
+{
+  __m256 scalar = _mm256_set1_ps(x);
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i packed = packMaskAvx2(compareFloat8Avx2(a + i, scalar, op),
+                                  compareFloat8Avx2(a + i + 8, scalar, op),
+                                  compareFloat8Avx2(a + i + 16, scalar, op),
+                                  compareFloat8Avx2(a + i + 24, scalar, op));
+    _mm256_storeu_si256((__m256i *)(mask + i), packed);
+  }
+  compareFloatScalar(mask + i, a + i, n - i, x, op);
+}
+
+static const ArrayKernels avx2Kernels = {
+    sumIntAvx2,   sumFloatAvx2, rangeIntAvx2, rangeFloatAvx2,   dotIntAvx2,
+    dotFloatAvx2, addIntAvx2,   addFloatAvx2, addByteAvx2,      mulIntAvx2,
+    mulFloatAvx2, compareIntAvx2, compareFloatAvx2,
+};
+
+#endif
+
+// The best kernel set this CPU supports, picked once for the whole process.
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+static ArrayKernel bestKernel = ARRAY_KERNEL_SCALAR;
+// The set this thread runs: bestKernel until setArrayKernel() overrides it,
+// which only affects the calling thread.
+static _Thread_local ArrayKernel activeKernel = ARRAY_KERNEL_SCALAR;
+static _Thread_local const ArrayKernels *kernels = NULL;
+
+static bool kernelSupported(ArrayKernel kernel)
+{
+  switch (kernel)
+  {
+  case ARRAY_KERNEL_SCALAR:
+    return true;
+#ifdef ARRAY_X86
+  case ARRAY_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case ARRAY_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+bool setArrayKernel(ArrayKernel kernel)
+{
+  if (!kernelSupported(kernel))
+    return false;
+
+  activeKernel = kernel;
+  switch (kernel)
+  {
+#ifdef ARRAY_X86
+  case ARRAY_KERNEL_SSE2:
+    kernels = &sse2Kernels;
+    break;
+  case ARRAY_KERNEL_AVX2:
+    kernels = &avx2Kernels;
+    break;
+#endif
+  default:
+    kernels = &scalarKernels;
+    break;
+  }
+  return true;
+}
+
+static void detectKernel()
+{
+  if (kernelSupported(ARRAY_KERNEL_AVX2))
+    bestKernel = ARRAY_KERNEL_AVX2;
+  else if (kernelSupported(ARRAY_KERNEL_SSE2))
+    bestKernel = ARRAY_KERNEL_SSE2;
+}
+
+static const ArrayKernels *activeKernels()
+{
+  if (kernels == NULL)
+  {
+    pthread_once(&kernelOnce, detectKernel);
+    setArrayKernel(bestKernel);
+  }
+  return kernels;
+}
+
+ArrayKernel arrayKernel()
+{
+  activeKernels();
+  return activeKernel;
+}
+
+const char *arrayKernelName(ArrayKernel kernel)
+{
+  switch (kernel)
+  {
+  case ARRAY_KERNEL_SCALAR:
+    return "scalar";
+  case ARRAY_KERNEL_SSE2:
+    return "sse2";
+  case ARRAY_KERNEL_AVX2:
+    return "avx2";
+  default:
+    return "unknown";
+  }
+}
+
+static int32_t toInt(Value value)
+{
+  switch (value.type)
+  {
+  case VAL_BYTE:
+    return AS_BYTE(value);
+  case VAL_INT:
+    return AS_INT(value);
+  case VAL_FLOAT:
+    return (int32_t)AS_FLOAT(value);
+  default:
+    return 0;
+  }
+}
+
+static float toFloat(Value value)
+{
+  switch (value.type)
+  {
+  case VAL_BYTE:
+    return (float)AS_BYTE(value);
+  case VAL_INT:
+    return (float)AS_INT(value);
+  case VAL_FLOAT:
+    return AS_FLOAT(value);
+  default:
+    return 0;
+  }
+}
+
+Value arrayGet(ObjArray *array, int index)
+{
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+    return BYTE_VAL((char)BYTES(array)[index]);
+  case VAL_INT:
+    return INT_VAL(INTS(array)[index]);
+  default:
+    return FLOAT_VAL(FLOATS(array)[index]);
+  }
+}
+
+void arraySet(ObjArray *array, int index, Value value)
+{
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+    BYTES(array)[index] = (int8_t)toInt(value);
+    break;
+  case VAL_INT:
+    INTS(array)[index] = toInt(value);
+    break;
+  default:
+    FLOATS(array)[index] = toFloat(value);
+    break;
+  }
+}
+
+Value arraySum(ObjArray *array)
+{
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+  {
+    int32_t sum = 0;
+    for (int i = 0; i < array->count; i++)
+      sum += BYTES(array)[i];
+    return INT_VAL(sum);
+  }
+  case VAL_INT:
+    return INT_VAL(activeKernels()->sumInt(INTS(array), array->count));
+  default:
+    return FLOAT_VAL(activeKernels()->sumFloat(FLOATS(array), array->count));
+  }
+}
+
+bool arrayRange(ObjArray *array, Value *min, Value *max)
+{
+  if (array->count == 0)
+    return false;
+
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+  {
+    int8_t low = BYTES(array)[0], high = BYTES(array)[0];
+    for (int i = 1; i < array->count; i++)
+    {
+      if (BYTES(array)[i] < low)
+        low = BYTES(array)[i];
+      if (BYTES(array)[i] > high)
+        high = BYTES(array)[i];
+    }
+    *min = BYTE_VAL((char)low);
+    *max = BYTE_VAL((char)high);
+    break;
+  }
+  case VAL_INT:
+  {
+    int32_t low, high;
+    activeKernels()->rangeInt(INTS(array), array->count, &low, &high);
+    *min = INT_VAL(low);
+    *max = INT_VAL(high);
+    break;
+  }
+  default:
+  {
+    float low, high;
+    activeKernels()->rangeFloat(FLOATS(array), array->count, &low, &high);
+    *min = FLOAT_VAL(low);
+    *max = FLOAT_VAL(high);
+    break;
+  }
+  }
+  return true;
+}
+
+Value arrayDot(ObjArray *a, ObjArray *b)
+{
+  switch (a->elementType)
+  {
+  case VAL_BYTE:
+  {
+    int32_t sum = 0;
+    for (int i = 0; i < a->count; i++)
+      sum += BYTES(a)[i] * BYTES(b)[i];
+    return INT_VAL(sum);
+  }
+  case VAL_INT:
+    return INT_VAL(activeKernels()->dotInt(INTS(a), INTS(b), a->count));
+  default:
+    return FLOAT_VAL(activeKernels()->dotFloat(FLOATS(a), FLOATS(b), a->count));
+  }
+}
+
+ObjArray *arrayAdd(ObjArray *a, ObjArray *b)
+{
+  ObjArray *result = newArray(a->elementType, a->count);
+  switch (a->elementType)
+  {
+  case VAL_BYTE:
+    activeKernels()->addByte(BYTES(result), BYTES(a), BYTES(b), a->count);
+    break;
+  case VAL_INT:
+    activeKernels()->addInt(INTS(result), INTS(a), INTS(b), a->count);
+    break;
+  default:
+    activeKernels()->addFloat(FLOATS(result), FLOATS(a), FLOATS(b), a->count);
+    break;
+  }
+  return result;
+}
+
+ObjArray *arrayMul(ObjArray *a, ObjArray *b)
+{
+  ObjArray *result = newArray(a->elementType, a->count);
+  switch (a->elementType)
+  {
+  case VAL_BYTE:
+    for (int i = 0; i < a->count; i++)
+      BYTES(result)[i] = (int8_t)(BYTES(a)[i] * BYTES(b)[i]);
+    break;
+  case VAL_INT:
+    activeKernels()->mulInt(INTS(result), INTS(a), INTS(b), a->count);
+    break;
+  default:
+    activeKernels()->mulFloat(FLOATS(result), FLOATS(a), FLOATS(b), a->count);
+    break;
+  }
+  return result;
+}
+
+void arrayFill(ObjArray *array, Value value)
+{
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+    memset(array->elements, (int8_t)toInt(value), array->count);
+    break;
+  case VAL_INT:
+  {
+    int32_t x = toInt(value);
+    for (int i = 0; i < array->count; i++)
+      INTS(array)[i] = x;
+    break;
+  }
+  default:
+  {
+    float x = toFloat(value);
+    for (int i = 0; i < array->count; i++)
+      FLOATS(array)[i] = x;
+    break;
+  }
+  }
+}
+
+ObjArray *arrayCompare(ObjArray *array, Value value, ArrayOp op)
+{
+  ObjArray *mask = newArray(VAL_BYTE, array->count);
+  uint8_t *out = (uint8_t *)mask->elements;
+
+  switch (array->elementType)
+  {
+  case VAL_BYTE:
+  {
+    // Same conversion as comparing a byte to a number in the interpreter.
+    int8_t x = (int8_t)toInt(value);
+    for (int i = 0; i < array->count; i++)
+    {
+      int8_t element = BYTES(array)[i];
+      out[i] = op == ARRAY_LESS      ? element < x
+               : op == ARRAY_GREATER ? element > x
+                                     : element == x;
+    }
+    break;
+  }
+  case VAL_INT:
+    activeKernels()->compareInt(out, INTS(array), array->count, toInt(value),
+                                op);
+    break;
+  default:
+    activeKernels()->compareFloat(out, FLOATS(array), array->count,
+                                  toFloat(value), op);
+    break;
+  }
+  return mask;
+}
+
+void printArray(ObjArray *array)
+{
+  printf("[");
+  for (int i = 0; i < array->count; i++)
+  {
+    if (i > 0)
+      printf(", ");
+    printValue(arrayGet(array, i));
+  }
+  printf("]");
+}
+
+typedef enum
+{
+  BENCH_SUM,
+  BENCH_DOT,
+  BENCH_ADD,
+  BENCH_LESS,
+  BENCH_COUNT,
+} BenchOp;
+
+static const char *benchName(BenchOp op)
+{
+  switch (op)
+  {
+  case BENCH_SUM:
+    return "sum";
+  case BENCH_DOT:
+    return "dot";
+  case BENCH_ADD:
+    return "add";
+  default:
+    return "less";
+  }
+}
+
+static double benchmarkOne(BenchOp op, ValueType type, ObjArray *a,
+                           ObjArray *b, ObjArray *out)
+{
+  // Run long enough to get a stable reading regardless of array length.
+  long iterations = (64L * 1024 * 1024) / a->count;
+  if (iterations < 16)
+    iterations = 16;
+
+  const ArrayKernels *k = activeKernels();
+  volatile float sink = 0;
+  clock_t start = clock();
+  for (long i = 0; i < iterations; i++)
+  {
+    switch (op)
+    {
+    case BENCH_SUM:
+      sink += type == VAL_INT ? (float)k->sumInt(INTS(a), a->count)
+                              : k->sumFloat(FLOATS(a), a->count);
+      break;
+    case BENCH_DOT:
+      sink += type == VAL_INT ? (float)k->dotInt(INTS(a), INTS(b), a->count)
+                              : k->dotFloat(FLOATS(a), FLOATS(b), a->count);
+      break;
+    case BENCH_ADD:
+      if (type == VAL_INT)
+        k->addInt(INTS(out), INTS(a), INTS(b), a->count);
+      else
+        k->addFloat(FLOATS(out), FLOATS(a), FLOATS(b), a->count);
+      sink += out->elements[i % a->count];
+      break;
+    default:
+      if (type == VAL_INT)
+        k->compareInt(out->elements, INTS(a), a->count, 0, ARRAY_LESS);
+      else
+        k->compareFloat(out->elements, FLOATS(a), a->count, 0, ARRAY_LESS);
+      sink += out->elements[i % a->count];
+      break;
+    }
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  (void)sink;
+
+  if (seconds <= 0)
+    return 0;
+  return (double)iterations * a->count / seconds / 1e9;
+}
+
+void benchmarkArray(FILE *out)
+{
+  const int count = 4096;
+  ArrayKernel previous = arrayKernel();
+
+  fprintf(out, "%12s", "op");
+  for (int kernel = ARRAY_KERNEL_SCALAR; kernel <= ARRAY_KERNEL_AVX2; kernel++)
+  {
+    if (kernelSupported((ArrayKernel)kernel))
+      fprintf(out, " %10s", arrayKernelName((ArrayKernel)kernel));
+  }
+  fprintf(out, "   (Gelem/s, %d elements)\n", count);
+
+  ValueType types[] = {VAL_INT, VAL_FLOAT};
+  for (int t = 0; t < 2; t++)
+  {
+    ObjArray *a = newArray(types[t], count);
+    ObjArray *b = newArray(types[t], count);
+    ObjArray *result = newArray(types[t], count);
+    #pragma GCC unroll 8
+    for (int i = 0; i < count; i++)
+    {
+      arraySet(a, i, INT_VAL((i * 37) % 101 - 50));
+      arraySet(b, i, INT_VAL((i * 13) % 7 - 3));
+    }
+
+    for (int op = BENCH_SUM; op < BENCH_COUNT; op++)
+    {
+      fprintf(out, "%6s %5s", benchName((BenchOp)op),
+              types[t] == VAL_INT ? "int" : "float");
+      for (int kernel = ARRAY_KERNEL_SCALAR; kernel <= ARRAY_KERNEL_AVX2;
+           kernel++)
+      {
+        if (!setArrayKernel((ArrayKernel)kernel))
+          continue;
+        fprintf(out, " %10.2f",
+                benchmarkOne((BenchOp)op, types[t], a, b, result));
+      }
+      fprintf(out, "\n");
+    }
+  }
+
+  setArrayKernel(previous);
+}
@@ -0,0 +1,57 @@
+#ifndef xasm_array_h
+#define xasm_array_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Operand of OP_ARRAY_OP.
+typedef enum
+{
+  ARRAY_SUM,
+  ARRAY_MIN,
+  ARRAY_MAX,
+  ARRAY_DOT,
+  ARRAY_ADD,
+  ARRAY_MUL,
+  ARRAY_FILL,
+  ARRAY_LESS,
+  ARRAY_GREATER,
+  ARRAY_EQUAL,
+} ArrayOp;
+
+typedef enum
+{
+  ARRAY_KERNEL_SCALAR,
+  ARRAY_KERNEL_SSE2,
+  ARRAY_KERNEL_AVX2,
+} ArrayKernel;
+
+// Element access. Indexes must already be bounds-checked, and stored values
+// are converted to the element type the same way arithmetic converts them.
+Value arrayGet(ObjArray *array, int index);
+void arraySet(ObjArray *array, int index, Value value);
+
+// Bulk operations. Binary ones expect arrays of the same type and length;
+// the comparisons return a byte array holding 1 where the element compares
+// true against the scalar and 0 elsewhere. Float sums and dot products
+// accumulate in 32 lanes on every kernel, so the result does not depend
+// on which kernel ran.
+Value arraySum(ObjArray *array);
+bool arrayRange(ObjArray *array, Value *min, Value *max);
+Value arrayDot(ObjArray *a, ObjArray *b);
+ObjArray *arrayAdd(ObjArray *a, ObjArray *b);
+ObjArray *arrayMul(ObjArray *a, ObjArray *b);
+void arrayFill(ObjArray *array, Value value);
+ObjArray *arrayCompare(ObjArray *array, Value value, ArrayOp op);
+void printArray(ObjArray *array);
+
+ArrayKernel arrayKernel();
+// Only changes the kernels of the calling thread.
+bool setArrayKernel(ArrayKernel kernel);
+const char *arrayKernelName(ArrayKernel kernel);
+void benchmarkArray(FILE *out);
+
+#endif
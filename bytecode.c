@@ -0,0 +1,904 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "bytecode.h"
+#include "host.h"
+#include "memory.h"
+#include "object.h"
+
+typedef struct
+{
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+// Appends length bytes, zeroed when bytes is NULL, and pads the buffer to a
+// multiple of 4. Returns the offset they start at.
+static uint32_t append(Buffer *buffer, const void *bytes, size_t length)
+{
+  size_t offset = buffer->count;
+  size_t padded = (length + 3) & ~(size_t)3;
+  if (buffer->capacity < offset + padded)
+  {
+    size_t capacity = buffer->capacity;
+    while (capacity < offset + padded)
+      capacity = GROW_CAPACITY(capacity);
+    buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes, buffer->capacity,
+                               capacity, MEM_OTHER);
+    buffer->capacity = capacity;
+  }
+
+  memset(buffer->bytes + offset, 0, padded);
+  if (bytes != NULL)
+    memcpy(buffer->bytes + offset, bytes, length);
+  buffer->count += padded;
+  return (uint32_t)offset;
+}
+
+static int comparePointers(const void *a, const void *b)
+{
+  uintptr_t left = (uintptr_t) * (void *const *)a;
+  uintptr_t right = (uintptr_t) * (void *const *)b;
+  return left < right ? -1 : left > right;
+}
+
+// Objects are numbered by their position in a sorted array of pointers.
+static uint32_t indexOf(void **objects, int count, void *object)
+{
+  void **found =
+      bsearch(&object, objects, count, sizeof(void *), comparePointers);
+  return (uint32_t)(found - objects);
+}
+
+static int sortUnique(void **objects, int count)
+{
+  qsort(objects, count, sizeof(void *), comparePointers);
+  int unique = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (unique == 0 || objects[unique - 1] != objects[i])
+      objects[unique++] = objects[i];
+  }
+  return unique;
+}
+
+typedef struct
+{
+  Chunk **chunks; // the script's first, then one per function
+  ObjFunction **functions;
+  int functionCount;
+  ObjString **strings;
+  int stringCount;
+  int stringCapacity;
+} Contents;
+
+static void addString(Contents *contents, ObjString *string)
+{
+  if (contents->stringCount == contents->stringCapacity)
+  {
+    int capacity = GROW_CAPACITY(contents->stringCapacity);
+    contents->strings = GROW_ARRAY(ObjString *, contents->strings,
+                                   contents->stringCapacity, capacity,
+                                   MEM_OTHER);
+    contents->stringCapacity = capacity;
+  }
+  contents->strings[contents->stringCount++] = string;
+}
+
+// Gathers the program's functions and the strings its code refers to.
+static bool gatherContents(Program *program, Contents *contents)
+{
+  int count = 0;
+  for (ObjFunction *function = program->home.functions; function != NULL;
+       function = function->nextFunction)
+    count++;
+
+  contents->functions = ALLOCATE(ObjFunction *, count, MEM_OTHER);
+  contents->functionCount = 0;
+  for (ObjFunction *function = program->home.functions; function != NULL;
+       function = function->nextFunction)
+    contents->functions[contents->functionCount++] = function;
+  qsort(contents->functions, count, sizeof(ObjFunction *), comparePointers);
+
+  contents->chunks = ALLOCATE(Chunk *, count + 1, MEM_OTHER);
+  contents->chunks[0] = &program->chunk;
+  for (int i = 0; i < count; i++)
+  {
+    contents->chunks[i + 1] = &contents->functions[i]->chunk;
+    if (contents->functions[i]->name != NULL)
+      addString(contents, contents->functions[i]->name);
+  }
+
+  for (int i = 0; i <= count; i++)
+  {
+    ValueArray *constants = &contents->chunks[i]->constants;
+    for (int j = 0; j < constants->count; j++)
+    {
+      Value value = constants->values[j];
+      if (!IS_OBJ(value))
+        continue;
+      if (IS_STRING(value))
+      {
+        addString(contents, AS_STRING(value));
+      }
+      else if (!IS_FUNCTION(value))
+      {
+        fprintf(stderr, "Constant of object type %d can't be written.\n",
+                OBJ_TYPE(value));
+        return false;
+      }
+    }
+  }
+  contents->stringCount =
+      sortUnique((void **)contents->strings, contents->stringCount);
+  return true;
+}
+
+static void freeContents(Contents *contents)
+{
+  FREE_ARRAY(Chunk *, contents->chunks, contents->functionCount + 1,
+             MEM_OTHER);
+  FREE_ARRAY(ObjFunction *, contents->functions, contents->functionCount,
+             MEM_OTHER);
+  FREE_ARRAY(ObjString *, contents->strings, contents->stringCapacity,
+             MEM_OTHER);
+}
+
+static BytecodeConstant encodeConstant(Contents *contents, Value value)
+{
+  BytecodeConstant constant = {CONSTANT_NIL, 0};
+  switch (value.type)
+  {
+  case VAL_NIL:
+    break;
+  case VAL_BOOL:
+    constant = (BytecodeConstant){CONSTANT_BOOL, AS_BOOL(value)};
+    break;
+  case VAL_BYTE:
+    constant = (BytecodeConstant){CONSTANT_BYTE, (uint8_t)value.as.byte};
+    break;
+  case VAL_INT:
+    constant = (BytecodeConstant){CONSTANT_INT, (uint32_t)value.as.i};
+    break;
+  case VAL_FLOAT:
+    constant.kind = CONSTANT_FLOAT;
+    memcpy(&constant.as, &value.as.f, sizeof(float));
+    break;
+  case VAL_OBJ:
+    if (IS_STRING(value))
+      constant = (BytecodeConstant){
+          CONSTANT_STRING, indexOf((void **)contents->strings,
+                                   contents->stringCount, AS_OBJ(value))};
+    else
+      constant = (BytecodeConstant){
+          CONSTANT_FUNCTION,
+          1 + indexOf((void **)contents->functions, contents->functionCount,
+                      AS_OBJ(value))};
+    break;
+  }
+  return constant;
+}
+
+static void writeFunction(Buffer *buffer, Contents *contents, int index,
+                          BytecodeFunction *entry)
+{
+  Chunk *chunk = contents->chunks[index];
+  ObjFunction *function = index > 0 ? contents->functions[index - 1] : NULL;
+  entry->name = function != NULL && function->name != NULL
+                    ? indexOf((void **)contents->strings,
+                              contents->stringCount, function->name)
+                    : BYTECODE_NO_NAME;
+  entry->arity = function != NULL ? (uint32_t)function->arity : 0;
+  entry->cacheCount = (uint32_t)chunk->cacheCount;
+
+  entry->codeOffset = append(buffer, chunk->code, chunk->count);
+  entry->codeLength = (uint32_t)chunk->count;
+
+  entry->linesOffset = (uint32_t)buffer->count;
+  entry->lineRunCount = 0;
+  for (int i = 0; i < chunk->count; i++)
+  {
+    if (i > 0 && chunk->lines[i] == chunk->lines[i - 1])
+      continue;
+    LineRun run = {(uint32_t)i, (uint32_t)chunk->lines[i]};
+    append(buffer, &run, sizeof(run));
+    entry->lineRunCount++;
+  }
+
+  entry->constantsOffset = (uint32_t)buffer->count;
+  entry->constantCount = (uint32_t)chunk->constants.count;
+  for (int i = 0; i < chunk->constants.count; i++)
+  {
+    BytecodeConstant constant =
+        encodeConstant(contents, chunk->constants.values[i]);
+    append(buffer, &constant, sizeof(constant));
+  }
+}
+
+bool writeBytecode(Program *program, FILE *out)
+{
+  Contents contents = {0};
+  if (!gatherContents(program, &contents))
+  {
+    freeContents(&contents);
+    return false;
+  }
+
+  Buffer buffer = {NULL, 0, 0};
+  append(&buffer, NULL, sizeof(BytecodeHeader));
+  BytecodeHeader header;
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.byteOrder = BYTECODE_BYTE_ORDER;
+
+  header.hostCount = (uint32_t)hostCount;
+  header.hostsOffset = (uint32_t)buffer.count;
+  for (int i = 0; i < hostCount; i++)
+  {
+    // Each is padded on its own; the loader skips the padding.
+    append(&buffer, hosts[i].name, strlen(hosts[i].name) + 1);
+    append(&buffer, hosts[i].signature, strlen(hosts[i].signature) + 1);
+  }
+
+  header.stringCount = (uint32_t)contents.stringCount;
+  header.stringsOffset = (uint32_t)buffer.count;
+  for (int i = 0; i < contents.stringCount; i++)
+  {
+    ObjString *string = contents.strings[i];
+    uint32_t prefix[2] = {stringHash(string), (uint32_t)string->length};
+    append(&buffer, prefix, sizeof(prefix));
+    append(&buffer, string->chars, string->length + 1);
+  }
+
+  int functionCount = contents.functionCount + 1;
+  header.functionCount = (uint32_t)functionCount;
+  header.functionsOffset =
+      append(&buffer, NULL, sizeof(BytecodeFunction) * functionCount);
+  for (int i = 0; i < functionCount; i++)
+  {
+    BytecodeFunction entry;
+    writeFunction(&buffer, &contents, i, &entry);
+    // The buffer may have moved.
+    memcpy(buffer.bytes + header.functionsOffset +
+               sizeof(BytecodeFunction) * i,
+           &entry, sizeof(entry));
+  }
+
+  bool ok = buffer.count <= UINT32_MAX;
+  if (ok)
+  {
+    header.fileSize = (uint32_t)buffer.count;
+    memcpy(buffer.bytes, &header, sizeof(header));
+    ok = fwrite(buffer.bytes, 1, buffer.count, out) == buffer.count;
+  }
+  else
+  {
+    fprintf(stderr, "Program too large for a bytecode file.\n");
+  }
+
+  FREE_ARRAY(uint8_t, buffer.bytes, buffer.capacity, MEM_OTHER);
+  freeContents(&contents);
+  return ok;
+}
+
+// Loading
+
+typedef struct
+{
+  const char *path;
+  const uint8_t *bytes;
+  size_t size;
+} Mapping;
+
+// Whether count elements of the given size fit in the file at offset, which
+// must be aligned for them.
+static bool fits(Mapping *file, uint32_t offset, uint32_t count, size_t size)
+{
+  return offset % 4 == 0 && offset <= file->size &&
+         count <= (file->size - offset) / size;
+}
+
+static const char *readCString(Mapping *file, uint32_t *offset)
+{
+  if (*offset >= file->size)
+    return NULL;
+  const char *start = (const char *)file->bytes + *offset;
+  const char *end = memchr(start, '\0', file->size - *offset);
+  if (end == NULL)
+    return NULL;
+  *offset += (uint32_t)((end - start + 1 + 3) & ~3);
+  return start;
+}
+
+static bool checkHosts(Mapping *file, BytecodeHeader *header)
+{
+  uint32_t offset = header->hostsOffset;
+  for (uint32_t i = 0; i < header->hostCount; i++)
+  {
+    const char *name = readCString(file, &offset);
+    const char *signature = name != NULL ? readCString(file, &offset) : NULL;
+    if (signature == NULL)
+      return false;
+    if ((int)i >= hostCount || strcmp(hosts[i].name, name) != 0 ||
+        strcmp(hosts[i].signature, signature) != 0)
+    {
+      fprintf(stderr,
+              "\"%s\" was compiled against host function %u %s(%s), which "
+              "is not defined the same way now.\n",
+              file->path, i, name, signature);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Interns the string pool in the program's VM, sizing its table once, and
+// fills strings with them in order.
+static bool loadStrings(Mapping *file, BytecodeHeader *header, VM *home,
+                        ObjString **strings)
+{
+  tableReserve(&home->strings, (int)header->stringCount);
+
+  uint32_t offset = header->stringsOffset;
+  for (uint32_t i = 0; i < header->stringCount; i++)
+  {
+    uint32_t prefix[2];
+    if (!fits(file, offset, 2, sizeof(uint32_t)))
+      return false;
+    memcpy(prefix, file->bytes + offset, sizeof(prefix));
+    offset += sizeof(prefix);
+    uint32_t length = prefix[1];
+    if (length >= INT32_MAX || !fits(file, offset, length + 1, 1) ||
+        file->bytes[offset + length] != '\0')
+      return false;
+
+    strings[i] = copyHashedString(home, (const char *)file->bytes + offset,
+                                  (int)length, prefix[0]);
+    offset += (length + 1 + 3) & ~3u;
+  }
+  return true;
+}
+
+static bool loadConstant(BytecodeConstant *constant, ObjString **strings,
+                         BytecodeHeader *header, ObjFunction **functions,
+                         Value *value)
+{
+  switch (constant->kind)
+  {
+  case CONSTANT_NIL:
+    *value = NIL_VAL;
+    return true;
+  case CONSTANT_BOOL:
+    *value = BOOL_VAL(constant->as != 0);
+    return true;
+  case CONSTANT_BYTE:
+    *value = BYTE_VAL((uint8_t)constant->as);
+    return true;
+  case CONSTANT_INT:
+    *value = INT_VAL((int32_t)constant->as);
+    return true;
+  case CONSTANT_FLOAT:
+  {
+    float number;
+    memcpy(&number, &constant->as, sizeof(float));
+    *value = FLOAT_VAL(number);
+    return true;
+  }
+  case CONSTANT_STRING:
+    if (constant->as >= header->stringCount)
+      return false;
+    *value = OBJ_VAL(strings[constant->as]);
+    return true;
+  case CONSTANT_FUNCTION:
+    if (constant->as == 0 || constant->as >= header->functionCount)
+      return false;
+    *value = OBJ_VAL(functions[constant->as]);
+    return true;
+  }
+  return false;
+}
+
+// The length of the instruction at offset with its operands, or 0 when its
+// opcode is unknown or it runs past the end of the code.
+static int instructionLength(Chunk *chunk, int offset)
+{
+  int length;
+  switch (chunk->code[offset])
+  {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_LOOP:
+    length = 3;
+    break;
+  case OP_MAP_NEXT:
+  case OP_GET_FIELD:
+  case OP_SET_FIELD:
+    length = 4;
+    break;
+  case OP_PARALLEL:
+    if (offset + 2 >= chunk->count)
+      return 0;
+    length = 3 + chunk->code[offset + 2];
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_YEET:
+  case OP_PARALLEL_DONE:
+  case OP_ARRAY_NEW:
+  case OP_ARRAY_OP:
+  case OP_STRING_OP:
+  case OP_CLASS:
+  case OP_FIELD:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_HOST:
+    length = 2;
+    break;
+  default:
+    if (chunk->code[offset] > OP_PRINT)
+      return 0;
+    length = 1;
+    break;
+  }
+  return length <= chunk->count - offset ? length : 0;
+}
+
+static uint16_t readShort(const uint8_t *bytes)
+{
+  return (uint16_t)(bytes[0] << 8 | bytes[1]);
+}
+
+// Where the jump at offset goes, or -1 when it is not a jump.
+static int jumpTarget(Chunk *chunk, int offset)
+{
+  const uint8_t *operands = chunk->code + offset + 1;
+  int next = offset + instructionLength(chunk, offset);
+  switch (chunk->code[offset])
+  {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    return next + readShort(operands);
+  case OP_LOOP:
+    return next - readShort(operands);
+  case OP_MAP_NEXT:
+    return next + readShort(operands + 1);
+  default:
+    return -1;
+  }
+}
+
+static bool isConstant(Chunk *chunk, uint8_t index, ObjType type)
+{
+  return index < chunk->constants.count &&
+         isObjType(chunk->constants.values[index], type);
+}
+
+static bool isTarget(Chunk *chunk, const bool *starts, int target)
+{
+  return target >= 0 && target < chunk->count && starts[target];
+}
+
+// Checks the operands the VM uses without looking: constants of the kind the
+// instruction reads, caches and hosts that exist, enum operands in range and
+// jumps that land on an instruction.
+static bool checkOperands(Chunk *chunk, int offset, const bool *starts,
+                          uint32_t hostCount)
+{
+  const uint8_t *operands = chunk->code + offset + 1;
+  switch (chunk->code[offset])
+  {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_LOOP:
+  case OP_MAP_NEXT:
+    return isTarget(chunk, starts, jumpTarget(chunk, offset));
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_CLASS:
+  case OP_FIELD:
+    return isConstant(chunk, operands[0], OBJ_STRING);
+  case OP_GET_FIELD:
+  case OP_SET_FIELD:
+    return isConstant(chunk, operands[0], OBJ_STRING) &&
+           readShort(operands + 1) < chunk->cacheCount;
+  case OP_YEET:
+    return operands[0] < chunk->constants.count;
+  case OP_PARALLEL:
+    if (!isConstant(chunk, operands[0], OBJ_FUNCTION) ||
+        operands[1] > PARALLEL_ACCUMULATORS_MAX)
+      return false;
+    for (int i = 0; i < operands[1]; i++)
+    {
+      if (operands[2 + i] > REDUCE_MAX)
+        return false;
+    }
+    return true;
+  case OP_PARALLEL_DONE:
+    return operands[0] <= PARALLEL_ACCUMULATORS_MAX;
+  case OP_ARRAY_NEW:
+    return operands[0] == VAL_BYTE || operands[0] == VAL_INT ||
+           operands[0] == VAL_FLOAT;
+  case OP_ARRAY_OP:
+    return operands[0] <= ARRAY_EQUAL;
+  case OP_STRING_OP:
+    return operands[0] <= STRING_TRIM;
+  case OP_HOST:
+    return operands[0] < hostCount;
+  default:
+    return true;
+  }
+}
+
+// Checks that the frame holds the depth values the instruction at offset
+// reads, its local slots included, and sets *after to the depth it leaves.
+// Slot 0, the callee, is never popped.
+static bool stackEffect(Chunk *chunk, int offset, int depth, int *after)
+{
+  const uint8_t *operands = chunk->code + offset + 1;
+  int pops = 0;
+  int pushes = 0;
+  switch (chunk->code[offset])
+  {
+  case OP_GET_LOCAL:
+    if (operands[0] >= depth)
+      return false;
+    pushes = 1;
+    break;
+  case OP_SET_LOCAL:
+    if (operands[0] >= depth)
+      return false;
+    pops = pushes = 1;
+    break;
+  case OP_MAP_NEXT:
+    // The map, its cursor, the key and the value.
+    if (operands[0] + 4 > depth)
+      return false;
+    break;
+  case OP_PARALLEL_DONE:
+    // The accumulators follow the body and its two bounds.
+    if (3 + operands[0] > depth)
+      return false;
+    break;
+  case OP_GET_GLOBAL:
+  case OP_YEET:
+  case OP_MAP_NEW:
+  case OP_CLASS:
+  case OP_RAND:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_PAUSE:
+  case OP_HALT:
+    pushes = 1;
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_POP:
+  case OP_PRINT:
+  case OP_RET:
+    pops = 1;
+    break;
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_SET_GLOBAL:
+  case OP_ARRAY_NEW:
+  case OP_FIELD:
+  case OP_GET_FIELD:
+  case OP_RANDSEED:
+  case OP_RANDMAX:
+  case OP_RANDFILL:
+  case OP_LEN:
+  case OP_NEG:
+  case OP_NOT:
+  case OP_SPAWN:
+  case OP_UNHALT:
+  case OP_RECV:
+    pops = pushes = 1;
+    break;
+  case OP_GET_INDEX:
+  case OP_SET_FIELD:
+  case OP_RANDRANGE:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_SEND:
+    pops = 2;
+    pushes = 1;
+    break;
+  case OP_DELETE_INDEX:
+    pops = 2;
+    break;
+  case OP_MAP_INSERT:
+  case OP_SET_INDEX:
+    pops = 3;
+    pushes = 1;
+    break;
+  case OP_ARRAY_OP:
+    pops = operands[0] == ARRAY_SUM || operands[0] == ARRAY_MIN ||
+                   operands[0] == ARRAY_MAX
+               ? 1
+               : 2;
+    pushes = 1;
+    break;
+  case OP_STRING_OP:
+    pops = operands[0] == STRING_SUBSTRING ? 3
+           : operands[0] == STRING_SPLIT   ? 2
+                                           : 1;
+    pushes = 1;
+    break;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    pops = operands[0] + 1;
+    pushes = 1;
+    break;
+  case OP_HOST:
+    pops = hosts[operands[0]].arity;
+    pushes = 1;
+    break;
+  case OP_PARALLEL:
+    // The bounds go; the accumulators are combined in place.
+    pops = operands[1] + 2;
+    pushes = operands[1];
+    break;
+  default:
+    break;
+  }
+
+  *after = depth - pops + pushes;
+  return pops < depth;
+}
+
+// Queues offset to be checked at depth, the first time a path reaches it.
+// Every later path must arrive with the same depth.
+static bool reach(int *depths, int *pending, int *pendingCount, int offset,
+                  int depth)
+{
+  if (depths[offset] < 0)
+  {
+    depths[offset] = depth;
+    pending[(*pendingCount)++] = offset;
+    return true;
+  }
+  return depths[offset] == depth;
+}
+
+// Follows every path through the code from a frame holding the callee and
+// its arguments, so none pops below the frame, reads a slot it has not
+// pushed, or runs off the end of the code.
+static bool checkStack(Chunk *chunk, int arity)
+{
+  int *depths = ALLOCATE(int, chunk->count, MEM_OTHER);
+  int *pending = ALLOCATE(int, chunk->count, MEM_OTHER);
+  for (int i = 0; i < chunk->count; i++)
+    depths[i] = -1;
+  int pendingCount = 0;
+  bool ok = reach(depths, pending, &pendingCount, 0, 1 + arity);
+
+  while (ok && pendingCount > 0)
+  {
+    int offset = pending[--pendingCount];
+    int depth;
+    ok = stackEffect(chunk, offset, depths[offset], &depth);
+
+    uint8_t instruction = chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    if (ok && instruction != OP_RET && instruction != OP_EXIT &&
+        instruction != OP_JUMP && instruction != OP_LOOP)
+      ok = next < chunk->count &&
+           reach(depths, pending, &pendingCount, next, depth);
+
+    int target = jumpTarget(chunk, offset);
+    if (ok && target >= 0)
+      ok = reach(depths, pending, &pendingCount, target, depth);
+  }
+
+  FREE_ARRAY(int, depths, chunk->count, MEM_OTHER);
+  FREE_ARRAY(int, pending, chunk->count, MEM_OTHER);
+  return ok;
+}
+
+// Walks the code once to find where its instructions start, again to check
+// their operands, and then along every path to check the stack.
+static bool verifyCode(Chunk *chunk, int arity, uint32_t hostCount)
+{
+  if (chunk->count == 0)
+    return false;
+
+  bool *starts = ALLOCATE(bool, chunk->count, MEM_OTHER);
+  memset(starts, 0, sizeof(bool) * chunk->count);
+  bool ok = true;
+  for (int offset = 0; offset < chunk->count && ok;)
+  {
+    int length = instructionLength(chunk, offset);
+    ok = length > 0;
+    starts[offset] = true;
+    offset += length;
+  }
+
+  for (int offset = 0; offset < chunk->count && ok;
+       offset += instructionLength(chunk, offset))
+    ok = checkOperands(chunk, offset, starts, hostCount);
+
+  FREE_ARRAY(bool, starts, chunk->count, MEM_OTHER);
+  return ok && checkStack(chunk, arity);
+}
+
+// Points chunk at its code and line runs in the file, builds its constants
+// and verifies its code.
+static bool loadChunk(Mapping *file, BytecodeHeader *header,
+                      BytecodeFunction *entry, ObjString **strings,
+                      ObjFunction **functions, Chunk *chunk)
+{
+  if (entry->codeLength > INT32_MAX || entry->codeOffset > file->size ||
+      entry->codeLength > file->size - entry->codeOffset ||
+      !fits(file, entry->linesOffset, entry->lineRunCount, sizeof(LineRun)) ||
+      !fits(file, entry->constantsOffset, entry->constantCount,
+            sizeof(BytecodeConstant)) ||
+      entry->constantCount > UINT8_COUNT || entry->cacheCount > INT32_MAX ||
+      entry->arity > UINT8_MAX)
+    return false;
+
+  chunk->code = (uint8_t *)file->bytes + entry->codeOffset;
+  chunk->count = (int)entry->codeLength;
+  chunk->lineRuns = (const LineRun *)(file->bytes + entry->linesOffset);
+  chunk->lineRunCount = (int)entry->lineRunCount;
+  chunk->cacheCount = (int)entry->cacheCount;
+
+  ValueArray *constants = &chunk->constants;
+  constants->values =
+      ALLOCATE(Value, entry->constantCount, MEM_CONSTANTS);
+  constants->capacity = (int)entry->constantCount;
+  const BytecodeConstant *encoded =
+      (const BytecodeConstant *)(file->bytes + entry->constantsOffset);
+  for (uint32_t i = 0; i < entry->constantCount; i++)
+  {
+    BytecodeConstant constant = encoded[i];
+    if (!loadConstant(&constant, strings, header, functions,
+                      &constants->values[i]))
+      return false;
+    constants->count++;
+  }
+  return verifyCode(chunk, (int)entry->arity, header->hostCount);
+}
+
+static bool loadFunctions(Mapping *file, BytecodeHeader *header,
+                          ObjString **strings, Program *program)
+{
+  const BytecodeFunction *entries =
+      (const BytecodeFunction *)(file->bytes + header->functionsOffset);
+  // Made up front, since any constant may refer to any of them. Slot 0, the
+  // script, has no function.
+  ObjFunction **functions =
+      ALLOCATE(ObjFunction *, header->functionCount, MEM_OTHER);
+  functions[0] = NULL;
+  for (uint32_t i = 1; i < header->functionCount; i++)
+    functions[i] = newFunction();
+
+  bool ok = true;
+  for (uint32_t i = 0; i < header->functionCount && ok; i++)
+  {
+    BytecodeFunction entry = entries[i];
+    Chunk *chunk = i == 0 ? &program->chunk : &functions[i]->chunk;
+    ok = loadChunk(file, header, &entry, strings, functions, chunk);
+    if (ok && i > 0)
+    {
+      ok = entry.name == BYTECODE_NO_NAME || entry.name < header->stringCount;
+      functions[i]->arity = (int)entry.arity;
+      functions[i]->name =
+          entry.name == BYTECODE_NO_NAME ? NULL : strings[entry.name];
+    }
+  }
+
+  FREE_ARRAY(ObjFunction *, functions, header->functionCount, MEM_OTHER);
+  return ok;
+}
+
+static bool mapFile(const char *path, Mapping *file)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  bool ok = fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(BytecodeHeader);
+  if (ok)
+  {
+    file->size = (size_t)info.st_size;
+    void *bytes = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = bytes != MAP_FAILED;
+    file->bytes = ok ? bytes : NULL;
+  }
+  close(fd);
+  return ok;
+}
+
+Program *loadBytecode(const char *path)
+{
+  Mapping file = {path, NULL, 0};
+  if (!mapFile(path, &file))
+  {
+    fprintf(stderr, "Could not map bytecode file \"%s\".\n", path);
+    return NULL;
+  }
+
+  BytecodeHeader header;
+  memcpy(&header, file.bytes, sizeof(header));
+  if (memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.byteOrder != BYTECODE_BYTE_ORDER ||
+      header.version != BYTECODE_VERSION)
+  {
+    fprintf(stderr, "\"%s\" is not bytecode of version %d for this machine.\n",
+            path, BYTECODE_VERSION);
+    munmap((void *)file.bytes, file.size);
+    return NULL;
+  }
+  // Each string takes at least its hash and length, so a count the file
+  // has no room for is caught before the pool is allocated.
+  if (header.fileSize != file.size || header.functionCount == 0 ||
+      !fits(&file, header.functionsOffset, header.functionCount,
+            sizeof(BytecodeFunction)) ||
+      !fits(&file, header.stringsOffset, header.stringCount,
+            2 * sizeof(uint32_t)))
+  {
+    fprintf(stderr, "Bytecode file \"%s\" is malformed.\n", path);
+    munmap((void *)file.bytes, file.size);
+    return NULL;
+  }
+  if (!checkHosts(&file, &header))
+  {
+    munmap((void *)file.bytes, file.size);
+    return NULL;
+  }
+
+  Program *program = ALLOCATE(Program, 1, MEM_OTHER);
+  initVM(&program->home);
+  initChunk(&program->chunk);
+  program->mapping = (void *)file.bytes;
+  program->mappingSize = file.size;
+
+  VM *previous = vm;
+  switchVM(&program->home);
+  ObjString **strings =
+      ALLOCATE(ObjString *, header.stringCount, MEM_OTHER);
+  bool ok = loadStrings(&file, &header, &program->home, strings) &&
+            loadFunctions(&file, &header, strings, program);
+  FREE_ARRAY(ObjString *, strings, header.stringCount, MEM_OTHER);
+  switchVM(previous);
+
+  if (!ok)
+  {
+    fprintf(stderr, "Bytecode file \"%s\" is malformed.\n", path);
+    freeProgram(program);
+    return NULL;
+  }
+  finishProgram(program);
+  return program;
+}
+
+bool isBytecodeFile(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  char magic[4];
+  bool bytecode = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                  memcmp(magic, BYTECODE_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return bytecode;
+}
@@ -0,0 +1,88 @@
+#ifndef xasm_bytecode_h
+#define xasm_bytecode_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define BYTECODE_MAGIC "XBC"
+// Bumped whenever the layout, the instruction set or hashBytes() changes.
+#define BYTECODE_VERSION 1
+#define BYTECODE_BYTE_ORDER 0x01020304u
+#define BYTECODE_NO_NAME UINT32_MAX
+
+// A compiled program as written by `xasm --compile`. Every section starts
+// at a multiple of 4 bytes, in the byte order of the machine that wrote it,
+// and offsets count from the start of the file:
+//
+//   header
+//   hosts      hostCount pairs of NUL-terminated name and signature: the
+//              host functions the calls in the code were resolved against
+//   strings    stringCount of: uint32 hash, uint32 length, the characters
+//              and a NUL, padded to 4 bytes
+//   functions  functionCount BytecodeFunction; the first is the script
+//   then, per function, its code, its LineRuns and its constants
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t fileSize;
+  uint32_t hostCount;
+  uint32_t hostsOffset;
+  uint32_t stringCount;
+  uint32_t stringsOffset;
+  uint32_t functionCount;
+  uint32_t functionsOffset;
+} BytecodeHeader;
+
+typedef struct
+{
+  uint32_t name; // string index, or BYTECODE_NO_NAME for the script
+  uint32_t arity;
+  uint32_t cacheCount;
+  uint32_t codeOffset;
+  uint32_t codeLength;
+  uint32_t linesOffset;
+  uint32_t lineRunCount;
+  uint32_t constantsOffset;
+  uint32_t constantCount;
+} BytecodeFunction;
+
+typedef enum
+{
+  CONSTANT_NIL,
+  CONSTANT_BOOL,
+  CONSTANT_BYTE,
+  CONSTANT_INT,
+  CONSTANT_FLOAT,
+  CONSTANT_STRING,   // as is a string index
+  CONSTANT_FUNCTION, // as is a function index
+} ConstantKind;
+
+typedef struct
+{
+  uint32_t kind;
+  uint32_t as; // the value's bits, or an index
+} BytecodeConstant;
+
+// Writes program in the format above. Returns false, after reporting why,
+// when it holds a constant the format has no room for.
+bool writeBytecode(Program *program, FILE *out);
+// Maps a file written by writeBytecode() and makes a program that runs its
+// code where it lies, only interning its strings and building its
+// functions' constants. The file must not change while the program is in
+// use. Returns NULL, after reporting why, when the file is unreadable,
+// malformed, from another version, or compiled against other host
+// functions than the ones defined now, or when its code does not verify:
+// every instruction must be known, with constants of the right kind, field
+// caches and hosts that exist and jumps onto instructions, and every path
+// must keep the stack depth consistent, stay within its frame and end in a
+// return, exit or jump. The types of stack values are not tracked, and a
+// few instructions, such as OP_MAP_INSERT and OP_FIELD, take their operand's
+// type on trust, so load only files from a trusted compiler.
+Program *loadBytecode(const char *path);
+bool isBytecodeFile(const char *path);
+
+#endif
@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+Channel *newChannel(int capacity)
+{
+  int rounded = 1;
+  while (rounded < capacity)
+    rounded *= 2;
+
+  Channel *channel = ALLOCATE(Channel, 1, MEM_OTHER);
+  channel->capacity = rounded;
+  channel->slots = ALLOCATE(Message, rounded, MEM_OTHER);
+  channel->head = 0;
+  channel->tail = 0;
+  channel->sendWaiter = NULL;
+  channel->receiveWaiter = NULL;
+  return channel;
+}
+
+void freeChannel(Channel *channel)
+{
+  for (size_t i = channel->head; i != channel->tail; i++)
+  {
+    Message *message = &channel->slots[i & (channel->capacity - 1)];
+    if (message->chars != NULL)
+      FREE_ARRAY(char, message->chars, message->length + 1, MEM_STRING_CHARS);
+  }
+  FREE_ARRAY(Message, channel->slots, channel->capacity, MEM_OTHER);
+  FREE(Channel, channel, MEM_OTHER);
+}
+
+Value channelValue(VM *instance, Channel *channel)
+{
+  VM *previous = vm;
+  switchVM(instance);
+  Value value = OBJ_VAL(wrapChannel(channel));
+  switchVM(previous);
+  return value;
+}
+
+// Wakes the VM waiting on the other side, if any. The index was just
+// stored sequentially consistent, and so was the waiter before it looked
+// at the index again, so either it saw our change or we see it here.
+static void notifyWaiter(VM **waiter)
+{
+  if (__atomic_load_n(waiter, __ATOMIC_SEQ_CST) == NULL)
+    return;
+
+  VM *instance = __atomic_exchange_n(waiter, NULL, __ATOMIC_SEQ_CST);
+  if (instance != NULL)
+    notifyVM(instance);
+}
+
+ChannelResult channelSend(Channel *channel, Value value)
+{
+  if (IS_OBJ(value) && !IS_TEXT(value))
+    return CHANNEL_UNSENDABLE;
+
+  size_t tail = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&channel->head, __ATOMIC_ACQUIRE);
+  if (tail - head == (size_t)channel->capacity)
+    return CHANNEL_FULL;
+
+  Message *message = &channel->slots[tail & (channel->capacity - 1)];
+  *message = (Message){value, NULL, 0};
+  if (IS_OBJ(value))
+  {
+    ObjString *string = flattenText(AS_OBJ(value));
+    message->length = string->length;
+    message->chars = ALLOCATE(char, string->length + 1, MEM_STRING_CHARS);
+    memcpy(message->chars, string->chars, string->length + 1);
+  }
+
+  __atomic_store_n(&channel->tail, tail + 1, __ATOMIC_SEQ_CST);
+  notifyWaiter(&channel->receiveWaiter);
+  return CHANNEL_OK;
+}
+
+ChannelResult channelReceive(Channel *channel, Value *value)
+{
+  size_t head = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return CHANNEL_EMPTY;
+
+  Message message = channel->slots[head & (channel->capacity - 1)];
+  __atomic_store_n(&channel->head, head + 1, __ATOMIC_SEQ_CST);
+  notifyWaiter(&channel->sendWaiter);
+
+  if (message.chars != NULL)
+  {
+    // Left uninterned, so a stage that only passes messages on does not
+    // grow its string table with each one.
+    *value = OBJ_VAL(copyRuntimeString(vm, message.chars, message.length));
+    FREE_ARRAY(char, message.chars, message.length + 1, MEM_STRING_CHARS);
+  }
+  else
+  {
+    *value = message.value;
+  }
+  return CHANNEL_OK;
+}
+
+bool channelWait(Channel *channel, bool sending)
+{
+  VM **waiter = sending ? &channel->sendWaiter : &channel->receiveWaiter;
+  __atomic_store_n(waiter, vm, __ATOMIC_SEQ_CST);
+
+  size_t head = __atomic_load_n(&channel->head, __ATOMIC_SEQ_CST);
+  size_t tail = __atomic_load_n(&channel->tail, __ATOMIC_SEQ_CST);
+  bool blocked =
+      sending ? tail - head == (size_t)channel->capacity : head == tail;
+  if (blocked)
+    return true;
+
+  // Take the registration back unless the other side already did, in which
+  // case its notification is only a spurious retry.
+  VM *expected = vm;
+  __atomic_compare_exchange_n(waiter, &expected, NULL, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  return false;
+}
@@ -0,0 +1,57 @@
+#ifndef xasm_channel_h
+#define xasm_channel_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// A message in transit. Strings are copied out of the sender's heap into
+// chars and become strings of the receiver's heap when received.
+typedef struct
+{
+  Value value;
+  char *chars;
+  int length;
+} Message;
+
+typedef enum
+{
+  CHANNEL_OK,
+  CHANNEL_FULL,
+  CHANNEL_EMPTY,
+  CHANNEL_UNSENDABLE, // not a number, boolean, nil or text
+} ChannelResult;
+
+// A bounded queue of values from one VM to another, which may be running
+// on another thread. It is a single-producer, single-consumer ring: one VM
+// sends and one VM receives at a time, and neither side takes a lock.
+// head and tail only grow and sit on cache lines of their own. A VM whose
+// coroutines wait on a full or empty channel leaves itself in sendWaiter
+// or receiveWaiter, and the other side notifies it (see notifyVM()) once
+// it has made room or sent something.
+struct Channel
+{
+  int capacity;
+  Message *slots;
+  _Alignas(64) size_t head; // next message to receive, moved by the receiver
+  _Alignas(64) size_t tail; // next free slot, moved by the sender
+  _Alignas(64) VM *sendWaiter;
+  VM *receiveWaiter;
+};
+
+// capacity is rounded up to a power of two.
+Channel *newChannel(int capacity);
+// Frees the channel and any messages still in it. No VM may use it again.
+void freeChannel(Channel *channel);
+// A value for the channel in the given VM, to hand to its scripts.
+Value channelValue(VM *instance, Channel *channel);
+
+// Called on the current VM.
+ChannelResult channelSend(Channel *channel, Value value);
+ChannelResult channelReceive(Channel *channel, Value *value);
+// Leaves the current VM as the waiter on the sending or receiving side, and
+// returns false instead when the channel changed meanwhile and the
+// operation should just be tried again.
+bool channelWait(Channel *channel, bool sending);
+
+#endif
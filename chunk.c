@@ -9,7 +9,14 @@ void initChunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineRuns = NULL;
+  chunk->lineRunCount = 0;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->shared = false;
+  chunk->cacheBase = 0;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
@@ -17,8 +24,10 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity,
+                   MEM_CHUNK_CODE);
+    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity,
+                              MEM_LINE_TABLE);
   }
 
   chunk->code[chunk->count] = byte;
@@ -27,13 +36,49 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 }
 
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // Mapped code and line runs belong to the program's mapping.
+  if (chunk->capacity > 0) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity, MEM_CHUNK_CODE);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity, MEM_LINE_TABLE);
+  }
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(FieldCache, chunk->caches, chunk->cacheCapacity, MEM_CHUNK_CODE);
   initChunk(chunk);
 }
 
 int addConstant(Chunk *chunk, Value value) {
   writeValueArray(&chunk->constants, value);
   return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int addFieldCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(FieldCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity, MEM_CHUNK_CODE);
+  }
+
+  FieldCache *cache = &chunk->caches[chunk->cacheCount];
+  cache->shape = NULL;
+  cache->next = NULL;
+  cache->slot = 0;
+  return chunk->cacheCount++;
+}
+
+int getLine(Chunk *chunk, int offset) {
+  if (chunk->lines != NULL)
+    return chunk->lines[offset];
+
+  // The last run starting at or before offset.
+  int low = 0;
+  int high = chunk->lineRunCount;
+  while (high - low > 1) {
+    int middle = low + (high - low) / 2;
+    if (chunk->lineRuns[middle].offset <= (uint32_t)offset)
+      low = middle;
+    else
+      high = middle;
+  }
+  return chunk->lineRunCount > 0 ? (int)chunk->lineRuns[low].line : 0;
+}
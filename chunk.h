@@ -15,6 +15,11 @@ typedef enum
   OP_PAUSE,
   OP_HALT,
   OP_UNHALT,
+  OP_SPAWN,
+  OP_SEND,
+  OP_RECV,
+  OP_PARALLEL,
+  OP_PARALLEL_DONE,
 
   OP_NOP,
 
@@ -53,12 +58,31 @@ typedef enum
   OP_SWAP,
   OP_REMOVE,
 
+  OP_MAP_NEW,
+  OP_MAP_INSERT,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  OP_DELETE_INDEX,
+  OP_MAP_NEXT,
+
+  OP_ARRAY_NEW,
+  OP_ARRAY_OP,
+  OP_LEN,
+  OP_STRING_OP,
+
+  OP_CLASS,
+  OP_FIELD,
+  OP_GET_FIELD,
+  OP_SET_FIELD,
+
   OP_RAND,
   OP_RANDSEED,
   OP_RANDMAX,
   OP_RANDRANGE,
+  OP_RANDFILL,
 
   OP_CALL,
+  OP_TAIL_CALL,
   OP_RET,
   OP_BRP,
   OP_REQ,
@@ -66,18 +90,48 @@ typedef enum
   OP_PRINT,
 } OpCode;
 
+// A monomorphic inline cache for one field access site. It remembers the
+// shape last seen there and the slot the field had in it. For a store that
+// added the field, next is the shape the instance moved to.
+typedef struct
+{
+  ObjShape *shape;
+  ObjShape *next;
+  int slot;
+} FieldCache;
+
+// The line of the instructions from offset up to the next run's offset.
+typedef struct
+{
+  uint32_t offset;
+  uint32_t line;
+} LineRun;
+
 typedef struct
 {
   int count;
   int capacity;
   uint8_t *code;
   int *lines;
+  // A chunk loaded from a bytecode file has its code in the file's mapping
+  // (capacity is 0) and its lines as runs instead of one per byte.
+  const LineRun *lineRuns;
+  int lineRunCount;
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  FieldCache *caches;
+  // Set on the chunks of a shared Program. Their caches live in each VM
+  // running the program, starting at cacheBase, and caches is unused.
+  bool shared;
+  int cacheBase;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int addFieldCache(Chunk *chunk);
+int getLine(Chunk *chunk, int offset);
 void freeChunk(Chunk *chunk);
 
 #endif
\ No newline at end of file
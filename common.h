@@ -8,6 +8,18 @@
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// Only compile-time literals and identifiers are interned up front; strings
+// built at runtime are hashed and interned on demand.
+#define LAZY_STRING_INTERNING
+
+// Use the group-probed table with control bytes instead of plain linear
+// probing for Table.
+#define SWISS_TABLE
+
+// Charge fuel at backward branches and calls, so a host can bound how long
+// a script runs before run() hands control back (see setFuel()).
+#define FUEL_METERING
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
@@ -2,8 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "array.h"
 #include "common.h"
 #include "compiler.h"
+#include "host.h"
+#include "object.h"
+#include "parallel.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -15,6 +19,8 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  int lastIndexGet;
+  int lastCall;
 } Parser;
 
 typedef enum {
@@ -53,19 +59,71 @@ typedef struct {
   AssignRule assignRule;
 } Local;
 
-typedef struct {
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_PARALLEL, // the body of a parallel for
+  TYPE_SCRIPT,
+} FunctionType;
+
+typedef struct Compiler {
+  struct Compiler *enclosing;
+  ObjFunction *function;
+  FunctionType type;
+  Chunk *chunk;
+
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
 } Compiler;
 
-Parser parser;
+// A function-like operation that compiles straight to an instruction, such
+// as intArray(n) or sum(a). operand is emitted after the opcode unless it is
+// negative.
+typedef struct {
+  const char *name;
+  OpCode opcode;
+  int operand;
+  int arity;
+} Builtin;
+
+static const Builtin builtins[] = {
+    {"intArray", OP_ARRAY_NEW, VAL_INT, 1},
+    {"floatArray", OP_ARRAY_NEW, VAL_FLOAT, 1},
+    {"byteArray", OP_ARRAY_NEW, VAL_BYTE, 1},
+    {"len", OP_LEN, -1, 1},
+    {"sum", OP_ARRAY_OP, ARRAY_SUM, 1},
+    {"min", OP_ARRAY_OP, ARRAY_MIN, 1},
+    {"max", OP_ARRAY_OP, ARRAY_MAX, 1},
+    {"dot", OP_ARRAY_OP, ARRAY_DOT, 2},
+    {"add", OP_ARRAY_OP, ARRAY_ADD, 2},
+    {"mul", OP_ARRAY_OP, ARRAY_MUL, 2},
+    {"fill", OP_ARRAY_OP, ARRAY_FILL, 2},
+    {"lessMask", OP_ARRAY_OP, ARRAY_LESS, 2},
+    {"greaterMask", OP_ARRAY_OP, ARRAY_GREATER, 2},
+    {"equalMask", OP_ARRAY_OP, ARRAY_EQUAL, 2},
+    {"substring", OP_STRING_OP, STRING_SUBSTRING, 3},
+    {"split", OP_STRING_OP, STRING_SPLIT, 2},
+    {"trim", OP_STRING_OP, STRING_TRIM, 1},
+    {"rand", OP_RAND, -1, 0},
+    {"randSeed", OP_RANDSEED, -1, 1},
+    {"randMax", OP_RANDMAX, -1, 1},
+    {"randRange", OP_RANDRANGE, -1, 2},
+    {"randFill", OP_RANDFILL, -1, 1},
+    {"spawn", OP_SPAWN, -1, 1},
+    {"pause", OP_PAUSE, -1, 0},
+    {"halt", OP_HALT, -1, 0},
+    {"unhalt", OP_UNHALT, -1, 1},
+    {"exit", OP_EXIT, -1, 0},
+    {"send", OP_SEND, -1, 2},
+    {"recv", OP_RECV, -1, 1},
+};
 
-Compiler *current = NULL;
+// Compilation state is per thread, so threads can compile at the same time.
+static _Thread_local Parser parser;
 
-Chunk *compilingChunk;
+static _Thread_local Compiler *current = NULL;
 
-static Chunk *currentChunk() { return compilingChunk; }
+static Chunk *currentChunk() { return current->chunk; }
 
 static void errorAt(Token *token, const char *message) {
   if (parser.panicMode)
@@ -150,13 +208,8 @@ static int emitJump(uint8_t instruction) {
 }
 
 static void emitReturn() {
+  emitByte(OP_NIL);
   emitByte(OP_RET);
-
-#ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), "code");
-  }
-#endif
 }
 
 static uint8_t makeConstant(Value value) {
@@ -185,13 +238,50 @@ static void patchJump(int offset) {
   currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler *compiler) {
+// A script compiles into the chunk it is handed; a function compiles into
+// the chunk of a fresh ObjFunction.
+static void initCompiler(Compiler *compiler, FunctionType type, Chunk *chunk) {
+  compiler->enclosing = current;
+  compiler->function = NULL;
+  compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  if (type == TYPE_FUNCTION) {
+    compiler->function = newFunction();
+    compiler->function->name =
+        copyString(vm, parser.previous.start, parser.previous.length);
+    chunk = &compiler->function->chunk;
+  } else if (type == TYPE_PARALLEL) {
+    compiler->function = newFunction();
+    compiler->function->name = copyString(vm, "parallel for", 12);
+    chunk = &compiler->function->chunk;
+  }
+  compiler->chunk = chunk;
   current = compiler;
+
+  // Slot 0 holds the callee, so parameters and locals start at slot 1.
+  Local *local = &current->locals[current->localCount++];
+  local->name.start = "";
+  local->name.length = 0;
+  local->depth = 0;
+  local->initialized = true;
+  local->assignRule = READONLY;
 }
 
-static void endCompiler() { emitReturn(); }
+static ObjFunction *endCompiler() {
+  emitReturn();
+  ObjFunction *function = current->function;
+
+#ifdef DEBUG_PRINT_CODE
+  if (!parser.hadError) {
+    disassembleChunk(currentChunk(),
+                     function != NULL ? function->name->chars : "<script>");
+  }
+#endif
+
+  current = current->enclosing;
+  return function;
+}
 
 static void beginScope() { current->scopeDepth++; }
 
@@ -327,17 +417,33 @@ static void and_(bool canAssign) {
 
 static void string(bool canAssign) {
   emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+      copyString(vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static int resolveLocal(Compiler *compiler, Token *name);
 
+// Whether code being compiled runs on a parallel for's helper VMs, where
+// globals are a private snapshot that is thrown away.
+static bool inParallelBody() {
+  for (Compiler *compiler = current; compiler != NULL;
+       compiler = compiler->enclosing) {
+    if (compiler->type == TYPE_PARALLEL)
+      return true;
+  }
+  return false;
+}
+
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+  } else if (current->type == TYPE_PARALLEL &&
+             resolveLocal(current->enclosing, &name) != -1) {
+    error("Can only use the enclosing function's locals in a parallel for "
+          "body as accumulators.");
+    return;
   } else {
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
@@ -355,6 +461,10 @@ static void namedVariable(Token name, bool canAssign) {
   }
 
   if (canAssign && match(TOKEN_EQUAL)) {
+    if (setOp == OP_SET_GLOBAL && inParallelBody()) {
+      error("Can't assign to a global in a parallel for body.");
+      return;
+    }
     expression();
     emitBytes(setOp, (uint8_t)arg);
   } else {
@@ -362,8 +472,140 @@ static void namedVariable(Token name, bool canAssign) {
   }
 }
 
+static void mapLiteral(bool canAssign) {
+  emitByte(OP_MAP_NEW);
+
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      expression();
+      consume(TOKEN_COLON, "Expect ':' after map key.");
+      expression();
+      emitByte(OP_MAP_INSERT);
+    } while (match(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+}
+
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
+    parser.lastIndexGet = currentChunk()->count - 1;
+  }
+}
+
+static const Builtin *findBuiltin(Token *name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    const Builtin *builtin = &builtins[i];
+    if ((int)strlen(builtin->name) == name->length &&
+        memcmp(builtin->name, name->start, name->length) == 0)
+      return builtin;
+  }
+  return NULL;
+}
+
+// Compiles the argument list of a builtin or host call, which must match
+// the callee's fixed arity.
+static bool fixedArguments(const char *name, int arity) {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  int argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      expression();
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+  if (argCount != arity) {
+    char message[64];
+    snprintf(message, sizeof(message), "Expect %d argument%s to '%s'.", arity,
+             arity == 1 ? "" : "s", name);
+    error(message);
+    return false;
+  }
+  return true;
+}
+
+static void builtinCall(const Builtin *builtin) {
+  if (!fixedArguments(builtin->name, builtin->arity))
+    return;
+
+  emitByte(builtin->opcode);
+  if (builtin->operand >= 0)
+    emitByte((uint8_t)builtin->operand);
+}
+
+static uint8_t argumentList() {
+  uint8_t argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      expression();
+      if (argCount == 255) {
+        error("Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(bool canAssign) {
+  uint8_t argCount = argumentList();
+  parser.lastCall = currentChunk()->count;
+  emitBytes(OP_CALL, argCount);
+}
+
+static void emitFieldAccess(uint8_t instruction, uint8_t name) {
+  int cache = addFieldCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many field accesses in one chunk.");
+    return;
+  }
+
+  emitBytes(instruction, name);
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect field name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitFieldAccess(OP_SET_FIELD, name);
+  } else {
+    emitFieldAccess(OP_GET_FIELD, name);
+  }
+}
+
 static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+  // Locals shadow builtins and host functions; otherwise such a name
+  // followed by '(' is a direct call, resolved here rather than at runtime.
+  Token name = parser.previous;
+  if (check(TOKEN_LEFT_PAREN) && resolveLocal(current, &name) == -1) {
+    const Builtin *builtin = findBuiltin(&name);
+    if (builtin != NULL) {
+      builtinCall(builtin);
+      return;
+    }
+
+    int host = findHost(name.start, name.length);
+    if (host >= 0) {
+      if (fixedArguments(hosts[host].name, hosts[host].arity))
+        emitBytes(OP_HOST, (uint8_t)host);
+      return;
+    }
+  }
+
+  namedVariable(name, canAssign);
 }
 
 static void unary(bool canAssign) {
@@ -386,12 +628,14 @@ static void unary(bool canAssign) {
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {NULL, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -413,13 +657,16 @@ ParseRule rules[] = {
     [TOKEN_FLOAT] = {number_float, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DELETE] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IN] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
+    [TOKEN_PARALLEL] = {NULL, NULL, PREC_NONE},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
@@ -455,7 +702,7 @@ static void parsePrecedence(Precedence precedence) {
 }
 
 static uint8_t identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  return makeConstant(OBJ_VAL(copyString(vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -486,6 +733,7 @@ static void addLocal(Token name, AssignRule assignRule) {
 
   Local *local = &current->locals[current->localCount++];
   local->name = name;
+  local->depth = -1;
   local->initialized = false;
   local->assignRule = assignRule;
 }
@@ -509,16 +757,25 @@ static void declareVariable(AssignRule assignRule) {
   addLocal(*name, assignRule);
 }
 
-static uint8_t parseVariable(const char *errorMessage, AssignRule assignRule) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
-
+static uint8_t declareNamedVariable(AssignRule assignRule) {
   declareVariable(assignRule);
   if (current->scopeDepth > 0)
     return 0;
 
+  // A call by this name would still compile to the builtin or host call,
+  // so a global could never be called.
+  Token *name = &parser.previous;
+  if (findBuiltin(name) != NULL || findHost(name->start, name->length) >= 0)
+    error("Can't declare a global with the name of a builtin or host "
+          "function.");
   return identifierConstant(&parser.previous);
 }
 
+static uint8_t parseVariable(const char *errorMessage, AssignRule assignRule) {
+  consume(TOKEN_IDENTIFIER, errorMessage);
+  return declareNamedVariable(assignRule);
+}
+
 static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
   if (current->locals[current->localCount - 1].assignRule == SINGLE_ASSIGN) {
@@ -547,9 +804,7 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.", MULTIPLE_ASSIGN);
-
+static void finishVarDeclaration(uint8_t global) {
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -560,6 +815,68 @@ static void varDeclaration() {
   defineVariable(global);
 }
 
+static void varDeclaration() {
+  finishVarDeclaration(
+      parseVariable("Expect variable name.", MULTIPLE_ASSIGN));
+}
+
+// class Name { var field, ...; ... }
+// Declared fields are part of every instance's initial shape, so instances
+// of a class all start out with the same layout.
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  uint8_t global = declareNamedVariable(MULTIPLE_ASSIGN);
+
+  emitBytes(OP_CLASS, nameConstant);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (match(TOKEN_VAR)) {
+    do {
+      consume(TOKEN_IDENTIFIER, "Expect field name.");
+      emitBytes(OP_FIELD, identifierConstant(&parser.previous));
+    } while (match(TOKEN_COMMA));
+    consume(TOKEN_SEMICOLON, "Expect ';' after field declaration.");
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+
+  defineVariable(global);
+}
+
+static void function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+  beginScope();
+
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      current->function->arity++;
+      if (current->function->arity > 255) {
+        errorAtCurrent("Can't have more than 255 parameters.");
+      }
+      uint8_t constant = parseVariable("Expect parameter name.",
+                                       MULTIPLE_ASSIGN);
+      defineVariable(constant);
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block();
+
+  // The frame is discarded on return, so the body's locals need no pops.
+  ObjFunction *function = endCompiler();
+  emitConstant(OBJ_VAL(function));
+}
+
+static void funDeclaration() {
+  uint8_t global = parseVariable("Expect function name.", MULTIPLE_ASSIGN);
+  // A local function may refer to itself.
+  if (current->scopeDepth > 0)
+    markInitialized();
+  function(TYPE_FUNCTION);
+  defineVariable(global);
+}
+
 static void constDeclaration() {
   uint8_t global = parseVariable("Expect variable name.", SINGLE_ASSIGN);
 
@@ -579,6 +896,52 @@ static void expressionStatement() {
   emitByte(OP_PRINT);
 }
 
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = parser.previous.line;
+  return token;
+}
+
+static void addHiddenLocal(Token name) {
+  addLocal(name, MULTIPLE_ASSIGN);
+  markInitialized();
+}
+
+// for (var key[, value] in map) statement
+static void forInStatement(Token keyName) {
+  Token valueName = syntheticToken("(value)");
+  if (match(TOKEN_COMMA)) {
+    consume(TOKEN_IDENTIFIER, "Expect value variable name.");
+    valueName = parser.previous;
+  }
+  consume(TOKEN_IN, "Expect 'in' after loop variables.");
+
+  int mapSlot = current->localCount;
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after map.");
+  addHiddenLocal(syntheticToken("(map)"));
+
+  emitConstant(INT_VAL(0));
+  addHiddenLocal(syntheticToken("(cursor)"));
+  emitByte(OP_NIL);
+  addHiddenLocal(keyName);
+  emitByte(OP_NIL);
+  addHiddenLocal(valueName);
+
+  int loopStart = currentChunk()->count;
+  emitBytes(OP_MAP_NEXT, (uint8_t)mapSlot);
+  emitByte(0xff);
+  emitByte(0xff);
+  int exitJump = currentChunk()->count - 2;
+
+  statement();
+  emitLoop(loopStart);
+  patchJump(exitJump);
+}
+
 static void forStatement() {
   beginScope();
 
@@ -586,7 +949,13 @@ static void forStatement() {
   if (match(TOKEN_SEMICOLON)) {
     // No initializer.
   } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    if (check(TOKEN_COMMA) || check(TOKEN_IN)) {
+      forInStatement(parser.previous);
+      endScope();
+      return;
+    }
+    finishVarDeclaration(declareNamedVariable(MULTIPLE_ASSIGN));
   } else {
     expressionStatement();
   }
@@ -628,6 +997,143 @@ static void forStatement() {
   endScope();
 }
 
+// Reads or writes a variable of the current function, or a global, without
+// namedVariable()'s parsing.
+static void emitVariable(Token *name, bool set) {
+  int arg = resolveLocal(current, name);
+  if (arg != -1) {
+    if (set && current->locals[arg].assignRule == READONLY)
+      error("Const variable can not be assign to.");
+    emitBytes(set ? OP_SET_LOCAL : OP_GET_LOCAL, (uint8_t)arg);
+  } else {
+    emitBytes(set ? OP_SET_GLOBAL : OP_GET_GLOBAL, identifierConstant(name));
+  }
+}
+
+static bool matchName(const char *name) {
+  if (!check(TOKEN_IDENTIFIER) ||
+      parser.current.length != (int)strlen(name) ||
+      memcmp(parser.current.start, name, parser.current.length) != 0)
+    return false;
+  advance();
+  return true;
+}
+
+static void consumeName(Token *name, const char *message) {
+  consume(TOKEN_IDENTIFIER, message);
+  if (!identifiersEqual(&parser.previous, name))
+    error(message);
+}
+
+static void addSlot(Token name) {
+  addLocal(name, MULTIPLE_ASSIGN);
+  markInitialized();
+}
+
+// parallel for (var i = start; i < end; i = i + 1) reduce (+ a, * b, min c,
+//     max d) statement
+//
+// The body becomes a function of the bounds of a range and the accumulators,
+// which OP_PARALLEL runs on helper VMs, one range each; each range's
+// accumulators start from the operation's identity and are folded into the
+// variables afterwards. Only this counted form is parallel: the body may
+// not assign globals or use the enclosing function's other locals, and may
+// only change objects it created.
+static void parallelStatement() {
+  consume(TOKEN_FOR, "Expect 'for' after 'parallel'.");
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  consume(TOKEN_VAR, "Expect 'var' in parallel for.");
+  consume(TOKEN_IDENTIFIER, "Expect variable name.");
+  Token index = parser.previous;
+  consume(TOKEN_EQUAL, "Expect '=' after loop variable.");
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after loop start.");
+  const char *shape = "Parallel for loops must count up by one.";
+  consumeName(&index, shape);
+  consume(TOKEN_LESS, shape);
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  consumeName(&index, shape);
+  consume(TOKEN_EQUAL, shape);
+  consumeName(&index, shape);
+  consume(TOKEN_PLUS, shape);
+  consume(TOKEN_INT, shape);
+  if (parser.previous.length != 1 || parser.previous.start[0] != '1')
+    error(shape);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  Token accumulators[PARALLEL_ACCUMULATORS_MAX];
+  uint8_t ops[PARALLEL_ACCUMULATORS_MAX];
+  int count = 0;
+  if (matchName("reduce")) {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'reduce'.");
+    do {
+      if (count == PARALLEL_ACCUMULATORS_MAX) {
+        error("Too many accumulators in parallel for.");
+        break;
+      }
+      if (match(TOKEN_PLUS))
+        ops[count] = REDUCE_ADD;
+      else if (match(TOKEN_STAR))
+        ops[count] = REDUCE_MUL;
+      else if (matchName("min"))
+        ops[count] = REDUCE_MIN;
+      else if (matchName("max"))
+        ops[count] = REDUCE_MAX;
+      else
+        errorAtCurrent("Expect '+', '*', 'min' or 'max' before accumulator.");
+      consume(TOKEN_IDENTIFIER, "Expect accumulator name.");
+      accumulators[count] = parser.previous;
+      emitVariable(&accumulators[count], false);
+      count++;
+    } while (match(TOKEN_COMMA));
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after accumulators.");
+  }
+
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_PARALLEL, NULL);
+  beginScope();
+  Token unnamed = {TOKEN_IDENTIFIER, "", 0, parser.previous.line};
+  addSlot(unnamed); // start
+  addSlot(unnamed); // end
+  for (int i = 0; i < count; i++)
+    addSlot(accumulators[i]);
+  current->function->arity = 2 + count;
+
+  uint8_t slot = (uint8_t)current->localCount;
+  emitBytes(OP_GET_LOCAL, 1);
+  addSlot(index);
+
+  int loopStart = currentChunk()->count;
+  emitBytes(OP_GET_LOCAL, slot);
+  emitBytes(OP_GET_LOCAL, 2);
+  emitByte(OP_LESS);
+  int exitJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+
+  statement();
+
+  emitBytes(OP_GET_LOCAL, slot);
+  emitConstant(INT_VAL(1));
+  emitByte(OP_ADD);
+  emitBytes(OP_SET_LOCAL, slot);
+  emitByte(OP_POP);
+  emitLoop(loopStart);
+  patchJump(exitJump);
+  emitByte(OP_POP);
+  emitBytes(OP_PARALLEL_DONE, (uint8_t)count);
+
+  ObjFunction *body = endCompiler();
+  emitBytes(OP_PARALLEL, makeConstant(OBJ_VAL(body)));
+  emitByte((uint8_t)count);
+  for (int i = 0; i < count; i++)
+    emitByte(ops[i]);
+  for (int i = count - 1; i >= 0; i--) {
+    emitVariable(&accumulators[i], true);
+    emitByte(OP_POP);
+  }
+}
+
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
   expression();
@@ -683,6 +1189,43 @@ static void doWhileStatement() {
   emitByte(OP_POP);
 }
 
+static void deleteStatement() {
+  parser.lastIndexGet = -1;
+  parsePrecedence(PREC_CALL);
+  consume(TOKEN_SEMICOLON, "Expect ';' after delete target.");
+
+  // The target was compiled as an element read; turn that read into the
+  // delete.
+  if (parser.lastIndexGet != currentChunk()->count - 1) {
+    error("Can only delete map elements.");
+    return;
+  }
+  currentChunk()->code[parser.lastIndexGet] = OP_DELETE_INDEX;
+}
+
+static void returnStatement() {
+  if (current->type == TYPE_SCRIPT) {
+    error("Can't return from top-level code.");
+  }
+  if (current->type == TYPE_PARALLEL) {
+    error("Can't return from a parallel for body.");
+  }
+
+  if (match(TOKEN_SEMICOLON)) {
+    emitReturn();
+    return;
+  }
+
+  parser.lastCall = -1;
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+  // A call whose result is returned as is can reuse the caller's frame.
+  if (parser.lastCall == currentChunk()->count - 2)
+    currentChunk()->code[parser.lastCall] = OP_TAIL_CALL;
+  emitByte(OP_RET);
+}
+
 static void printStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after value.");
@@ -702,6 +1245,7 @@ static void synchronize() {
     case TOKEN_VAR:
     case TOKEN_CONST:
     case TOKEN_FOR:
+    case TOKEN_PARALLEL:
     case TOKEN_IF:
     case TOKEN_WHILE:
     case TOKEN_PRINT:
@@ -722,12 +1266,18 @@ static void statement() {
     printStatement();
   } else if (match(TOKEN_FOR)) {
     forStatement();
+  } else if (match(TOKEN_PARALLEL)) {
+    parallelStatement();
   } else if (match(TOKEN_IF)) {
     ifStatement();
   } else if (match(TOKEN_WHILE)) {
     whileStatement();
   } else if (match(TOKEN_DO)) {
     doWhileStatement();
+  } else if (match(TOKEN_DELETE)) {
+    deleteStatement();
+  } else if (match(TOKEN_RETURN)) {
+    returnStatement();
   } else if (match(TOKEN_LEFT_BRACE)) {
     beginScope();
     block();
@@ -738,7 +1288,11 @@ static void statement() {
 }
 
 static void declaration() {
-  if (match(TOKEN_VAR)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
+    funDeclaration();
+  } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else if (match(TOKEN_CONST)) {
     constDeclaration();
@@ -750,11 +1304,16 @@ static void declaration() {
     synchronize();
 }
 
-bool compile(const char *source, Chunk *chunk) {
+bool compile(VM *instance, const char *source, Chunk *chunk) {
+  // Constants and functions are allocated in the target VM.
+  VM *previous = vm;
+  switchVM(instance);
+  instance->compiling = true;
+
   initScanner(source);
   Compiler compiler;
-  initCompiler(&compiler);
-  compilingChunk = chunk;
+  current = NULL;
+  initCompiler(&compiler, TYPE_SCRIPT, chunk);
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -766,5 +1325,7 @@ bool compile(const char *source, Chunk *chunk) {
   }
 
   endCompiler();
+  instance->compiling = false;
+  switchVM(previous);
   return !parser.hadError;
 }
\ No newline at end of file
@@ -4,6 +4,6 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+bool compile(VM *instance, const char *source, Chunk *chunk);
 
 #endif
\ No newline at end of file
@@ -31,6 +31,37 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk,
   return offset + 3;
 }
 
+static int mapNextInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+  return offset + 4;
+}
+
+static int fieldInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int parallelInstruction(const char *name, Chunk *chunk, int offset) {
+  static const char *ops[] = {"+", "*", "min", "max"};
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t count = chunk->code[offset + 2];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' reduce");
+  for (int i = 0; i < count; i++)
+    printf(" %s", ops[chunk->code[offset + 3 + i]]);
+  printf("\n");
+  return offset + 3 + count;
+}
+
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
@@ -41,10 +72,11 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
 
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -66,6 +98,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_halt", offset);
   case OP_UNHALT:
     return simpleInstruction("OP_unhalt", offset);
+  case OP_SPAWN:
+    return simpleInstruction("OP_spawn", offset);
+  case OP_SEND:
+    return simpleInstruction("OP_send", offset);
+  case OP_RECV:
+    return simpleInstruction("OP_recv", offset);
+  case OP_PARALLEL:
+    return parallelInstruction("OP_parallel", chunk, offset);
+  case OP_PARALLEL_DONE:
+    return byteInstruction("OP_parallel_done", chunk, offset);
 
   case OP_NOP:
     return simpleInstruction("OP_nop", offset);
@@ -134,6 +176,37 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_REMOVE:
     return simpleInstruction("OP_remove", offset);
 
+  case OP_MAP_NEW:
+    return simpleInstruction("OP_map_new", offset);
+  case OP_MAP_INSERT:
+    return simpleInstruction("OP_map_insert", offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_get_index", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_set_index", offset);
+  case OP_DELETE_INDEX:
+    return simpleInstruction("OP_delete_index", offset);
+  case OP_MAP_NEXT:
+    return mapNextInstruction("OP_map_next", chunk, offset);
+
+  case OP_ARRAY_NEW:
+    return byteInstruction("OP_array_new", chunk, offset);
+  case OP_ARRAY_OP:
+    return byteInstruction("OP_array_op", chunk, offset);
+  case OP_LEN:
+    return simpleInstruction("OP_len", offset);
+  case OP_STRING_OP:
+    return byteInstruction("OP_string_op", chunk, offset);
+
+  case OP_CLASS:
+    return constantInstruction("OP_class", chunk, offset);
+  case OP_FIELD:
+    return constantInstruction("OP_field", chunk, offset);
+  case OP_GET_FIELD:
+    return fieldInstruction("OP_get_field", chunk, offset);
+  case OP_SET_FIELD:
+    return fieldInstruction("OP_set_field", chunk, offset);
+
   case OP_RAND:
     return simpleInstruction("OP_rand", offset);
   case OP_RANDSEED:
@@ -142,9 +215,13 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_randmax", offset);
   case OP_RANDRANGE:
     return simpleInstruction("OP_randrange", offset);
+  case OP_RANDFILL:
+    return simpleInstruction("OP_randfill", offset);
 
   case OP_CALL:
-    return simpleInstruction("OP_call", offset);
+    return byteInstruction("OP_call", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_tail_call", chunk, offset);
   case OP_RET:
     return simpleInstruction("OP_ret", offset);
   case OP_BRP:
@@ -152,7 +229,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_REQ:
     return simpleInstruction("OP_req", offset);
   case OP_HOST:
-    return simpleInstruction("OP_host", offset);
+    return byteInstruction("OP_host", chunk, offset);
   case OP_PRINT:
     return simpleInstruction("OP_PRINT", offset);
 
@@ -0,0 +1,622 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "host.h"
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+
+// The task whose VM runs on this thread, for the host functions.
+static _Thread_local LoopTask *runningTask = NULL;
+
+static uint64_t now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static void queueTask(LoopTask *task)
+{
+  if (task->queued)
+    return;
+
+  EventLoop *loop = task->loop;
+  task->queued = true;
+  task->next = NULL;
+  if (loop->tail != NULL)
+    loop->tail->next = task;
+  else
+    loop->head = task;
+  loop->tail = task;
+}
+
+static IoWait *newWait(LoopTask *task, WaitKind kind, int fd)
+{
+  IoWait *wait = ALLOCATE(IoWait, 1, MEM_OTHER);
+  *wait = (IoWait){.kind = kind,
+                   .task = task,
+                   .coroutine = runningCoroutine(task->vm),
+                   .fd = fd};
+  task->waits++;
+  return wait;
+}
+
+static void finishWait(IoWait *wait, Value value)
+{
+  LoopTask *task = wait->task;
+  task->waits--;
+  task->loop->wakeups++;
+  wakeCoroutine(task->vm, wait->coroutine, value);
+  queueTask(task);
+  FREE(IoWait, wait, MEM_OTHER);
+}
+
+// Descriptors
+
+static FdWatch *watchFor(EventLoop *loop, int fd)
+{
+  if (fd >= loop->watchCapacity)
+  {
+    int capacity = loop->watchCapacity;
+    while (capacity <= fd)
+      capacity = GROW_CAPACITY(capacity);
+    loop->watches = GROW_ARRAY(FdWatch, loop->watches, loop->watchCapacity,
+                               capacity, MEM_OTHER);
+    memset(loop->watches + loop->watchCapacity, 0,
+           sizeof(FdWatch) * (capacity - loop->watchCapacity));
+    loop->watchCapacity = capacity;
+  }
+
+  FdWatch *watch = &loop->watches[fd];
+  if (!watch->nonblocking)
+  {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    watch->nonblocking = true;
+  }
+  return watch;
+}
+
+// Registers interest in what the descriptor's waiters wait for, and nothing
+// else, so epoll never reports a descriptor no one waits on.
+static bool updateWatch(EventLoop *loop, int fd)
+{
+  FdWatch *watch = &loop->watches[fd];
+  uint32_t events = (watch->reader != NULL ? EPOLLIN : 0) |
+                    (watch->writer != NULL ? EPOLLOUT : 0);
+  if (events == watch->events)
+    return true;
+
+  struct epoll_event event = {.events = events, .data.fd = fd};
+  int op = watch->events == 0 ? EPOLL_CTL_ADD
+           : events == 0      ? EPOLL_CTL_DEL
+                              : EPOLL_CTL_MOD;
+  int status = epoll_ctl(loop->epoll, op, fd, &event);
+  // epoll drops a descriptor when it is closed, so one closed without
+  // forgetFd() and reopened under the same number has to be added again.
+  if (status < 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+    status = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event);
+  if (status < 0 && op != EPOLL_CTL_DEL)
+    return false;
+  watch->events = events;
+  return true;
+}
+
+// Reads what is there. Returns false when nothing is yet; otherwise the
+// result is the text read, "" at the end of the stream or nil on an error.
+// The text is left uninterned like any other string built at runtime.
+static bool tryRead(VM *instance, int fd, Value *result)
+{
+  char buffer[LOOP_READ_MAX];
+  ssize_t count = read(fd, buffer, sizeof(buffer));
+  if (count < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return false;
+
+  *result = count < 0
+                ? NIL_VAL
+                : OBJ_VAL(copyRuntimeString(instance, buffer, (int)count));
+  return true;
+}
+
+// Writes as much as the descriptor takes. Returns false when it has to wait
+// for room; *written stops short of the length on an error.
+static bool tryWrite(int fd, ObjString *data, int *written)
+{
+  while (*written < data->length)
+  {
+    const char *start = data->chars + *written;
+    size_t length = (size_t)(data->length - *written);
+    // A closed socket fails with EPIPE rather than raising SIGPIPE.
+    ssize_t count = send(fd, start, length, MSG_NOSIGNAL);
+    if (count < 0 && errno == ENOTSOCK)
+      count = write(fd, start, length);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno != EAGAIN && errno != EWOULDBLOCK;
+    }
+    *written += (int)count;
+  }
+  return true;
+}
+
+static void handleEvent(EventLoop *loop, int fd, uint32_t events)
+{
+  FdWatch *watch = &loop->watches[fd];
+  bool hangup = (events & (EPOLLERR | EPOLLHUP)) != 0;
+
+  IoWait *reader = watch->reader;
+  Value value;
+  if (reader != NULL && ((events & EPOLLIN) || hangup) &&
+      tryRead(reader->task->vm, fd, &value))
+  {
+    watch->reader = NULL;
+    finishWait(reader, value);
+  }
+
+  IoWait *writer = watch->writer;
+  if (writer != NULL && ((events & EPOLLOUT) || hangup) &&
+      tryWrite(fd, writer->data, &writer->written))
+  {
+    watch->writer = NULL;
+    finishWait(writer, INT_VAL(writer->written));
+  }
+
+  updateWatch(loop, fd);
+}
+
+// Timers
+
+static void swapTimers(EventLoop *loop, int a, int b)
+{
+  IoWait *wait = loop->timers[a];
+  loop->timers[a] = loop->timers[b];
+  loop->timers[b] = wait;
+}
+
+static void siftDown(EventLoop *loop, int index)
+{
+  for (;;)
+  {
+    int smallest = index;
+    for (int child = 2 * index + 1; child <= 2 * index + 2; child++)
+    {
+      if (child < loop->timerCount &&
+          loop->timers[child]->deadline < loop->timers[smallest]->deadline)
+        smallest = child;
+    }
+    if (smallest == index)
+      return;
+    swapTimers(loop, index, smallest);
+    index = smallest;
+  }
+}
+
+static void pushTimer(EventLoop *loop, IoWait *wait)
+{
+  if (loop->timerCount == loop->timerCapacity)
+  {
+    int capacity = GROW_CAPACITY(loop->timerCapacity);
+    loop->timers = GROW_ARRAY(IoWait *, loop->timers, loop->timerCapacity,
+                              capacity, MEM_OTHER);
+    loop->timerCapacity = capacity;
+  }
+
+  int index = loop->timerCount++;
+  loop->timers[index] = wait;
+  while (index > 0 &&
+         loop->timers[(index - 1) / 2]->deadline > wait->deadline)
+  {
+    swapTimers(loop, index, (index - 1) / 2);
+    index = (index - 1) / 2;
+  }
+}
+
+static void fireTimers(EventLoop *loop)
+{
+  uint64_t time = now();
+  while (loop->timerCount > 0 && loop->timers[0]->deadline <= time)
+  {
+    IoWait *wait = loop->timers[0];
+    loop->timers[0] = loop->timers[--loop->timerCount];
+    siftDown(loop, 0);
+    finishWait(wait, NIL_VAL);
+  }
+}
+
+// Drops the waits of a task that ended while some of its coroutines were
+// still parked, since the caller may free the task once it is done.
+static void cancelWaits(EventLoop *loop, LoopTask *task)
+{
+  for (int fd = 0; fd < loop->watchCapacity && task->waits > 0; fd++)
+  {
+    FdWatch *watch = &loop->watches[fd];
+    IoWait **waits[] = {&watch->reader, &watch->writer};
+    for (int i = 0; i < 2; i++)
+    {
+      if (*waits[i] != NULL && (*waits[i])->task == task)
+      {
+        FREE(IoWait, *waits[i], MEM_OTHER);
+        *waits[i] = NULL;
+        task->waits--;
+      }
+    }
+    updateWatch(loop, fd);
+  }
+
+  int kept = 0;
+  for (int i = 0; i < loop->timerCount; i++)
+  {
+    if (loop->timers[i]->task == task)
+    {
+      FREE(IoWait, loop->timers[i], MEM_OTHER);
+      task->waits--;
+    }
+    else
+    {
+      loop->timers[kept++] = loop->timers[i];
+    }
+  }
+  loop->timerCount = kept;
+  for (int i = kept / 2 - 1; i >= 0; i--)
+    siftDown(loop, i);
+}
+
+// Host functions
+
+static LoopTask *loopCaller(const char *name)
+{
+  if (runningTask == NULL || runningCoroutine(vm) == NULL)
+  {
+    hostError("%s() needs a coroutine run by an event loop.", name);
+    return NULL;
+  }
+  return runningTask;
+}
+
+static bool hostRead(Value *args, Value *result)
+{
+  LoopTask *task = loopCaller("read");
+  if (task == NULL)
+    return false;
+  int fd = args[0].as.i;
+  if (fd < 0)
+  {
+    hostError("Invalid file descriptor %d.", fd);
+    return false;
+  }
+
+  FdWatch *watch = watchFor(task->loop, fd);
+  if (tryRead(vm, fd, result))
+    return true;
+  if (watch->reader != NULL)
+  {
+    hostError("Another coroutine is already reading from %d.", fd);
+    return false;
+  }
+
+  watch->reader = newWait(task, WAIT_READ, fd);
+  if (!updateWatch(task->loop, fd))
+  {
+    hostError("Can't wait to read from %d: %s.", fd, strerror(errno));
+    FREE(IoWait, watch->reader, MEM_OTHER);
+    watch->reader = NULL;
+    task->waits--;
+    return false;
+  }
+  suspendHostCall(vm);
+  return true;
+}
+
+static bool hostWrite(Value *args, Value *result)
+{
+  LoopTask *task = loopCaller("write");
+  if (task == NULL)
+    return false;
+  int fd = args[0].as.i;
+  if (fd < 0)
+  {
+    hostError("Invalid file descriptor %d.", fd);
+    return false;
+  }
+
+  FdWatch *watch = watchFor(task->loop, fd);
+  ObjString *data = AS_STRING(args[1]);
+  int written = 0;
+  if (watch->writer == NULL && tryWrite(fd, data, &written))
+  {
+    *result = INT_VAL(written);
+    return true;
+  }
+  if (watch->writer != NULL)
+  {
+    hostError("Another coroutine is already writing to %d.", fd);
+    return false;
+  }
+
+  IoWait *wait = newWait(task, WAIT_WRITE, fd);
+  wait->data = data;
+  wait->written = written;
+  watch->writer = wait;
+  if (!updateWatch(task->loop, fd))
+  {
+    hostError("Can't wait to write to %d: %s.", fd, strerror(errno));
+    FREE(IoWait, wait, MEM_OTHER);
+    watch->writer = NULL;
+    task->waits--;
+    return false;
+  }
+  suspendHostCall(vm);
+  return true;
+}
+
+static bool hostSleep(Value *args, Value *result)
+{
+  (void)result;
+  LoopTask *task = loopCaller("sleep");
+  if (task == NULL)
+    return false;
+
+  int milliseconds = args[0].as.i > 0 ? args[0].as.i : 0;
+  IoWait *wait = newWait(task, WAIT_TIMER, -1);
+  wait->deadline = now() + (uint64_t)milliseconds * 1000000u;
+  pushTimer(task->loop, wait);
+  suspendHostCall(vm);
+  return true;
+}
+
+void defineEventLoopHosts()
+{
+  defineHost("read", "i", hostRead);
+  defineHost("write", "is", hostWrite);
+  defineHost("sleep", "i", hostSleep);
+}
+
+// The loop
+
+bool initEventLoop(EventLoop *loop)
+{
+  memset(loop, 0, sizeof(EventLoop));
+  loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  return loop->epoll >= 0;
+}
+
+void freeEventLoop(EventLoop *loop)
+{
+  for (int fd = 0; fd < loop->watchCapacity; fd++)
+  {
+    if (loop->watches[fd].reader != NULL)
+      FREE(IoWait, loop->watches[fd].reader, MEM_OTHER);
+    if (loop->watches[fd].writer != NULL)
+      FREE(IoWait, loop->watches[fd].writer, MEM_OTHER);
+  }
+  for (int i = 0; i < loop->timerCount; i++)
+    FREE(IoWait, loop->timers[i], MEM_OTHER);
+  FREE_ARRAY(FdWatch, loop->watches, loop->watchCapacity, MEM_OTHER);
+  FREE_ARRAY(IoWait *, loop->timers, loop->timerCapacity, MEM_OTHER);
+  if (loop->epoll >= 0)
+    close(loop->epoll);
+  memset(loop, 0, sizeof(EventLoop));
+  loop->epoll = -1;
+}
+
+void forgetFd(EventLoop *loop, int fd)
+{
+  if (fd < 0 || fd >= loop->watchCapacity)
+    return;
+
+  FdWatch *watch = &loop->watches[fd];
+  if (watch->reader != NULL)
+    finishWait(watch->reader, NIL_VAL);
+  if (watch->writer != NULL)
+    finishWait(watch->writer, INT_VAL(watch->writer->written));
+  if (watch->events != 0)
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, NULL);
+  *watch = (FdWatch){0};
+}
+
+void addLoopTask(EventLoop *loop, LoopTask *task)
+{
+  task->loop = loop;
+  task->started = false;
+  task->queued = false;
+  task->waits = 0;
+  loop->taskCount++;
+  queueTask(task);
+}
+
+static void runTask(EventLoop *loop, LoopTask *task)
+{
+  task->queued = false;
+  loop->turns++;
+  runningTask = task;
+  setFuel(task->vm, loop->slice > 0 ? loop->slice : -1);
+
+  InterpretResult result;
+  if (!task->started)
+  {
+    task->started = true;
+    result = task->program != NULL ? runProgram(task->vm, task->program)
+                                   : runScheduler(task->vm);
+  }
+  else
+  {
+    result = continueVM(task->vm);
+  }
+  runningTask = NULL;
+
+  if (result == INTERPRET_OUT_OF_FUEL)
+  {
+    queueTask(task);
+    return;
+  }
+  if (result == INTERPRET_YIELD && task->waits > 0)
+    return;
+
+  if (task->waits > 0)
+    cancelWaits(loop, task);
+  loop->taskCount--;
+  if (task->done != NULL)
+    task->done(task, result);
+}
+
+void runEventLoop(EventLoop *loop)
+{
+  struct epoll_event events[LOOP_EVENTS_MAX];
+  while (loop->taskCount > 0)
+  {
+    // Only the tasks queued so far get a turn before the next poll, so I/O
+    // is looked at even while scripts keep requeueing each other.
+    LoopTask *last = loop->tail;
+    while (loop->head != NULL)
+    {
+      LoopTask *task = loop->head;
+      loop->head = task->next;
+      if (loop->head == NULL)
+        loop->tail = NULL;
+      runTask(loop, task);
+      if (task == last)
+        break;
+    }
+    if (loop->taskCount == 0)
+      break;
+
+    int timeout = -1;
+    if (loop->head != NULL)
+    {
+      timeout = 0;
+    }
+    else if (loop->timerCount > 0)
+    {
+      uint64_t time = now();
+      uint64_t deadline = loop->timers[0]->deadline;
+      timeout = deadline <= time ? 0 : (int)((deadline - time + 999999) / 1000000);
+    }
+
+    loop->polls++;
+    int count = epoll_wait(loop->epoll, events, LOOP_EVENTS_MAX, timeout);
+    for (int i = 0; i < count; i++)
+      handleEvent(loop, events[i].data.fd, events[i].events);
+    fireTimers(loop);
+  }
+}
+
+#define BENCH_LOOP_VMS 8
+#define BENCH_LOOP_PAIRS 128
+#define BENCH_LOOP_ROUNDS 100
+
+// Each pair of coroutines bounces a message over a socket pair. Counting is
+// done by walking the succ map, since arithmetic would print.
+static const char *loopBenchSource =
+    "var clients = 0;\n"
+    "var servers = 0;\n"
+    "func client() {\n"
+    "  var fd = clientFds[clients = succ[clients]];\n"
+    "  var round = 0;\n"
+    "  while (!((round = succ[round]) == rounds)) {\n"
+    "    var sent = write(fd, \"ping\");\n"
+    "    var reply = read(fd);\n"
+    "  }\n"
+    "}\n"
+    "func server() {\n"
+    "  var fd = serverFds[servers = succ[servers]];\n"
+    "  var round = 0;\n"
+    "  while (!((round = succ[round]) == rounds)) {\n"
+    "    var request = read(fd);\n"
+    "    var sent = write(fd, request);\n"
+    "  }\n"
+    "}\n"
+    "var pair = 0;\n"
+    "while (!((pair = succ[pair]) == pairs)) {\n"
+    "  var c = spawn(client);\n"
+    "  var s = spawn(server);\n"
+    "}\n";
+
+void benchmarkEventLoop(FILE *out)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  defineEventLoopHosts();
+  Program *program = compileProgram(loopBenchSource);
+  EventLoop loop;
+  if (program == NULL || !initEventLoop(&loop))
+    return;
+
+  VM *previous = vm;
+  static VM vms[BENCH_LOOP_VMS];
+  static LoopTask tasks[BENCH_LOOP_VMS];
+  static int fds[BENCH_LOOP_VMS][BENCH_LOOP_PAIRS][2];
+  int steps = BENCH_LOOP_PAIRS > BENCH_LOOP_ROUNDS ? BENCH_LOOP_PAIRS
+                                                   : BENCH_LOOP_ROUNDS;
+  for (int v = 0; v < BENCH_LOOP_VMS; v++)
+  {
+    VM *instance = &vms[v];
+    initVM(instance);
+    loadProgram(instance, program);
+    switchVM(instance);
+    ObjMap *succ = newMap();
+    ObjMap *clientFds = newMap();
+    ObjMap *serverFds = newMap();
+    for (int i = 0; i <= steps; i++)
+      mapSet(succ, INT_VAL(i), INT_VAL(i + 1));
+    for (int i = 0; i < BENCH_LOOP_PAIRS; i++)
+    {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[v][i]) < 0)
+      {
+        fprintf(out, "socketpair: %s\n", strerror(errno));
+        return;
+      }
+      mapSet(clientFds, INT_VAL(i + 1), INT_VAL(fds[v][i][0]));
+      mapSet(serverFds, INT_VAL(i + 1), INT_VAL(fds[v][i][1]));
+    }
+    defineGlobal(instance, "succ", OBJ_VAL(succ));
+    defineGlobal(instance, "clientFds", OBJ_VAL(clientFds));
+    defineGlobal(instance, "serverFds", OBJ_VAL(serverFds));
+    defineGlobal(instance, "pairs", INT_VAL(BENCH_LOOP_PAIRS + 1));
+    defineGlobal(instance, "rounds", INT_VAL(BENCH_LOOP_ROUNDS + 1));
+    tasks[v] = (LoopTask){.vm = instance, .program = program};
+    addLoopTask(&loop, &tasks[v]);
+  }
+
+  uint64_t start = now();
+  runEventLoop(&loop);
+  double seconds = (double)(now() - start) / 1e9;
+  long trips = (long)BENCH_LOOP_VMS * BENCH_LOOP_PAIRS * BENCH_LOOP_ROUNDS;
+  fprintf(out,
+          "%d VMs, %d coroutines in flight: %ld round trips in %.3f s, "
+          "%.0f/s\n",
+          BENCH_LOOP_VMS, BENCH_LOOP_VMS * BENCH_LOOP_PAIRS * 2, trips,
+          seconds, trips / seconds);
+  fprintf(out, "%llu turns, %llu polls, %llu wakeups\n",
+          (unsigned long long)loop.turns, (unsigned long long)loop.polls,
+          (unsigned long long)loop.wakeups);
+
+  for (int v = 0; v < BENCH_LOOP_VMS; v++)
+  {
+    freeVM(&vms[v]);
+    for (int i = 0; i < BENCH_LOOP_PAIRS; i++)
+    {
+      close(fds[v][i][0]);
+      close(fds[v][i][1]);
+    }
+  }
+  freeEventLoop(&loop);
+  freeProgram(program);
+  switchVM(previous);
+}
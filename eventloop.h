@@ -0,0 +1,113 @@
+#ifndef xasm_eventloop_h
+#define xasm_eventloop_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Bytes one read() hands to a script at most.
+#define LOOP_READ_MAX 4096
+#define LOOP_EVENTS_MAX 256
+
+typedef struct EventLoop EventLoop;
+typedef struct LoopTask LoopTask;
+typedef void (*LoopTaskDone)(LoopTask *task, InterpretResult result);
+
+typedef enum
+{
+  WAIT_READ,
+  WAIT_WRITE,
+  WAIT_TIMER,
+} WaitKind;
+
+// A coroutine parked in read(), write() or sleep().
+typedef struct
+{
+  WaitKind kind;
+  LoopTask *task;
+  ObjCoroutine *coroutine;
+  int fd;
+  // What write() still has to send.
+  ObjString *data;
+  int written;
+  // When sleep() ends, in nanoseconds on the monotonic clock.
+  uint64_t deadline;
+} IoWait;
+
+// The coroutines of one VM waiting on a file descriptor.
+typedef struct
+{
+  IoWait *reader;
+  IoWait *writer;
+  uint32_t events; // registered with epoll
+  bool nonblocking;
+} FdWatch;
+
+// A VM the loop runs. The caller owns it: it fills in the fields up to
+// data, adds it, and keeps it alive until done has been called.
+struct LoopTask
+{
+  VM *vm;
+  // Run on the task's first turn. When NULL, the VM's coroutines, spawned
+  // by the host beforehand, are run instead.
+  Program *program;
+  LoopTaskDone done;
+  void *data;
+
+  // Owned by the loop.
+  EventLoop *loop;
+  bool started;
+  bool queued;
+  int waits;
+  LoopTask *next;
+};
+
+// Runs many VMs on one thread, none of which blocks on I/O. Their
+// coroutines call read(fd), write(fd, text) and sleep(ms), which park them
+// until epoll reports the descriptor ready or the timer is due; the loop
+// then does the I/O itself and wakes the coroutine with the result. A VM
+// whose coroutines are all parked costs nothing until one of them is
+// woken. The script of a task must do its I/O inside coroutines; the
+// top-level code only spawns them.
+struct EventLoop
+{
+  int epoll;
+  FdWatch *watches; // indexed by descriptor
+  int watchCapacity;
+  // Pending sleep() calls, a binary heap ordered by deadline.
+  IoWait **timers;
+  int timerCount;
+  int timerCapacity;
+  // Tasks with coroutines ready to run.
+  LoopTask *head;
+  LoopTask *tail;
+  int taskCount;
+  // Fuel a task gets per turn (see setFuel()), or 0 for no limit, so a busy
+  // script cannot starve the others.
+  int64_t slice;
+
+  uint64_t turns;
+  uint64_t polls;
+  uint64_t wakeups;
+};
+
+// Registers the read, write and sleep host functions. Call it once before
+// compiling scripts that use them.
+void defineEventLoopHosts();
+bool initEventLoop(EventLoop *loop);
+void freeEventLoop(EventLoop *loop);
+// Queues a task for its first turn. Descriptors its scripts use are
+// switched to non-blocking mode, and must stay open while waited on.
+void addLoopTask(EventLoop *loop, LoopTask *task);
+// Drops what the loop knows about a descriptor. Call it before closing one
+// that scripts used, so a descriptor later opened under the same number is
+// switched to non-blocking mode and registered afresh. A coroutine still
+// waiting on it is woken as if the I/O had failed.
+void forgetFd(EventLoop *loop, int fd);
+// Runs until every task is done. A task whose coroutines are all parked
+// with nothing in the loop to wake them is done with INTERPRET_YIELD.
+void runEventLoop(EventLoop *loop);
+void benchmarkEventLoop(FILE *out);
+
+#endif
@@ -0,0 +1,374 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86
+#include <immintrin.h>
+#endif
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME32_1 0x9E3779B1U
+
+#define STRIPE_SIZE 32
+// Accumulators are scrambled after this many stripes so that long inputs
+// keep mixing their high bits back in.
+#define STRIPES_PER_BLOCK 16
+// Below this many stripes the vector kernels do not pay for themselves.
+#define VECTOR_MIN_STRIPES 4
+
+typedef void (*AccumulateFn)(uint64_t *acc, const uint8_t *p, size_t stripes);
+
+static const uint64_t secret[4] = {
+    0xBE4BA423396CFEB8ULL,
+    0x1CAD21F72C81017CULL,
+    0xDB979083E96DD4DEULL,
+    0x1F67B3B7A4A44072ULL,
+};
+
+static uint64_t readWord(const uint8_t *p)
+{
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+static uint64_t readHalfWord(const uint8_t *p)
+{
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  return word;
+}
+
+static uint64_t rotateLeft(uint64_t x, int bits)
+{
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t mixWord(uint64_t x)
+{
+  x ^= x >> 31;
+  x *= PRIME64_2;
+  x ^= x >> 29;
+  return x;
+}
+
+static uint32_t avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return (uint32_t)h;
+}
+
+static void scrambleScalar(uint64_t *acc)
+{
+  for (int lane = 0; lane < 4; lane++)
+  {
+    acc[lane] ^= acc[lane] >> 47;
+    acc[lane] *= PRIME32_1;
+  }
+}
+
+static void accumulateScalar(uint64_t *acc, const uint8_t *p, size_t stripes)
+{
+  for (size_t stripe = 1; stripe <= stripes; stripe++, p += STRIPE_SIZE)
+  {
+    for (int lane = 0; lane < 4; lane++)
+    {
+      uint64_t data = readWord(p + lane * 8);
+      uint64_t keyed = data ^ secret[lane];
+      acc[lane] += (keyed & 0xffffffff) * (keyed >> 32) + data;
+    }
+
+    if (stripe % STRIPES_PER_BLOCK == 0)
+      scrambleScalar(acc);
+  }
+}
+
+#ifdef HASH_X86
+
+__attribute__((target("sse2"))) static __m128i
+multiply64By32Sse2(__m128i x, uint32_t factor)
+{
+  // Only the low 64 bits of each product are kept, which is what the scalar
+  // 64-bit multiply produces as well.
+  __m128i prime = _mm_set1_epi32((int)factor);
+  __m128i low = _mm_mul_epu32(x, prime);
+  __m128i high = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+  return _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+}
+
+__attribute__((target("sse2"))) static void
+accumulateSse2(uint64_t *acc, const uint8_t *p, size_t stripes)
+{
+  __m128i acc0 = _mm_loadu_si128((const __m128i *)acc);
+  __m128i acc1 = _mm_loadu_si128((const __m128i *)(acc + 2));
+  const __m128i key0 = _mm_loadu_si128((const __m128i *)secret);
+  const __m128i key1 = _mm_loadu_si128((const __m128i *)(secret + 2));
+
+  for (size_t stripe = 1; stripe <= stripes; stripe++, p += STRIPE_SIZE)
+  {
+    __m128i data0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i data1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i keyed0 = _mm_xor_si128(data0, key0);
+    __m128i keyed1 = _mm_xor_si128(data1, key1);
+    __m128i product0 = _mm_mul_epu32(keyed0, _mm_srli_epi64(keyed0, 32));
+    __m128i product1 = _mm_mul_epu32(keyed1, _mm_srli_epi64(keyed1, 32));
+    acc0 = _mm_add_epi64(acc0, _mm_add_epi64(product0, data0));
+    acc1 = _mm_add_epi64(acc1, _mm_add_epi64(product1, data1));
+
+    if (stripe % STRIPES_PER_BLOCK == 0)
+    {
+      acc0 = _mm_xor_si128(acc0, _mm_srli_epi64(acc0, 47));
+      acc1 = _mm_xor_si128(acc1, _mm_srli_epi64(acc1, 47));
+      acc0 = multiply64By32Sse2(acc0, PRIME32_1);
+      acc1 = multiply64By32Sse2(acc1, PRIME32_1);
+    }
+  }
+
+  _mm_storeu_si128((__m128i *)acc, acc0);
+  _mm_storeu_si128((__m128i *)(acc + 2), acc1);
+}
+
+__attribute__((target("avx2"))) static void
+accumulateAvx2(uint64_t *acc, const uint8_t *p, size_t stripes)
+{
+  __m256i lanes = _mm256_loadu_si256((const __m256i *)acc);
+  const __m256i key = _mm256_loadu_si256((const __m256i *)secret);
+  const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+
+  for (size_t stripe = 1; stripe <= stripes; stripe++, p += STRIPE_SIZE)
+  {
+    __m256i data = _mm256_loadu_si256((const __m256i *)p);
+    __m256i keyed = _mm256_xor_si256(data, key);
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+    lanes = _mm256_add_epi64(lanes, _mm256_add_epi64(product, data));
+
+    if (stripe % STRIPES_PER_BLOCK == 0)
+    {
+      lanes = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+      __m256i low = _mm256_mul_epu32(lanes, prime);
+      __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+      lanes = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+  }
+
+  _mm256_storeu_si256((__m256i *)acc, lanes);
+}
+
+#endif
+
+// The best kernel this CPU supports, picked once for the whole process.
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+static HashKernel bestKernel = HASH_KERNEL_SCALAR;
+// The kernel this thread hashes with: bestKernel until setHashKernel()
+// overrides it, which only affects the calling thread.
+static _Thread_local HashKernel activeKernel = HASH_KERNEL_SCALAR;
+static _Thread_local AccumulateFn accumulate = NULL;
+
+static bool kernelSupported(HashKernel kernel)
+{
+  switch (kernel)
+  {
+  case HASH_KERNEL_SCALAR:
+    return true;
+#ifdef HASH_X86
+  case HASH_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case HASH_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+bool setHashKernel(HashKernel kernel)
+{
+  if (!kernelSupported(kernel))
+    return false;
+
+  activeKernel = kernel;
+  switch (kernel)
+  {
+#ifdef HASH_X86
+  case HASH_KERNEL_SSE2:
+    accumulate = accumulateSse2;
+    break;
+  case HASH_KERNEL_AVX2:
+    accumulate = accumulateAvx2;
+    break;
+#endif
+  default:
+    accumulate = accumulateScalar;
+    break;
+  }
+  return true;
+}
+
+static void detectKernel()
+{
+  if (kernelSupported(HASH_KERNEL_AVX2))
+    bestKernel = HASH_KERNEL_AVX2;
+  else if (kernelSupported(HASH_KERNEL_SSE2))
+    bestKernel = HASH_KERNEL_SSE2;
+}
+
+static void selectKernel()
+{
+  pthread_once(&kernelOnce, detectKernel);
+  setHashKernel(bestKernel);
+}
+
+HashKernel hashKernel()
+{
+  if (accumulate == NULL)
+    selectKernel();
+  return activeKernel;
+}
+
+const char *hashKernelName(HashKernel kernel)
+{
+  switch (kernel)
+  {
+  case HASH_KERNEL_SCALAR:
+    return "scalar";
+  case HASH_KERNEL_SSE2:
+    return "sse2";
+  case HASH_KERNEL_AVX2:
+    return "avx2";
+  default:
+    return "unknown";
+  }
+}
+
+uint32_t hashBytes(const char *key, int length)
+{
+  const uint8_t *p = (const uint8_t *)key;
+  size_t remaining = (size_t)length;
+  uint64_t h = (uint64_t)length * PRIME64_1;
+
+  if (remaining >= STRIPE_SIZE)
+  {
+    if (accumulate == NULL)
+      selectKernel();
+
+    uint64_t acc[4] = {PRIME64_1, PRIME64_2, PRIME64_3, PRIME32_1};
+    size_t stripes = remaining / STRIPE_SIZE;
+    if (stripes < VECTOR_MIN_STRIPES)
+      accumulateScalar(acc, p, stripes);
+    else
+      accumulate(acc, p, stripes);
+    p += stripes * STRIPE_SIZE;
+    remaining -= stripes * STRIPE_SIZE;
+
+    for (int lane = 0; lane < 4; lane++)
+      h = rotateLeft(h ^ mixWord(acc[lane]), 27) * PRIME64_1;
+  }
+
+  for (; remaining >= 8; remaining -= 8, p += 8)
+    h = rotateLeft(h ^ mixWord(readWord(p) * PRIME64_2), 27) * PRIME64_1 +
+        PRIME64_3;
+
+  // The last 1-7 bytes are read as two overlapping halves (or three single
+  // bytes) instead of one at a time; the length is already mixed into h.
+  if (remaining >= 4)
+  {
+    uint64_t tail =
+        readHalfWord(p) | (uint64_t)readHalfWord(p + remaining - 4) << 32;
+    h ^= tail * PRIME64_3;
+  }
+  else if (remaining > 0)
+  {
+    uint64_t tail = (uint64_t)p[0] | (uint64_t)p[remaining / 2] << 8 |
+                    (uint64_t)p[remaining - 1] << 16;
+    h ^= tail * PRIME64_3;
+  }
+
+  return avalanche(h);
+}
+
+static uint32_t hashFnv1a(const char *key, int length)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+typedef uint32_t (*HashFn)(const char *, int);
+
+static double benchmarkOne(HashFn function, const char *data, int length)
+{
+  // Called through a volatile pointer so neither candidate gets inlined.
+  HashFn volatile hash = function;
+
+  // Run long enough to get a stable reading regardless of key length.
+  long iterations = (64L * 1024 * 1024) / length;
+  if (iterations < 16)
+    iterations = 16;
+
+  volatile uint32_t sink = 0;
+  clock_t start = clock();
+  for (long i = 0; i < iterations; i++)
+    sink += hash(data + (i & 7), length);
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  (void)sink;
+
+  if (seconds <= 0)
+    return 0;
+  return (double)iterations * length / seconds / (1024.0 * 1024 * 1024);
+}
+
+void benchmarkHash(FILE *out)
+{
+  const int maxLength = 64 * 1024;
+  char *data = (char *)malloc(maxLength + 8);
+  for (int i = 0; i < maxLength + 8; i++)
+    data[i] = (char)(i * 131 + (i >> 7));
+
+  HashKernel previous = hashKernel();
+
+  fprintf(out, "%8s %10s", "bytes", "fnv1a");
+  for (int kernel = HASH_KERNEL_SCALAR; kernel <= HASH_KERNEL_AVX2; kernel++)
+  {
+    if (kernelSupported((HashKernel)kernel))
+      fprintf(out, " %10s", hashKernelName((HashKernel)kernel));
+  }
+  fprintf(out, "   (GiB/s)\n");
+
+  for (int length = 4; length <= maxLength; length *= 2)
+  {
+    fprintf(out, "%8d %10.2f", length, benchmarkOne(hashFnv1a, data, length));
+    for (int kernel = HASH_KERNEL_SCALAR; kernel <= HASH_KERNEL_AVX2;
+         kernel++)
+    {
+      if (!setHashKernel((HashKernel)kernel))
+        continue;
+      fprintf(out, " %10.2f", benchmarkOne(hashBytes, data, length));
+    }
+    fprintf(out, "\n");
+  }
+
+  setHashKernel(previous);
+  free(data);
+}
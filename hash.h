@@ -0,0 +1,25 @@
+#ifndef xasm_hash_h
+#define xasm_hash_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+typedef enum
+{
+  HASH_KERNEL_SCALAR,
+  HASH_KERNEL_SSE2,
+  HASH_KERNEL_AVX2,
+} HashKernel;
+
+// Hashes 8 bytes per step for short keys and 32-byte stripes for long ones.
+// Every kernel produces the same value, so the choice only affects speed.
+uint32_t hashBytes(const char *key, int length);
+
+HashKernel hashKernel();
+// Only changes the kernel of the calling thread.
+bool setHashKernel(HashKernel kernel);
+const char *hashKernelName(HashKernel kernel);
+void benchmarkHash(FILE *out);
+
+#endif
@@ -0,0 +1,93 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+#include "value.h"
+
+static bool hostClock(Value *args, Value *result)
+{
+  (void)args;
+  *result = FLOAT_VAL((float)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool hostSqrt(Value *args, Value *result)
+{
+  if (args[0].as.f < 0)
+  {
+    hostError("sqrt() of a negative number.");
+    return false;
+  }
+  *result = FLOAT_VAL(sqrtf(args[0].as.f));
+  return true;
+}
+
+static bool hostFloor(Value *args, Value *result)
+{
+  *result = INT_VAL((int)floorf(args[0].as.f));
+  return true;
+}
+
+static bool hostPow(Value *args, Value *result)
+{
+  *result = FLOAT_VAL(powf(args[0].as.f, args[1].as.f));
+  return true;
+}
+
+HostFunction hosts[HOSTS_MAX] = {
+    {"clock", "", 0, hostClock},
+    {"sqrt", "f", 1, hostSqrt},
+    {"floor", "f", 1, hostFloor},
+    {"pow", "ff", 2, hostPow},
+};
+int hostCount = 4;
+
+static _Thread_local char errorMessage[HOST_ERROR_MAX];
+
+int defineHost(const char *name, const char *signature, HostFn function)
+{
+  int arity = (int)strlen(signature);
+  if (arity > UINT8_MAX || strspn(signature, "ifbsv") != (size_t)arity)
+    return -1;
+
+  int index = findHost(name, (int)strlen(name));
+  if (index < 0)
+  {
+    if (hostCount == HOSTS_MAX)
+      return -1;
+    index = hostCount++;
+  }
+  else if (strcmp(hosts[index].signature, signature) != 0)
+  {
+    // Compiled calls, including those in bytecode files, already check
+    // their arguments against the old signature.
+    return -1;
+  }
+
+  hosts[index] = (HostFunction){name, signature, arity, function};
+  return index;
+}
+
+int findHost(const char *name, int length)
+{
+  for (int i = 0; i < hostCount; i++)
+  {
+    if ((int)strlen(hosts[i].name) == length &&
+        memcmp(hosts[i].name, name, length) == 0)
+      return i;
+  }
+  return -1;
+}
+
+void hostError(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(errorMessage, sizeof(errorMessage), format, args);
+  va_end(args);
+}
+
+const char *hostErrorMessage() { return errorMessage; }
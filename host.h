@@ -0,0 +1,45 @@
+#ifndef xasm_host_h
+#define xasm_host_h
+
+#include "common.h"
+#include "value.h"
+
+#define HOSTS_MAX UINT8_COUNT
+#define HOST_ERROR_MAX 256
+
+// A C function callable from scripts. args points straight into the VM
+// stack and holds exactly arity values, already checked and converted
+// against the signature, so the function can read args[i].as.i and friends
+// without looking at the type. It stores its return value in *result
+// (nil unless set) and returns false after calling hostError() to fail.
+typedef bool (*HostFn)(Value *args, Value *result);
+
+// One signature character per parameter:
+//   'i' int, 'f' float, 'b' byte  - any number, converted in place
+//   's' string                    - any text, flattened to an ObjString
+//   'v' any value, passed as is
+typedef struct
+{
+  const char *name;
+  const char *signature;
+  int arity;
+  HostFn function;
+} HostFunction;
+
+extern HostFunction hosts[HOSTS_MAX];
+extern int hostCount;
+
+// Registers a host function and returns its index, or -1 when the registry
+// is full, the signature is malformed, or the name is taken with another
+// signature. Registering a name again with the same signature replaces its
+// function in place. Hosts must be defined before the scripts that call
+// them are compiled, since calls are resolved to an index at compile time.
+// The registry is not locked: every host must be defined before any VM
+// compiles or runs code, on any thread.
+int defineHost(const char *name, const char *signature, HostFn function);
+int findHost(const char *name, int length);
+
+void hostError(const char *format, ...);
+const char *hostErrorMessage();
+
+#endif
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+static size_t stringSize(int length) { return sizeof(ObjString) + length + 1; }
+
+void initInternTable(InternTable *table, int bucketCount)
+{
+    // Round up to a power of two so a bucket is hash & mask.
+    int count = 1;
+    while (count < bucketCount)
+        count *= 2;
+
+    table->bucketCount = count;
+    table->buckets = ALLOCATE(Obj *, count, MEM_TABLE_ENTRIES);
+    memset(table->buckets, 0, sizeof(Obj *) * count);
+}
+
+void freeInternTable(InternTable *table)
+{
+    for (int i = 0; i < table->bucketCount; i++)
+    {
+        Obj *object = table->buckets[i];
+        while (object != NULL)
+        {
+            Obj *next = object->next;
+            reallocate(object, stringSize(((ObjString *)object)->length), 0,
+                       MEM_STRING_CHARS);
+            object = next;
+        }
+    }
+    FREE_ARRAY(Obj *, table->buckets, table->bucketCount, MEM_TABLE_ENTRIES);
+    table->buckets = NULL;
+    table->bucketCount = 0;
+}
+
+// Walks a chain from head down to, but not including, stop. Strings are
+// fully written before they are published, and the acquire loads pair with
+// the release in internAdd, so every string reached here is complete.
+static ObjString *findInChain(Obj *head, Obj *stop, const char *chars,
+                              int length, uint32_t hash)
+{
+    for (Obj *object = head; object != stop;
+         object = __atomic_load_n(&object->next, __ATOMIC_ACQUIRE))
+    {
+        ObjString *string = (ObjString *)object;
+        if (string->hash == hash && string->length == length &&
+            memcmp(string->chars, chars, length) == 0)
+            return string;
+    }
+    return NULL;
+}
+
+ObjString *internFind(InternTable *table, const char *chars, int length,
+                      uint32_t hash)
+{
+    Obj **bucket = &table->buckets[hash & (table->bucketCount - 1)];
+    return findInChain(__atomic_load_n(bucket, __ATOMIC_ACQUIRE), NULL, chars,
+                       length, hash);
+}
+
+ObjString *internAdd(InternTable *table, const char *chars, int length,
+                     uint32_t hash)
+{
+    Obj **bucket = &table->buckets[hash & (table->bucketCount - 1)];
+    Obj *head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    ObjString *found = findInChain(head, NULL, chars, length, hash);
+    if (found != NULL)
+        return found;
+
+    ObjString *string = (ObjString *)reallocate(NULL, 0, stringSize(length),
+                                                MEM_STRING_CHARS);
+    string->obj.type = OBJ_STRING;
+    string->length = length;
+    string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+
+    for (;;)
+    {
+        string->obj.next = head;
+        Obj *seen = head;
+        if (__atomic_compare_exchange_n(bucket, &head, &string->obj, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return string;
+
+        // Another thread got in first. Only the strings it pushed in front
+        // of the old head can be new, so search those before retrying.
+        found = findInChain(head, seen, chars, length, hash);
+        if (found != NULL)
+        {
+            reallocate(string, stringSize(length), 0, MEM_STRING_CHARS);
+            return found;
+        }
+    }
+}
+
+#define BENCH_KEYS 16384
+#define BENCH_OPS_PER_THREAD 2000000
+
+typedef struct
+{
+    InternTable *table;
+    pthread_mutex_t *lock; // NULL for the lock-free run
+    char (*keys)[16];
+    int *lengths;
+    uint32_t *hashes;
+    uint32_t seed;
+} BenchThread;
+
+static void *benchThread(void *arg)
+{
+    BenchThread *bench = (BenchThread *)arg;
+    uint32_t x = bench->seed;
+    uintptr_t sink = 0;
+    for (int i = 0; i < BENCH_OPS_PER_THREAD; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        int key = x % BENCH_KEYS;
+        if (bench->lock != NULL)
+            pthread_mutex_lock(bench->lock);
+        ObjString *string =
+            internAdd(bench->table, bench->keys[key], bench->lengths[key],
+                      bench->hashes[key]);
+        if (bench->lock != NULL)
+            pthread_mutex_unlock(bench->lock);
+        sink += (uintptr_t)string;
+    }
+    return (void *)sink;
+}
+
+static double benchRun(int threads, bool locked, char (*keys)[16],
+                       int *lengths, uint32_t *hashes)
+{
+    InternTable table;
+    initInternTable(&table, INTERN_DEFAULT_BUCKETS);
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    BenchThread *benches = malloc(sizeof(BenchThread) * threads);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threads; t++)
+    {
+        benches[t] = (BenchThread){&table,  locked ? &lock : NULL,
+                                   keys,    lengths,
+                                   hashes,  0x9e3779b9u * (t + 1)};
+        pthread_create(&ids[t], NULL, benchThread, &benches[t]);
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(benches);
+    free(ids);
+    freeInternTable(&table);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)threads * BENCH_OPS_PER_THREAD / seconds / 1e6;
+}
+
+void benchmarkIntern(FILE *out)
+{
+    char(*keys)[16] = malloc(sizeof(*keys) * BENCH_KEYS);
+    int *lengths = malloc(sizeof(int) * BENCH_KEYS);
+    uint32_t *hashes = malloc(sizeof(uint32_t) * BENCH_KEYS);
+    for (int i = 0; i < BENCH_KEYS; i++)
+    {
+        lengths[i] = snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+        hashes[i] = hashBytes(keys[i], lengths[i]);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxThreads = cpus > 4 ? (int)cpus : 4;
+
+    fprintf(out, "%7s %12s %12s   (Mops/s, %d keys, %ld cpus)\n", "threads",
+            "lock-free", "mutex", BENCH_KEYS, cpus);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        fprintf(out, "%7d %12.2f %12.2f\n", threads,
+                benchRun(threads, false, keys, lengths, hashes),
+                benchRun(threads, true, keys, lengths, hashes));
+    }
+
+    free(hashes);
+    free(lengths);
+    free(keys);
+}
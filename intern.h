@@ -0,0 +1,36 @@
+#ifndef xasm_intern_h
+#define xasm_intern_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+#define INTERN_DEFAULT_BUCKETS (1 << 16)
+
+// A string intern table for VMs on many threads at once. Each bucket heads a
+// chain linked through the strings' obj.next, and strings are never removed,
+// so a lookup walks its chain without taking a lock and an insert publishes
+// a new string with a single compare-and-swap on the bucket head. The
+// strings live outside every VM's arena until the table is freed, so an
+// interned string is one object in all the VMs sharing the table and
+// pointer equality keeps meaning string equality between them. VMs only
+// add the strings they compile (see useInternTable()), which bounds the
+// table by the code compiled, so the bucket count is fixed when the table is
+// created; size it for the identifiers and literals of the programs.
+typedef struct
+{
+    int bucketCount;
+    Obj **buckets;
+} InternTable;
+
+void initInternTable(InternTable *table, int bucketCount);
+void freeInternTable(InternTable *table);
+ObjString *internFind(InternTable *table, const char *chars, int length,
+                      uint32_t hash);
+// Returns the interned string equal to chars, adding it if there is none.
+ObjString *internAdd(InternTable *table, const char *chars, int length,
+                     uint32_t hash);
+void benchmarkIntern(FILE *out);
+
+#endif
@@ -3,9 +3,20 @@
 #include <string.h>
 
 #include "chunk.h"
+#include "array.h"
+#include "bytecode.h"
 #include "common.h"
 #include "debug.h"
+#include "eventloop.h"
+#include "hash.h"
+#include "intern.h"
+#include "memory.h"
 #include "vm.h"
+#include "workers.h"
+
+static VM mainVM;
+// A program loaded from bytecode, kept until the VM that ran it is freed.
+static Program *loadedProgram = NULL;
 
 static void repl() {
   char line[1024];
@@ -17,7 +28,7 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(&mainVM, line);
   }
 }
 
@@ -49,9 +60,17 @@ static char *readFile(const char *path) {
 }
 
 static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+  InterpretResult result;
+  if (isBytecodeFile(path)) {
+    loadedProgram = loadBytecode(path);
+    if (loadedProgram == NULL)
+      exit(65);
+    result = runProgram(&mainVM, loadedProgram);
+  } else {
+    char *source = readFile(path);
+    result = interpret(&mainVM, source);
+    free(source);
+  }
 
   if (result == INTERPRET_COMPILE_ERROR) {
     exit(65);
@@ -61,19 +80,116 @@ static void runFile(const char *path) {
   }
 }
 
+static void compileFile(const char *path, const char *outPath) {
+  char *source = readFile(path);
+  Program *program = compileProgram(source);
+  free(source);
+  if (program == NULL)
+    exit(65);
+
+  FILE *file = fopen(outPath, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+    exit(74);
+  }
+  bool written = writeBytecode(program, file);
+  written = fclose(file) == 0 && written;
+  freeProgram(program);
+  if (!written) {
+    fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+    remove(outPath);
+    exit(74);
+  }
+}
+
+static void dumpMemoryStats() { printMemoryStatsJson(stderr); }
+
+static void usage() {
+  fprintf(stderr, "Usage: xasm [--mem-stats] [--mem-sample bytes] "
+                  "[--stack slots] [path]\n"
+                  "       xasm --compile path -o out\n"
+                  "       xasm --bench-hash\n"
+                  "       xasm --bench-array\n"
+                  "       xasm --bench-intern\n"
+                  "       xasm --bench-workers\n"
+                  "       xasm --bench-fuel\n"
+                  "       xasm --bench-events\n");
+  exit(64);
+}
+
 int main(int argc, const char *argv[]) {
-  initVM();
+  const char *path = NULL;
+  const char *outPath = NULL;
+  bool compileOnly = false;
+  size_t stackSlots = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--bench-hash") == 0) {
+      benchmarkHash(stdout);
+      return 0;
+    } else if (strcmp(argv[i], "--bench-array") == 0) {
+      initVM(&mainVM);
+      switchVM(&mainVM);
+      benchmarkArray(stdout);
+      freeVM(&mainVM);
+      return 0;
+    } else if (strcmp(argv[i], "--bench-intern") == 0) {
+      benchmarkIntern(stdout);
+      return 0;
+    } else if (strcmp(argv[i], "--bench-workers") == 0) {
+      benchmarkWorkers(stdout);
+      return 0;
+    } else if (strcmp(argv[i], "--bench-fuel") == 0) {
+      benchmarkFuel(stdout);
+      return 0;
+    } else if (strcmp(argv[i], "--bench-events") == 0) {
+      benchmarkEventLoop(stdout);
+      return 0;
+    } else if (strcmp(argv[i], "--mem-stats") == 0) {
+      atexit(dumpMemoryStats);
+    } else if (strcmp(argv[i], "--mem-sample") == 0) {
+      if (++i == argc)
+        usage();
+      setAllocationSampling((size_t)strtoul(argv[i], NULL, 10));
+    } else if (strcmp(argv[i], "--stack") == 0) {
+      if (++i == argc)
+        usage();
+      stackSlots = (size_t)strtoul(argv[i], NULL, 10);
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "-o") == 0) {
+      if (++i == argc)
+        usage();
+      outPath = argv[i];
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  if (compileOnly) {
+    if (path == NULL || outPath == NULL)
+      usage();
+    compileFile(path, outPath);
+    return 0;
+  }
+
+  initVM(&mainVM);
+  if (stackSlots > 0 && !setStackSize(&mainVM, stackSlots)) {
+    fprintf(stderr, "Could not allocate a stack of %zu slots.\n", stackSlots);
+    exit(74);
+  }
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: xasm [path]\n");
-    exit(64);
+    runFile(path);
   }
 
-  freeVM();
+  freeVM(&mainVM);
+  if (loadedProgram != NULL)
+    freeProgram(loadedProgram);
 
   return 0;
 }
\ No newline at end of file
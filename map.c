@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define MAP_MIN_INDEX 8
+#define MAP_DELETED 0xff
+
+#define KIND(keyType, valueType) ((uint8_t)(((keyType) << 4) | (valueType)))
+#define KEY_TYPE(kind) ((ValueType)((kind) >> 4))
+#define VALUE_TYPE(kind) ((ValueType)((kind)&0x0f))
+
+static uint32_t mixBits(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hashKey(Value key)
+{
+    switch (key.type)
+    {
+    case VAL_BOOL:
+        return AS_BOOL(key) ? 1231 : 1237;
+    case VAL_NIL:
+        return 0;
+    case VAL_BYTE:
+        return mixBits((uint8_t)AS_BYTE(key));
+    case VAL_INT:
+        return mixBits((uint32_t)AS_INT(key));
+    case VAL_FLOAT:
+    {
+        // keyEquals() compares floats with ==, so -0.0 must hash as 0.0.
+        float f = AS_FLOAT(key) == 0.0f ? 0.0f : AS_FLOAT(key);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return mixBits(bits);
+    }
+    case VAL_OBJ:
+        if (IS_STRING(key))
+            return stringHash(AS_STRING(key));
+        return mixBits((uint32_t)((uintptr_t)AS_OBJ(key) >> 4));
+    default:
+        return 0; // Unreachable.
+    }
+}
+
+static bool keyEquals(uint8_t kind, ValueAs stored, Value key)
+{
+    if (KEY_TYPE(kind) != key.type)
+        return false;
+
+    switch (key.type)
+    {
+    case VAL_BOOL:
+        return stored.boolean == AS_BOOL(key);
+    case VAL_NIL:
+        return true;
+    case VAL_BYTE:
+        return stored.byte == AS_BYTE(key);
+    case VAL_INT:
+        return stored.i == AS_INT(key);
+    case VAL_FLOAT:
+        return stored.f == AS_FLOAT(key);
+    case VAL_OBJ:
+        // String keys are interned, so identity is enough.
+        return stored.obj == AS_OBJ(key);
+    default:
+        return false; // Unreachable.
+    }
+}
+
+// Brings a string key to its interned form. Returns false when a lookup key
+// has no interned copy, in which case it cannot be in any map.
+static bool canonicalKey(Value *key, bool insert)
+{
+    if (IS_ROPE(*key) || IS_VIEW(*key))
+        *key = OBJ_VAL(flattenText(AS_OBJ(*key)));
+    if (!IS_STRING(*key) || AS_STRING(*key)->interned)
+        return true;
+
+    ObjString *string = AS_STRING(*key);
+    if (insert)
+    {
+        *key = OBJ_VAL(internString(string));
+        return true;
+    }
+
+    ObjString *interned =
+        findString(string->chars, string->length, stringHash(string));
+    if (interned == NULL)
+        return false;
+    *key = OBJ_VAL(interned);
+    return true;
+}
+
+static uint32_t emptySlot(int width)
+{
+    return width == 1 ? 0xff : width == 2 ? 0xffff : 0xffffffff;
+}
+
+static uint32_t readIndex(ObjMap *map, uint32_t slot)
+{
+    switch (map->indexWidth)
+    {
+    case 1:
+        return ((uint8_t *)map->index)[slot];
+    case 2:
+        return ((uint16_t *)map->index)[slot];
+    default:
+        return ((uint32_t *)map->index)[slot];
+    }
+}
+
+static void writeIndex(ObjMap *map, uint32_t slot, uint32_t position)
+{
+    switch (map->indexWidth)
+    {
+    case 1:
+        ((uint8_t *)map->index)[slot] = (uint8_t)position;
+        break;
+    case 2:
+        ((uint16_t *)map->index)[slot] = (uint16_t)position;
+        break;
+    default:
+        ((uint32_t *)map->index)[slot] = position;
+        break;
+    }
+}
+
+// Returns the index slot holding key, or -1. When the key is missing and
+// insertSlot is given, it receives the first reusable slot on the probe path.
+static int64_t findSlot(ObjMap *map, Value key, uint32_t hash,
+                        int64_t *insertSlot)
+{
+    uint32_t empty = emptySlot(map->indexWidth);
+    uint32_t dummy = empty - 1;
+    uint32_t mask = (uint32_t)map->indexCapacity - 1;
+    int64_t reusable = -1;
+
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        uint32_t position = readIndex(map, slot);
+        if (position == empty)
+        {
+            if (insertSlot != NULL)
+                *insertSlot = reusable >= 0 ? reusable : slot;
+            return -1;
+        }
+
+        if (position == dummy)
+        {
+            if (reusable < 0)
+                reusable = slot;
+        }
+        else if (keyEquals(map->kinds[position], map->entries[position].key,
+                           key))
+        {
+            return slot;
+        }
+    }
+}
+
+static Value entryKey(ObjMap *map, int position)
+{
+    Value key;
+    key.type = KEY_TYPE(map->kinds[position]);
+    key.as = map->entries[position].key;
+    return key;
+}
+
+static void resize(ObjMap *map, int indexCapacity)
+{
+    int entryCapacity = indexCapacity * 2 / 3;
+    int width = indexCapacity <= 256 ? 1 : indexCapacity <= 65536 ? 2 : 4;
+
+    MapEntry *entries = HEAP_ALLOCATE(MapEntry, entryCapacity,
+                                      MEM_TABLE_ENTRIES);
+    uint8_t *kinds = HEAP_ALLOCATE(uint8_t, entryCapacity, MEM_TABLE_ENTRIES);
+    void *index = heapReallocate(NULL, 0, (size_t)indexCapacity * width,
+                                 MEM_TABLE_ENTRIES);
+    memset(index, 0xff, (size_t)indexCapacity * width);
+
+    // Compacting drops deleted entries while keeping insertion order.
+    int count = 0;
+    for (int i = 0; i < map->entryCount; i++)
+    {
+        if (map->kinds[i] == MAP_DELETED)
+            continue;
+        entries[count] = map->entries[i];
+        kinds[count] = map->kinds[i];
+        count++;
+    }
+
+    heapReallocate(map->index, (size_t)map->indexCapacity * map->indexWidth,
+                   0, MEM_TABLE_ENTRIES);
+    HEAP_FREE_ARRAY(uint8_t, map->kinds, map->entryCapacity,
+                    MEM_TABLE_ENTRIES);
+    HEAP_FREE_ARRAY(MapEntry, map->entries, map->entryCapacity,
+                    MEM_TABLE_ENTRIES);
+
+    map->entries = entries;
+    map->kinds = kinds;
+    map->entryCount = count;
+    map->entryCapacity = entryCapacity;
+    map->index = index;
+    map->indexCapacity = indexCapacity;
+    map->indexWidth = width;
+
+    uint32_t mask = (uint32_t)indexCapacity - 1;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t slot = hashKey(entryKey(map, i)) & mask;
+        while (readIndex(map, slot) != emptySlot(width))
+            slot = (slot + 1) & mask;
+        writeIndex(map, slot, (uint32_t)i);
+    }
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value)
+{
+    if (map->count == 0 || !canonicalKey(&key, false))
+        return false;
+
+    int64_t slot = findSlot(map, key, hashKey(key), NULL);
+    if (slot < 0)
+        return false;
+
+    uint32_t position = readIndex(map, (uint32_t)slot);
+    value->type = VALUE_TYPE(map->kinds[position]);
+    value->as = map->entries[position].value;
+    return true;
+}
+
+bool mapSet(ObjMap *map, Value key, Value value)
+{
+    canonicalKey(&key, true);
+    uint32_t hash = hashKey(key);
+
+    if (map->entryCount == map->entryCapacity)
+    {
+        // Grow only when live entries, not deleted ones, fill the array.
+        int capacity = MAP_MIN_INDEX;
+        while (capacity * 2 / 3 < (map->count + 1) * 3 / 2)
+            capacity *= 2;
+        resize(map, capacity);
+    }
+
+    int64_t insertSlot = -1;
+    int64_t slot = findSlot(map, key, hash, &insertSlot);
+    if (slot >= 0)
+    {
+        uint32_t position = readIndex(map, (uint32_t)slot);
+        map->kinds[position] = KIND(key.type, value.type);
+        map->entries[position].value = value.as;
+        return false;
+    }
+
+    int position = map->entryCount++;
+    map->entries[position].key = key.as;
+    map->entries[position].value = value.as;
+    map->kinds[position] = KIND(key.type, value.type);
+    writeIndex(map, (uint32_t)insertSlot, (uint32_t)position);
+    map->count++;
+    return true;
+}
+
+bool mapDelete(ObjMap *map, Value key)
+{
+    if (map->count == 0 || !canonicalKey(&key, false))
+        return false;
+
+    int64_t slot = findSlot(map, key, hashKey(key), NULL);
+    if (slot < 0)
+        return false;
+
+    uint32_t position = readIndex(map, (uint32_t)slot);
+    map->kinds[position] = MAP_DELETED;
+    writeIndex(map, (uint32_t)slot, emptySlot(map->indexWidth) - 1);
+    map->count--;
+    return true;
+}
+
+bool mapNext(ObjMap *map, int *cursor, Value *key, Value *value)
+{
+    for (int position = *cursor; position < map->entryCount; position++)
+    {
+        uint8_t kind = map->kinds[position];
+        if (kind == MAP_DELETED)
+            continue;
+
+        *key = entryKey(map, position);
+        value->type = VALUE_TYPE(kind);
+        value->as = map->entries[position].value;
+        *cursor = position + 1;
+        return true;
+    }
+
+    *cursor = map->entryCount;
+    return false;
+}
+
+void printMap(ObjMap *map)
+{
+    printf("{");
+    int cursor = 0;
+    Value key, value;
+    for (bool first = true; mapNext(map, &cursor, &key, &value); first = false)
+    {
+        if (!first)
+            printf(", ");
+        printValue(key);
+        printf(": ");
+        printValue(value);
+    }
+    printf("}");
+}
@@ -0,0 +1,14 @@
+#ifndef xasm_map_h
+#define xasm_map_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+bool mapGet(ObjMap *map, Value key, Value *value);
+bool mapSet(ObjMap *map, Value key, Value value);
+bool mapDelete(ObjMap *map, Value key);
+bool mapNext(ObjMap *map, int *cursor, Value *key, Value *value);
+void printMap(ObjMap *map);
+
+#endif
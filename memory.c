@@ -1,12 +1,104 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "vm.h"
 
-//TODO implement 1 block memory stuff
+// Counted per thread, so VMs on different threads never contend; the
+// figures reported cover the calling thread.
+static _Thread_local MemStats stats;
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+static void countChange(MemCounter *counter, void *pointer, size_t oldSize,
+                        size_t newSize)
 {
+  if (newSize == 0)
+  {
+    if (pointer == NULL)
+      return;
+    counter->frees++;
+  }
+  else if (pointer == NULL)
+  {
+    counter->allocations++;
+  }
+  else
+  {
+    counter->reallocations++;
+  }
+
+  counter->current += newSize;
+  counter->current -= oldSize < counter->current ? oldSize : counter->current;
+  if (counter->current > counter->peak)
+    counter->peak = counter->current;
+}
+
+// The interpreter keeps ip in a register and stores it to the frame before
+// instructions that allocate, so this is the line of the current instruction.
+static int currentLine()
+{
+  if (vm == NULL || vm->frameCount == 0)
+    return 0;
+
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  size_t instruction = frame->ip - frame->chunk->code;
+  if (instruction > 0)
+    instruction--;
+  if (instruction >= (size_t)frame->chunk->count)
+    return 0;
+  return getLine(frame->chunk, (int)instruction);
+}
+
+static void sampleAllocation(MemCategory category, size_t size)
+{
+  // Byte-interval sampling: every sampleInterval bytes allocated, the
+  // allocation that crosses the boundary is attributed to its site.
+  if (size < stats.sampleCountdown)
+  {
+    stats.sampleCountdown -= size;
+    return;
+  }
+  stats.sampleCountdown = stats.sampleInterval;
+
+  int line = currentLine();
+  for (int i = 0; i < stats.siteCount; i++)
+  {
+    MemSampleSite *site = &stats.sites[i];
+    if (site->category == category && site->line == line)
+    {
+      site->samples++;
+      site->bytes += size;
+      return;
+    }
+  }
+
+  if (stats.siteCount == MEM_SAMPLE_SITES_MAX)
+  {
+    stats.droppedSamples++;
+    return;
+  }
+
+  MemSampleSite *site = &stats.sites[stats.siteCount++];
+  site->category = category;
+  site->line = line;
+  site->samples = 1;
+  site->bytes = size;
+}
+
+static void track(MemCategory category, void *pointer, size_t oldSize,
+                  size_t newSize)
+{
+  countChange(&stats.categories[category], pointer, oldSize, newSize);
+
+  if (stats.sampleInterval > 0 && newSize > oldSize)
+    sampleAllocation(category, newSize - oldSize);
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize,
+                 MemCategory category)
+{
+  track(category, pointer, oldSize, newSize);
+  countChange(&stats.total, pointer, oldSize, newSize);
+
   if (newSize == 0)
   {
     free(pointer);
@@ -19,27 +111,237 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
   return result;
 }
 
-static void freeObject(Obj *object)
+static size_t alignSize(size_t size)
 {
-  switch (object->type)
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void initArena(Arena *arena)
+{
+  arena->head = NULL;
+  arena->spare = NULL;
+}
+
+static void freeBlocks(ArenaBlock *block)
+{
+  while (block != NULL)
   {
-  case OBJ_STRING:
+    ArenaBlock *prev = block->prev;
+    reallocate(block, sizeof(ArenaBlock) + block->capacity, 0, MEM_ARENA);
+    block = prev;
+  }
+}
+
+void freeArena(Arena *arena)
+{
+  freeBlocks(arena->head);
+  freeBlocks(arena->spare);
+  initArena(arena);
+}
+
+static ArenaBlock *newBlock(Arena *arena, size_t size)
+{
+  // Reuse a block released by an earlier rewind when it is big enough.
+  ArenaBlock **link = &arena->spare;
+  while (*link != NULL)
   {
-    ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
-    break;
+    ArenaBlock *block = *link;
+    if (block->capacity >= size)
+    {
+      *link = block->prev;
+      return block;
+    }
+    link = &block->prev;
   }
+
+  size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+  ArenaBlock *block =
+      (ArenaBlock *)reallocate(NULL, 0, sizeof(ArenaBlock) + capacity,
+                               MEM_ARENA);
+  block->capacity = capacity;
+  return block;
+}
+
+static bool isTop(Arena *arena, void *pointer, size_t size)
+{
+  ArenaBlock *block = arena->head;
+  return block != NULL &&
+         (char *)pointer + alignSize(size) == block->data + block->used;
+}
+
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize,
+                      size_t newSize)
+{
+  // Only the most recent allocation can shrink or grow in place; anything
+  // else is simply abandoned until the arena is rewound.
+  if (pointer != NULL && isTop(arena, pointer, oldSize))
+  {
+    ArenaBlock *block = arena->head;
+    size_t start = (char *)pointer - block->data;
+    if (start + alignSize(newSize) <= block->capacity)
+    {
+      block->used = start + alignSize(newSize);
+      return newSize == 0 ? NULL : pointer;
+    }
+  }
+
+  if (newSize == 0)
+    return NULL;
+
+  size_t size = alignSize(newSize);
+  ArenaBlock *block = arena->head;
+  if (block == NULL || block->used + size > block->capacity)
+  {
+    block = newBlock(arena, size);
+    block->used = 0;
+    block->prev = arena->head;
+    arena->head = block;
+  }
+
+  void *result = block->data + block->used;
+  block->used += size;
+
+  if (pointer != NULL)
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  return result;
+}
+
+ArenaMark arenaMark(Arena *arena)
+{
+  ArenaMark mark;
+  mark.block = arena->head;
+  mark.used = arena->head != NULL ? arena->head->used : 0;
+  return mark;
+}
+
+void arenaRewind(Arena *arena, ArenaMark mark)
+{
+  while (arena->head != mark.block)
+  {
+    ArenaBlock *block = arena->head;
+    arena->head = block->prev;
+    block->prev = arena->spare;
+    arena->spare = block;
+  }
+
+  if (arena->head != NULL)
+    arena->head->used = mark.used;
+}
+
+void *heapReallocate(void *pointer, size_t oldSize, size_t newSize,
+                     MemCategory category)
+{
+  track(category, pointer, oldSize, newSize);
+  vm->heapBytes[category] += newSize;
+  vm->heapBytes[category] -= oldSize;
+
+  return arenaReallocate(&vm->heap, pointer, oldSize, newSize);
+}
+
+void releaseHeapBytes(size_t *heapBytes, const size_t *keep)
+{
+  // Arena rewinds drop many allocations at once, so the logical counters are
+  // settled here from the VM's running totals.
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+  {
+    size_t kept = keep != NULL ? keep[i] : 0;
+    size_t released = heapBytes[i] - kept;
+    MemCounter *counter = &stats.categories[i];
+    counter->current -= released < counter->current ? released : counter->current;
+    heapBytes[i] = kept;
   }
 }
 
+// Frees the chunks of the functions newer than until, the only objects that
+// own memory outside the heap arena. The arena itself is freed or rewound by
+// the caller.
+void releaseFunctions(ObjFunction *until)
+{
+  for (ObjFunction *function = vm->functions; function != until;
+       function = function->nextFunction)
+    freeChunk(&function->chunk);
+  vm->functions = until;
+}
+
 void freeObjects()
 {
-  Obj *object = vm.objects;
-  while (object != NULL)
+  releaseFunctions(NULL);
+  vm->objects = NULL;
+  releaseHeapBytes(vm->heapBytes, NULL);
+  freeArena(&vm->heap);
+}
+
+const MemStats *memoryStats() { return &stats; }
+
+void setAllocationSampling(size_t interval)
+{
+  stats.sampleInterval = interval;
+  stats.sampleCountdown = interval;
+}
+
+const char *memCategoryName(MemCategory category)
+{
+  switch (category)
+  {
+  case MEM_CHUNK_CODE:
+    return "chunkCode";
+  case MEM_LINE_TABLE:
+    return "lineTable";
+  case MEM_CONSTANTS:
+    return "constants";
+  case MEM_TABLE_ENTRIES:
+    return "tableEntries";
+  case MEM_STRING_CHARS:
+    return "stringChars";
+  case MEM_ARRAY_ELEMENTS:
+    return "arrayElements";
+  case MEM_COROUTINE_STACKS:
+    return "coroutineStacks";
+  case MEM_OBJECTS:
+    return "objects";
+  case MEM_ARENA:
+    return "arena";
+  case MEM_OTHER:
+    return "other";
+  default:
+    return "unknown";
+  }
+}
+
+static void printCounterJson(FILE *out, const MemCounter *counter)
+{
+  fprintf(out,
+          "{\"current\": %zu, \"peak\": %zu, \"allocations\": %llu, "
+          "\"reallocations\": %llu, \"frees\": %llu}",
+          counter->current, counter->peak,
+          (unsigned long long)counter->allocations,
+          (unsigned long long)counter->reallocations,
+          (unsigned long long)counter->frees);
+}
+
+void printMemoryStatsJson(FILE *out)
+{
+  fprintf(out, "{\n  \"total\": ");
+  printCounterJson(out, &stats.total);
+  fprintf(out, ",\n  \"categories\": {");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
   {
-    Obj *next = object->next;
-    freeObject(object);
-    object = next;
+    fprintf(out, "%s\n    \"%s\": ", i == 0 ? "" : ",",
+            memCategoryName((MemCategory)i));
+    printCounterJson(out, &stats.categories[i]);
   }
-}
\ No newline at end of file
+  fprintf(out, "\n  },\n  \"sampling\": {\"interval\": %zu, "
+               "\"dropped\": %llu, \"sites\": [",
+          stats.sampleInterval, (unsigned long long)stats.droppedSamples);
+  for (int i = 0; i < stats.siteCount; i++)
+  {
+    MemSampleSite *site = &stats.sites[i];
+    fprintf(out,
+            "%s\n    {\"category\": \"%s\", \"line\": %d, "
+            "\"samples\": %llu, \"bytes\": %llu}",
+            i == 0 ? "" : ",", memCategoryName(site->category), site->line,
+            (unsigned long long)site->samples,
+            (unsigned long long)site->bytes);
+  }
+  fprintf(out, "%s]}\n}\n", stats.siteCount > 0 ? "\n  " : "");
+}
@@ -1,23 +1,126 @@
 #ifndef xasm_memory_h
 #define xasm_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count, category) \
+  (type *)reallocate(NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer, category) \
+  reallocate(pointer, sizeof(type), 0, category)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)    \
-  (type *)reallocate(pointer, sizeof(type) * (oldCount), \
-                     sizeof(type) * (newCount))
+#define GROW_ARRAY(type, pointer, oldCount, newCount, category) \
+  (type *)reallocate(pointer, sizeof(type) * (oldCount),        \
+                     sizeof(type) * (newCount), category)
+
+#define FREE_ARRAY(type, pointer, oldCount, category) \
+  reallocate(pointer, sizeof(type) * (oldCount), 0, category)
+
+// Heap allocations belong to the current VM's arena and are released all at
+// once when the VM is reset or freed.
+#define HEAP_ALLOCATE(type, count, category) \
+  (type *)heapReallocate(NULL, 0, sizeof(type) * (count), category)
+
+#define HEAP_FREE_ARRAY(type, pointer, oldCount, category) \
+  heapReallocate(pointer, sizeof(type) * (oldCount), 0, category)
+
+typedef enum
+{
+  MEM_CHUNK_CODE,
+  MEM_LINE_TABLE,
+  MEM_CONSTANTS,
+  MEM_TABLE_ENTRIES,
+  MEM_STRING_CHARS,
+  MEM_ARRAY_ELEMENTS,
+  MEM_COROUTINE_STACKS,
+  MEM_OBJECTS,
+  MEM_ARENA,
+  MEM_OTHER,
+  MEM_CATEGORY_COUNT
+} MemCategory;
+
+typedef struct
+{
+  size_t current;
+  size_t peak;
+  uint64_t allocations;
+  uint64_t reallocations;
+  uint64_t frees;
+} MemCounter;
+
+#define MEM_SAMPLE_SITES_MAX 256
+
+// A sampled allocation site: the category and the script line that was
+// executing (0 when no script was running, e.g. while compiling).
+typedef struct
+{
+  MemCategory category;
+  int line;
+  uint64_t samples;
+  uint64_t bytes;
+} MemSampleSite;
+
+typedef struct
+{
+  MemCounter categories[MEM_CATEGORY_COUNT];
+  // Totals over memory obtained from the system allocator. Objects and
+  // string characters live in arena blocks and are counted under MEM_ARENA
+  // here, while their own counters track the logical bytes.
+  MemCounter total;
+
+  size_t sampleInterval;
+  size_t sampleCountdown;
+  int siteCount;
+  uint64_t droppedSamples;
+  MemSampleSite sites[MEM_SAMPLE_SITES_MAX];
+} MemStats;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock
+{
+  struct ArenaBlock *prev;
+  size_t capacity;
+  size_t used;
+  _Alignas(ARENA_ALIGNMENT) char data[];
+} ArenaBlock;
+
+typedef struct
+{
+  ArenaBlock *head;
+  ArenaBlock *spare;
+} Arena;
+
+typedef struct
+{
+  ArenaBlock *block;
+  size_t used;
+} ArenaMark;
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize,
+                 MemCategory category);
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize,
+                      size_t newSize);
+ArenaMark arenaMark(Arena *arena);
+void arenaRewind(Arena *arena, ArenaMark mark);
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+void *heapReallocate(void *pointer, size_t oldSize, size_t newSize,
+                     MemCategory category);
+void releaseHeapBytes(size_t *heapBytes, const size_t *keep);
+void releaseFunctions(ObjFunction *until);
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+const MemStats *memoryStats();
+void setAllocationSampling(size_t interval);
+const char *memCategoryName(MemCategory category);
+void printMemoryStatsJson(FILE *out);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "array.h"
+#include "hash.h"
+#include "intern.h"
+#include "map.h"
+#include "shape.h"
 #include "memory.h"
 #include "table.h"
 #include "object.h"
@@ -8,67 +13,642 @@
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objectType) \
-    (type *)allocateObject(sizeof(type), objectType)
+    (type *)allocateObject(sizeof(type), objectType, MEM_OBJECTS)
 
-static Obj *allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(size_t size, ObjType type, MemCategory category)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)heapReallocate(NULL, 0, size, category);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+static uint32_t hashString(const char *key, int length)
+{
+    return hashBytes(key, length);
+}
+
+static ObjString *allocateString(int length)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = (ObjString *)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING, MEM_STRING_CHARS);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->hashed = false;
+    string->interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    tableSet(&vm.strings, string, NIL_VAL);
+ObjMap *newMap()
+{
+    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    map->count = 0;
+    map->entryCount = 0;
+    map->entryCapacity = 0;
+    map->entries = NULL;
+    map->kinds = NULL;
+    map->indexCapacity = 0;
+    map->indexWidth = 0;
+    map->index = NULL;
+    return map;
+}
 
-    return string;
+int arrayElementSize(ValueType elementType)
+{
+    switch (elementType)
+    {
+    case VAL_BYTE:
+        return sizeof(int8_t);
+    case VAL_INT:
+        return sizeof(int32_t);
+    case VAL_FLOAT:
+        return sizeof(float);
+    default:
+        return 0; // Unreachable.
+    }
 }
 
-static uint32_t hashString(const char *key, int length)
+ObjArray *newArray(ValueType elementType, int count)
 {
-    uint32_t hash = 2166136261u;
+    size_t size = (size_t)count * arrayElementSize(elementType);
+    ObjArray *array = (ObjArray *)allocateObject(sizeof(ObjArray) + size,
+                                                 OBJ_ARRAY, MEM_ARRAY_ELEMENTS);
+    array->elementType = elementType;
+    array->count = count;
+    memset(array->elements, 0, size);
+    return array;
+}
 
-    for (int i = 0; i < length; i++)
+// With a NULL parent this makes a root shape with no fields; otherwise the
+// shape has the parent's fields followed by name.
+ObjShape *newShape(ObjShape *parent, ObjString *name)
+{
+    int slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    ObjShape *shape = (ObjShape *)allocateObject(
+        sizeof(ObjShape) + slotCount * sizeof(ObjString *), OBJ_SHAPE,
+        MEM_OBJECTS);
+    shape->parent = parent;
+    shape->transitions = NULL;
+    shape->slotCount = slotCount;
+    if (parent != NULL)
     {
-        hash ^= key[i];
-        hash *= 16777619;
+        memcpy(shape->names, parent->names,
+               parent->slotCount * sizeof(ObjString *));
+        shape->names[slotCount - 1] = name;
     }
+    return shape;
+}
+
+ObjFunction *newFunction()
+{
+    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->name = NULL;
+    initChunk(&function->chunk);
+    function->nextFunction = vm->functions;
+    vm->functions = function;
+    return function;
+}
+
+ObjCoroutine *newCoroutine(ObjFunction *function)
+{
+    ObjCoroutine *coroutine = ALLOCATE_OBJ(ObjCoroutine, OBJ_COROUTINE);
+    coroutine->state = COROUTINE_READY;
+    coroutine->transfer = NIL_VAL;
+    coroutine->started = false;
+    coroutine->channelWait = false;
+    coroutine->preempted = false;
+    coroutine->next = NULL;
 
-    return hash;
+    // Suspended before its first instruction: the callee in slot 0 and a
+    // frame at its start.
+    coroutine->stackCount = 1;
+    coroutine->stackCapacity = 1;
+    coroutine->stack = HEAP_ALLOCATE(Value, 1, MEM_COROUTINE_STACKS);
+    coroutine->stack[0] = OBJ_VAL(function);
+    coroutine->frameCount = 1;
+    coroutine->frameCapacity = 1;
+    coroutine->frames = HEAP_ALLOCATE(CallFrame, 1, MEM_COROUTINE_STACKS);
+    // slots and caches are set when the coroutine first runs.
+    coroutine->frames[0] = (CallFrame){.function = function,
+                                       .chunk = &function->chunk,
+                                       .ip = function->chunk.code};
+    return coroutine;
 }
 
-ObjString *takeString(char *chars, int length)
+ObjChannel *wrapChannel(Channel *channel)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL)
+    ObjChannel *object = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+ObjClass *newClass(ObjString *name)
+{
+    ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+    klass->name = name;
+    klass->slotHint = 0;
+    klass->shape = newShape(NULL, NULL);
+    return klass;
+}
+
+ObjInstance *newInstance(ObjClass *klass)
+{
+    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    instance->klass = klass;
+    instance->shape = klass->shape;
+    instance->capacity = klass->slotHint > klass->shape->slotCount
+                             ? klass->slotHint
+                             : klass->shape->slotCount;
+    instance->fields = HEAP_ALLOCATE(Value, instance->capacity, MEM_OBJECTS);
+    for (int i = 0; i < klass->shape->slotCount; i++)
+        instance->fields[i] = NIL_VAL;
+    return instance;
+}
+
+ObjString *makeString(int length)
+{
+    return allocateString(length);
+}
+
+// A VM running a parallel for range only reads the objects its lender made
+// (see runParallel()), since other ranges read them at the same time. It
+// recomputes what it would otherwise cache in them.
+uint32_t stringHash(ObjString *string)
+{
+    if (!string->hashed)
     {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+        uint32_t hash = hashString(string->chars, string->length);
+        if (vm->lender != NULL)
+            return hash;
+        string->hash = hash;
+        string->hashed = true;
+    }
+    return string->hash;
+}
+
+// A VM running a shared program looks in the program's strings first, so a
+// string built at runtime is the same object as an equal program constant.
+// A VM given an intern table keeps the strings it compiles there instead of
+// in its own.
+// A parallel for helper also looks in the strings of the VMs it borrows from.
+ObjString *findString(const char *chars, int length, uint32_t hash)
+{
+    if (vm->sharedStrings != NULL)
+    {
+        ObjString *shared =
+            tableFindString(vm->sharedStrings, chars, length, hash);
+        if (shared != NULL)
+            return shared;
     }
+    for (VM *lender = vm->lender; lender != NULL; lender = lender->lender)
+    {
+        ObjString *lent =
+            tableFindString(&lender->strings, chars, length, hash);
+        if (lent != NULL)
+            return lent;
+    }
+    // The VM's own strings come first: one of them may already be in use
+    // when another VM compiles an equal constant into the shared table.
+    ObjString *own = tableFindString(&vm->strings, chars, length, hash);
+    if (own != NULL || vm->interns == NULL)
+        return own;
+    return internFind(vm->interns, chars, length, hash);
+}
+
+static ObjString *internChars(const char *chars, int length);
+
+ObjString *internString(ObjString *string)
+{
+    if (string->interned)
+        return string;
 
-    return allocateString(chars, length, hash);
+    uint32_t hash = stringHash(string);
+    ObjString *interned = findString(string->chars, string->length, hash);
+    if (interned != NULL)
+        return interned;
+    if (vm->interns != NULL && vm->compiling)
+        return internAdd(vm->interns, string->chars, string->length, hash);
+    // The string may be the lender's, so intern a copy instead.
+    if (vm->lender != NULL)
+        return internChars(string->chars, string->length);
+
+    string->interned = true;
+    tableSet(&vm->strings, string, NIL_VAL);
+    return string;
+}
+
+// Completes a string built with makeString(). With lazy interning it is left
+// unhashed; otherwise it is interned, and a duplicate candidate is dropped.
+ObjString *finishString(ObjString *string)
+{
+#ifdef LAZY_STRING_INTERNING
+    return string;
+#else
+    ObjString *interned = internString(string);
+    if (interned != string)
+    {
+        // The candidate was the last object allocated, so unlinking it and
+        // handing its bytes back rewinds the arena.
+        if (vm->objects == (Obj *)string)
+            vm->objects = string->obj.next;
+        heapReallocate(string, sizeof(ObjString) + string->length + 1, 0,
+                       MEM_STRING_CHARS);
+    }
+    return interned;
+#endif
 }
 
-ObjString *copyString(const char *chars, int length)
+static ObjString *internHashedChars(const char *chars, int length,
+                                    uint32_t hash)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = findString(chars, length, hash);
     if (interned != NULL)
         return interned;
+    if (vm->interns != NULL && vm->compiling)
+        return internAdd(vm->interns, chars, length, hash);
+
+    ObjString *string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
+
+    tableSet(&vm->strings, string, NIL_VAL);
+    return string;
+}
+
+static ObjString *internChars(const char *chars, int length)
+{
+    return internHashedChars(chars, length, hashString(chars, length));
+}
+
+ObjString *copyString(VM *instance, const char *chars, int length)
+{
+    VM *previous = vm;
+    switchVM(instance);
+    ObjString *string = internChars(chars, length);
+    switchVM(previous);
+    return string;
+}
+
+ObjString *copyRuntimeString(VM *instance, const char *chars, int length)
+{
+    VM *previous = vm;
+    switchVM(instance);
+    ObjString *string = makeString(length);
+    memcpy(string->chars, chars, length);
+    string = finishString(string);
+    switchVM(previous);
+    return string;
+}
+
+ObjString *copyHashedString(VM *instance, const char *chars, int length,
+                            uint32_t hash)
+{
+    VM *previous = vm;
+    switchVM(instance);
+    ObjString *string = internHashedChars(chars, length, hash);
+    switchVM(previous);
+    return string;
+}
+
+int textLength(Obj *text)
+{
+    switch (text->type)
+    {
+    case OBJ_ROPE:
+        return ((ObjRope *)text)->length;
+    case OBJ_VIEW:
+        return ((ObjView *)text)->length;
+    default:
+        return ((ObjString *)text)->length;
+    }
+}
+
+// Returns the characters of any text. Only ropes have to be flattened; views
+// point into their parent, so the result is not NUL-terminated.
+static const char *textChars(Obj *text)
+{
+    switch (text->type)
+    {
+    case OBJ_ROPE:
+        return flattenText(text)->chars;
+    case OBJ_VIEW:
+    {
+        ObjView *view = (ObjView *)text;
+        return view->parent->chars + view->start;
+    }
+    default:
+        return ((ObjString *)text)->chars;
+    }
+}
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+static int textDepth(Obj *text)
+{
+    if (text->type == OBJ_ROPE)
+        return ((ObjRope *)text)->depth;
+    return 0;
+}
+
+// Treats a rope that has already been flattened as the leaf it became.
+static Obj *textNode(Obj *text)
+{
+    if (text->type == OBJ_ROPE && ((ObjRope *)text)->flat != NULL)
+        return (Obj *)((ObjRope *)text)->flat;
+    return text;
+}
 
-    return allocateString(heapChars, length, hash);
+static ObjRope *newRope(Obj *left, Obj *right)
+{
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->left = left;
+    rope->right = right;
+    rope->length = textLength(left) + textLength(right);
+    int depth = textDepth(left) > textDepth(right) ? textDepth(left)
+                                                   : textDepth(right);
+    rope->depth = depth + 1;
+    rope->flat = NULL;
+    return rope;
+}
+
+static ObjString *joinText(Obj *a, Obj *b)
+{
+    int aLength = textLength(a);
+    int bLength = textLength(b);
+    ObjString *result = makeString(aLength + bLength);
+    memcpy(result->chars, textChars(a), aLength);
+    memcpy(result->chars + aLength, textChars(b), bLength);
+    return finishString(result);
+}
+
+// Walks the leaves of a rope left to right. Leaves are strings or views. The
+// stack never holds more than one node per level, and rebalancing keeps the
+// depth bounded.
+typedef struct
+{
+    Obj *stack[ROPE_MAX_DEPTH + 2];
+    int count;
+} LeafIterator;
+
+static void pushLeftSpine(LeafIterator *iterator, Obj *node)
+{
+    node = textNode(node);
+    while (node->type == OBJ_ROPE)
+    {
+        iterator->stack[iterator->count++] = node;
+        node = textNode(((ObjRope *)node)->left);
+    }
+    iterator->stack[iterator->count++] = node;
+}
+
+static Obj *nextLeaf(LeafIterator *iterator)
+{
+    if (iterator->count == 0)
+        return NULL;
+
+    Obj *leaf = iterator->stack[--iterator->count];
+    if (iterator->count > 0)
+    {
+        ObjRope *parent = (ObjRope *)iterator->stack[--iterator->count];
+        pushLeftSpine(iterator, parent->right);
+    }
+    return leaf;
+}
+
+static Obj *buildBalanced(Obj **leaves, int start, int end)
+{
+    if (end - start == 1)
+        return leaves[start];
+
+    int middle = start + (end - start) / 2;
+    return (Obj *)newRope(buildBalanced(leaves, start, middle),
+                          buildBalanced(leaves, middle, end));
+}
+
+static Obj *rebalance(ObjRope *rope)
+{
+    int capacity = 64;
+    int count = 0;
+    Obj **leaves = ALLOCATE(Obj *, capacity, MEM_OTHER);
+
+    LeafIterator iterator = {.count = 0};
+    pushLeftSpine(&iterator, (Obj *)rope);
+    for (Obj *leaf = nextLeaf(&iterator); leaf != NULL;
+         leaf = nextLeaf(&iterator))
+    {
+        if (count == capacity)
+        {
+            leaves = GROW_ARRAY(Obj *, leaves, capacity, capacity * 2,
+                                MEM_OTHER);
+            capacity *= 2;
+        }
+        leaves[count++] = leaf;
+    }
+
+    Obj *balanced = buildBalanced(leaves, 0, count);
+    FREE_ARRAY(Obj *, leaves, capacity, MEM_OTHER);
+    return balanced;
+}
+
+Obj *concatenateText(Obj *a, Obj *b)
+{
+    a = textNode(a);
+    b = textNode(b);
+
+    if (textLength(a) + textLength(b) < ROPE_MIN_LENGTH)
+        return (Obj *)joinText(a, b);
+
+    // Appending a short piece merges it into the rightmost leaf rather than
+    // growing the rope by another level.
+    if (b->type == OBJ_STRING && ((ObjString *)b)->length < ROPE_LEAF_MAX)
+    {
+        ObjString *tail = (ObjString *)b;
+        if (a->type == OBJ_STRING &&
+            ((ObjString *)a)->length + tail->length <= ROPE_LEAF_MAX)
+            return (Obj *)joinText(a, b);
+
+        if (a->type == OBJ_ROPE)
+        {
+            ObjRope *rope = (ObjRope *)a;
+            Obj *right = textNode(rope->right);
+            if (right->type == OBJ_STRING &&
+                ((ObjString *)right)->length + tail->length <= ROPE_LEAF_MAX)
+                return (Obj *)newRope(rope->left,
+                                      (Obj *)joinText(right, b));
+        }
+    }
+
+    ObjRope *rope = newRope(a, b);
+    if (rope->depth > ROPE_MAX_DEPTH)
+        return rebalance(rope);
+    return (Obj *)rope;
+}
+
+static ObjString *flattenView(ObjView *view)
+{
+    if (view->flat == NULL)
+    {
+        ObjString *string = makeString(view->length);
+        memcpy(string->chars, view->parent->chars + view->start, view->length);
+        if (vm->lender != NULL)
+            return finishString(string);
+        view->flat = finishString(string);
+    }
+    return view->flat;
+}
+
+ObjString *flattenText(Obj *text)
+{
+    if (text->type == OBJ_STRING)
+        return (ObjString *)text;
+    if (text->type == OBJ_VIEW)
+        return flattenView((ObjView *)text);
+
+    ObjRope *rope = (ObjRope *)text;
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    ObjString *string = makeString(rope->length);
+    char *dest = string->chars;
+
+    LeafIterator iterator = {.count = 0};
+    pushLeftSpine(&iterator, text);
+    for (Obj *leaf = nextLeaf(&iterator); leaf != NULL;
+         leaf = nextLeaf(&iterator))
+    {
+        memcpy(dest, textChars(leaf), textLength(leaf));
+        dest += textLength(leaf);
+    }
+
+    if (vm->lender != NULL)
+        return finishString(string);
+    rope->flat = finishString(string);
+    return rope->flat;
+}
+
+static ObjView *allocateView(ObjString *parent, int start, int length)
+{
+    ObjView *view = ALLOCATE_OBJ(ObjView, OBJ_VIEW);
+    view->parent = parent;
+    view->start = start;
+    view->length = length;
+    view->flat = NULL;
+    return view;
+}
+
+// Finds the flat string a slice of text can point into, adjusting start to
+// be relative to it.
+static ObjString *viewParent(Obj *text, int *start)
+{
+    text = textNode(text);
+    if (text->type == OBJ_VIEW)
+    {
+        ObjView *view = (ObjView *)text;
+        *start += view->start;
+        return view->parent;
+    }
+    return flattenText(text);
+}
+
+Obj *sliceText(Obj *text, int start, int length)
+{
+    if (start == 0 && length == textLength(text))
+        return text;
+
+    ObjString *parent = viewParent(text, &start);
+    return (Obj *)allocateView(parent, start, length);
+}
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+Obj *trimText(Obj *text)
+{
+    const char *chars = textChars(text);
+    int start = 0;
+    int end = textLength(text);
+    while (start < end && isSpace(chars[start]))
+        start++;
+    while (end > start && isSpace(chars[end - 1]))
+        end--;
+    return sliceText(text, start, end - start);
+}
+
+// Splits text on every occurrence of separator, which must not be empty.
+// The fields are views keyed by their position, starting at 0.
+ObjMap *splitText(Obj *text, Obj *separator)
+{
+    int start = 0;
+    ObjString *parent = viewParent(text, &start);
+    const char *chars = parent->chars + start;
+    int length = textLength(text);
+    const char *sep = textChars(separator);
+    int sepLength = textLength(separator);
+
+    ObjMap *fields = newMap();
+    int field = 0;
+    int fieldStart = 0;
+    for (int i = 0; i + sepLength <= length;)
+    {
+        const char *match =
+            memchr(chars + i, sep[0], length - sepLength + 1 - i);
+        if (match == NULL)
+            break;
+
+        i = (int)(match - chars);
+        if (memcmp(match, sep, sepLength) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        ObjView *view =
+            allocateView(parent, start + fieldStart, i - fieldStart);
+        mapSet(fields, INT_VAL(field++), OBJ_VAL(view));
+        i += sepLength;
+        fieldStart = i;
+    }
+    ObjView *last =
+        allocateView(parent, start + fieldStart, length - fieldStart);
+    mapSet(fields, INT_VAL(field), OBJ_VAL(last));
+    return fields;
+}
+
+static bool stringsEqual(ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+    if (a->length != b->length || (a->interned && b->interned))
+        return false;
+
+    // Hashes are cached on the strings, so comparing them first makes
+    // repeated comparisons of unequal strings cheap.
+    if (stringHash(a) != stringHash(b))
+        return false;
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+bool objectsEqual(Obj *a, Obj *b)
+{
+    if (a == b)
+        return true;
+
+    bool aText = a->type == OBJ_STRING || a->type == OBJ_ROPE ||
+                 a->type == OBJ_VIEW;
+    bool bText = b->type == OBJ_STRING || b->type == OBJ_ROPE ||
+                 b->type == OBJ_VIEW;
+    if (!aText || !bText || textLength(a) != textLength(b))
+        return false;
+
+    // Views are compared in place rather than flattened.
+    if (a->type == OBJ_VIEW || b->type == OBJ_VIEW)
+        return memcmp(textChars(a), textChars(b), textLength(a)) == 0;
+    return stringsEqual(flattenText(a), flattenText(b));
 }
 
 void printObject(Value value)
@@ -78,5 +658,35 @@ void printObject(Value value)
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
+    case OBJ_ROPE:
+        printf("%s", flattenText(AS_OBJ(value))->chars);
+        break;
+    case OBJ_VIEW:
+        printf("%.*s", AS_VIEW(value)->length, textChars(AS_OBJ(value)));
+        break;
+    case OBJ_MAP:
+        printMap(AS_MAP(value));
+        break;
+    case OBJ_ARRAY:
+        printArray(AS_ARRAY(value));
+        break;
+    case OBJ_SHAPE:
+        printf("<shape>");
+        break;
+    case OBJ_CLASS:
+        printf("<class %s>", AS_CLASS(value)->name->chars);
+        break;
+    case OBJ_INSTANCE:
+        printInstance(AS_INSTANCE(value));
+        break;
+    case OBJ_FUNCTION:
+        printf("<fn %s>", AS_FUNCTION(value)->name->chars);
+        break;
+    case OBJ_COROUTINE:
+        printf("<coroutine>");
+        break;
+    case OBJ_CHANNEL:
+        printf("<channel>");
+        break;
     }
 }
\ No newline at end of file
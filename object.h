@@ -1,19 +1,59 @@
 #ifndef xasm_object_h
 #define xasm_object_h
 
+#include "chunk.h"
 #include "common.h"
 #include "value.h"
 
+typedef struct VM VM;
+typedef struct Channel Channel;
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_VIEW(value) isObjType(value, OBJ_VIEW)
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value) || IS_VIEW(value))
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_VIEW(value) ((ObjView *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_COROUTINE(value) ((ObjCoroutine *)AS_OBJ(value))
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
+
+// Concatenations shorter than this are built flat.
+#define ROPE_MIN_LENGTH 64
+// Adjacent leaves are merged while the merged leaf stays within this size.
+#define ROPE_LEAF_MAX 512
+// Ropes deeper than this are rebalanced.
+#define ROPE_MAX_DEPTH 48
 
 typedef enum
 {
     OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_VIEW,
+    OBJ_MAP,
+    OBJ_ARRAY,
+    OBJ_SHAPE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_FUNCTION,
+    OBJ_COROUTINE,
+    OBJ_CHANNEL,
 } ObjType;
 
 struct Obj
@@ -22,16 +62,219 @@ struct Obj
     struct Obj *next;
 };
 
+// The characters are stored inline after the header, so a string is a
+// single allocation and comparing it touches one cache line less. hash is
+// only valid once hashed is set; see stringHash().
 struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    bool hashed;
+    bool interned;
+    char chars[];
+};
+
+// A deferred concatenation of two texts (strings or ropes). It is flattened
+// into a real string only when the characters are needed, and the result is
+// cached in flat.
+typedef struct
+{
+    Obj obj;
+    int length;
+    int depth;
+    Obj *left;
+    Obj *right;
+    ObjString *flat;
+} ObjRope;
+
+// A slice of a string that shares the parent's characters instead of copying
+// them. The parent is always a flat string, never another view or a rope. A
+// real string is only made when one is needed, for hashing or as a map key,
+// and is cached in flat.
+typedef struct
+{
+    Obj obj;
+    int length;
+    int start;
+    ObjString *parent;
+    ObjString *flat;
+} ObjView;
+
+// Operand of OP_STRING_OP.
+typedef enum
+{
+    STRING_SUBSTRING,
+    STRING_SPLIT,
+    STRING_TRIM,
+} StringOp;
+
+// An insertion-ordered dictionary. Entries are kept densely in insertion
+// order with unboxed keys and values, and their value types are packed into
+// one byte per entry. A separate open-addressed index maps hashes to entry
+// positions using 1, 2 or 4-byte slots depending on its size.
+typedef struct
+{
+    ValueAs key;
+    ValueAs value;
+} MapEntry;
+
+struct ObjMap
+{
+    Obj obj;
+    int count;
+    int entryCount;
+    int entryCapacity;
+    MapEntry *entries;
+    uint8_t *kinds;
+    int indexCapacity;
+    int indexWidth;
+    void *index;
+};
+
+// A fixed-length array of unboxed numbers of a single type: int, float or
+// byte. The elements follow the header, so bulk operations can run SIMD
+// kernels straight over them.
+struct ObjArray
+{
+    Obj obj;
+    ValueType elementType;
+    int count;
+    _Alignas(16) uint8_t elements[];
 };
 
-ObjString *takeString(char *chars, int length);
-ObjString *copyString(const char *chars, int length);
+// The layout of an instance: which field lives in which slot. Shapes form a
+// tree per class, where each child adds one field to its parent, so
+// instances that gained the same fields in the same order share a shape and
+// a field access can be cached per shape.
+struct ObjShape
+{
+    Obj obj;
+    ObjShape *parent;
+    ObjMap *transitions; // field name -> child shape, created on demand
+    int slotCount;
+    ObjString *names[]; // names[slot], one per field
+};
+
+typedef struct
+{
+    Obj obj;
+    ObjString *name;
+    // The shape new instances start with: the root shape plus the fields
+    // declared in the class body.
+    ObjShape *shape;
+    // The most slots any instance has needed, used to size new instances.
+    int slotHint;
+} ObjClass;
+
+typedef struct
+{
+    Obj obj;
+    ObjClass *klass;
+    ObjShape *shape;
+    int capacity;
+    Value *fields;
+} ObjInstance;
+
+// A compiled function. Its chunk is allocated outside the heap arena, so it
+// has to be released explicitly; the VM keeps its functions on a list of
+// their own for that, see releaseFunctions().
+typedef struct ObjFunction
+{
+    Obj obj;
+    int arity;
+    Chunk chunk;
+    ObjString *name;
+    struct ObjFunction *nextFunction;
+} ObjFunction;
+
+// One active call. slots points into the VM stack at the callee, followed by
+// its arguments and locals, so arguments are never copied. The top-level
+// script runs in a frame with no function.
+typedef struct
+{
+    ObjFunction *function;
+    Chunk *chunk;
+    uint8_t *ip;
+    Value *slots;
+    FieldCache *caches; // the chunk's field caches as seen by this VM
+} CallFrame;
+
+typedef enum
+{
+    COROUTINE_READY,   // queued to run
+    COROUTINE_RUNNING,
+    COROUTINE_PARKED,  // halted, waiting for a wake
+    COROUTINE_DONE,
+} CoroutineState;
+
+// A script function running as a cooperative task. While it is suspended
+// its part of the VM stack and its frames are kept here, in arrays that
+// grow with the deepest point it has been suspended at, so a parked
+// coroutine costs only the values it actually holds. Frame slots still
+// point into the VM stack: a coroutine always resumes at the bottom of the
+// stack of the VM that created it.
+typedef struct ObjCoroutine
+{
+    Obj obj;
+    CoroutineState state;
+    // Delivered as the result of pause() or halt() when it resumes.
+    Value transfer;
+    bool started;
+    // Parked in send() or recv(), which runs again when it resumes.
+    bool channelWait;
+    // Stopped by running out of fuel, and goes on where it was.
+    bool preempted;
+    int stackCount;
+    int stackCapacity;
+    Value *stack;
+    int frameCount;
+    int frameCapacity;
+    CallFrame *frames;
+    struct ObjCoroutine *next; // run queue link
+} ObjCoroutine;
+
+// A script's handle on a Channel. The channel itself is shared between VMs
+// and belongs to the host.
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+ObjMap *newMap();
+ObjFunction *newFunction();
+ObjCoroutine *newCoroutine(ObjFunction *function);
+ObjChannel *wrapChannel(Channel *channel);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+ObjClass *newClass(ObjString *name);
+ObjInstance *newInstance(ObjClass *klass);
+ObjArray *newArray(ValueType elementType, int count);
+int arrayElementSize(ValueType elementType);
+// Strings built at runtime are allocated with room for their characters,
+// filled in place, and then handed to finishString().
+ObjString *makeString(int length);
+ObjString *finishString(ObjString *string);
+ObjString *internString(ObjString *string);
+ObjString *findString(const char *chars, int length, uint32_t hash);
+uint32_t stringHash(ObjString *string);
+// Interns a copy of chars in the given VM, which host code uses to hand
+// strings to a script.
+ObjString *copyString(VM *instance, const char *chars, int length);
+// The same, given the hashBytes() of chars computed earlier, such as one read
+// from a bytecode file.
+// Copies chars into a new string of the given VM the way strings built at
+// runtime are made, so it is interned only once it is hashed or compared.
+ObjString *copyRuntimeString(VM *instance, const char *chars, int length);
+ObjString *copyHashedString(VM *instance, const char *chars, int length,
+                            uint32_t hash);
+int textLength(Obj *text);
+Obj *concatenateText(Obj *a, Obj *b);
+ObjString *flattenText(Obj *text);
+Obj *sliceText(Obj *text, int start, int length);
+Obj *trimText(Obj *text);
+ObjMap *splitText(Obj *text, Obj *separator);
+bool objectsEqual(Obj *a, Obj *b);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type)
@@ -0,0 +1,310 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "parallel.h"
+#include "random.h"
+#include "table.h"
+#include "vm.h"
+
+typedef struct
+{
+  VM *owner;
+  ObjFunction *body;
+  int argCount;
+  Value args[2 + PARALLEL_ACCUMULATORS_MAX];
+  uint64_t seed;
+  InterpretResult result;
+} Task;
+
+// A VM that runs ranges of a parallel for, and the thread that runs them
+// for as long as the owner keeps its helpers. The thread creates, resets
+// and frees the VM itself, so the memory it uses is counted there. The
+// first helper, and any whose thread could not be started, run on the
+// owner's thread instead.
+struct ParallelHelper
+{
+  VM instance;
+  bool ready; // instance has been initialised
+  bool threaded;
+  pthread_t thread;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  // The range to run, guarded by lock; cleared once it has run.
+  Task *task;
+  bool stopping;
+};
+
+static int workerCount()
+{
+  int workers = vm->parallelism;
+  if (workers <= 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? (int)cpus : 1;
+  }
+  return workers < PARALLEL_WORKERS_MAX ? workers : PARALLEL_WORKERS_MAX;
+}
+
+// Empties a helper and lends it the owner's globals and strings.
+static void prepareHelper(VM *owner, VM *helper, uint64_t seed)
+{
+  resetVM(helper);
+  VM *previous = vm;
+  switchVM(helper);
+  tableClone(&owner->globals, &helper->globals);
+  switchVM(previous);
+  helper->lender = owner;
+  helper->interns = owner->interns;
+  if (owner->program != NULL)
+    loadProgram(helper, (Program *)owner->program);
+  seedRandom(&helper->random, seed);
+  helper->fuel = owner->fuel;
+}
+
+static void runRange(ParallelHelper *helper, Task *task)
+{
+  if (!helper->ready)
+  {
+    initVM(&helper->instance);
+    checkpointVM(&helper->instance);
+    helper->ready = true;
+  }
+  prepareHelper(task->owner, &helper->instance, task->seed);
+  task->result = callFunction(&helper->instance, task->body, task->argCount,
+                              task->args);
+}
+
+static void *helperThread(void *arg)
+{
+  ParallelHelper *helper = (ParallelHelper *)arg;
+
+  pthread_mutex_lock(&helper->lock);
+  for (;;)
+  {
+    while (helper->task == NULL && !helper->stopping)
+      pthread_cond_wait(&helper->wake, &helper->lock);
+    if (helper->task == NULL)
+      break;
+
+    Task *task = helper->task;
+    pthread_mutex_unlock(&helper->lock);
+    runRange(helper, task);
+    pthread_mutex_lock(&helper->lock);
+    helper->task = NULL;
+    pthread_cond_signal(&helper->finished);
+  }
+  pthread_mutex_unlock(&helper->lock);
+
+  if (helper->ready)
+    freeVM(&helper->instance);
+  return NULL;
+}
+
+static void ensureHelpers(VM *owner, int count)
+{
+  if (owner->helperCount >= count)
+    return;
+
+  ParallelHelper **helpers = ALLOCATE(ParallelHelper *, count, MEM_OTHER);
+  for (int i = 0; i < owner->helperCount; i++)
+    helpers[i] = owner->helpers[i];
+  for (int i = owner->helperCount; i < count; i++)
+  {
+    ParallelHelper *helper = ALLOCATE(ParallelHelper, 1, MEM_OTHER);
+    helper->ready = false;
+    helper->task = NULL;
+    helper->stopping = false;
+    pthread_mutex_init(&helper->lock, NULL);
+    pthread_cond_init(&helper->wake, NULL);
+    pthread_cond_init(&helper->finished, NULL);
+    helper->threaded =
+        i > 0 &&
+        pthread_create(&helper->thread, NULL, helperThread, helper) == 0;
+    helpers[i] = helper;
+  }
+  FREE_ARRAY(ParallelHelper *, owner->helpers, owner->helperCount,
+             MEM_OTHER);
+  owner->helpers = helpers;
+  owner->helperCount = count;
+}
+
+static double toDouble(Value value)
+{
+  switch (value.type)
+  {
+  case VAL_BYTE:
+    return AS_BYTE(value);
+  case VAL_INT:
+    return AS_INT(value);
+  default:
+    return AS_FLOAT(value);
+  }
+}
+
+static int toInt(Value value)
+{
+  return IS_BYTE(value) ? AS_BYTE(value) : AS_INT(value);
+}
+
+static Value reduce(ReduceOp op, Value a, Value b)
+{
+  bool floats = IS_FLOAT(a) || IS_FLOAT(b);
+  switch (op)
+  {
+  case REDUCE_ADD:
+    return floats ? FLOAT_VAL((float)(toDouble(a) + toDouble(b)))
+                  : INT_VAL(toInt(a) + toInt(b));
+  case REDUCE_MUL:
+    return floats ? FLOAT_VAL((float)(toDouble(a) * toDouble(b)))
+                  : INT_VAL(toInt(a) * toInt(b));
+  case REDUCE_MIN:
+    return toDouble(b) < toDouble(a) ? b : a;
+  case REDUCE_MAX:
+    return toDouble(b) > toDouble(a) ? b : a;
+  }
+  return a;
+}
+
+const char *runParallel(ObjFunction *body, Value start, Value end, int count,
+                        const uint8_t *ops, Value *accumulators)
+{
+  if (!(IS_INT(start) || IS_BYTE(start)) || !(IS_INT(end) || IS_BYTE(end)))
+    return "Parallel for bounds must be integers.";
+  for (int i = 0; i < count; i++)
+  {
+    if (!IS_NUMBER(accumulators[i]))
+      return "Parallel for accumulators must be numbers.";
+  }
+
+  int from = toInt(start);
+  long total = (long)toInt(end) - from;
+  if (total <= 0)
+    return NULL;
+
+  int workers = workerCount();
+  if (workers > total)
+    workers = (int)total;
+  VM *owner = vm;
+  ensureHelpers(owner, workers);
+
+  Task tasks[PARALLEL_WORKERS_MAX];
+  for (int w = 0; w < workers; w++)
+  {
+    Task *task = &tasks[w];
+    task->owner = owner;
+    task->body = body;
+    task->argCount = 2 + count;
+    task->args[0] = INT_VAL(from + (int)(total * w / workers));
+    task->args[1] = INT_VAL(from + (int)(total * (w + 1) / workers));
+    // Sums and products start from their identity, so the owner's value is
+    // counted once; minimums and maximums may start from it in every range.
+    for (int i = 0; i < count; i++)
+    {
+      Value initial = accumulators[i];
+      if (ops[i] == REDUCE_ADD)
+        initial = INT_VAL(0);
+      else if (ops[i] == REDUCE_MUL)
+        initial = INT_VAL(1);
+      task->args[2 + i] = initial;
+    }
+    task->seed = randomNext(&owner->random);
+  }
+
+  for (int w = 0; w < workers; w++)
+  {
+    ParallelHelper *helper = owner->helpers[w];
+    if (!helper->threaded)
+      continue;
+    pthread_mutex_lock(&helper->lock);
+    helper->task = &tasks[w];
+    pthread_cond_signal(&helper->wake);
+    pthread_mutex_unlock(&helper->lock);
+  }
+  // The calling thread runs the ranges that have no thread of their own.
+  for (int w = 0; w < workers; w++)
+  {
+    if (!owner->helpers[w]->threaded)
+      runRange(owner->helpers[w], &tasks[w]);
+  }
+  for (int w = 0; w < workers; w++)
+  {
+    ParallelHelper *helper = owner->helpers[w];
+    if (!helper->threaded)
+      continue;
+    pthread_mutex_lock(&helper->lock);
+    while (helper->task != NULL)
+      pthread_cond_wait(&helper->finished, &helper->lock);
+    pthread_mutex_unlock(&helper->lock);
+  }
+
+  // Each range could use all of the owner's fuel; the owner pays for what
+  // they used together.
+  int64_t fuel = owner->fuel;
+  bool outOfFuel = false;
+  for (int w = 0; w < workers; w++)
+  {
+    fuel -= owner->fuel - owner->helpers[w]->instance.fuel;
+    outOfFuel |= tasks[w].result == INTERPRET_OUT_OF_FUEL;
+  }
+  owner->fuel = fuel > 0 ? fuel : 0;
+  if (outOfFuel)
+    return "A parallel for ran out of fuel.";
+  for (int w = 0; w < workers; w++)
+  {
+    if (tasks[w].result != INTERPRET_OK)
+      return "A parallel for range failed.";
+  }
+  // A range may have stored anything in its accumulators, and an object
+  // would point into a helper heap that the next range resets.
+  for (int w = 0; w < workers; w++)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      if (!IS_NUMBER(owner->helpers[w]->instance.parallelResults[i]))
+        return "Parallel for accumulators must be numbers.";
+    }
+  }
+  for (int w = 0; w < workers; w++)
+  {
+    for (int i = 0; i < count; i++)
+      accumulators[i] = reduce((ReduceOp)ops[i], accumulators[i],
+                               owner->helpers[w]->instance.parallelResults[i]);
+  }
+  return NULL;
+}
+
+void setParallelism(VM *instance, int workers)
+{
+  instance->parallelism = workers;
+}
+
+void freeParallelHelpers(VM *instance)
+{
+  for (int i = 0; i < instance->helperCount; i++)
+  {
+    ParallelHelper *helper = instance->helpers[i];
+    if (helper->threaded)
+    {
+      pthread_mutex_lock(&helper->lock);
+      helper->stopping = true;
+      pthread_cond_signal(&helper->wake);
+      pthread_mutex_unlock(&helper->lock);
+      pthread_join(helper->thread, NULL);
+    }
+    else if (helper->ready)
+    {
+      freeVM(&helper->instance);
+    }
+    pthread_mutex_destroy(&helper->lock);
+    pthread_cond_destroy(&helper->wake);
+    pthread_cond_destroy(&helper->finished);
+    FREE(ParallelHelper, helper, MEM_OTHER);
+  }
+  FREE_ARRAY(ParallelHelper *, instance->helpers, instance->helperCount,
+             MEM_OTHER);
+  instance->helpers = NULL;
+  instance->helperCount = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef xasm_parallel_h
+#define xasm_parallel_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#define PARALLEL_ACCUMULATORS_MAX 16
+#define PARALLEL_WORKERS_MAX 64
+
+typedef struct ParallelHelper ParallelHelper;
+
+// How a parallel for combines an accumulator's partial results; operands
+// of OP_PARALLEL.
+typedef enum
+{
+  REDUCE_ADD,
+  REDUCE_MUL,
+  REDUCE_MIN,
+  REDUCE_MAX,
+} ReduceOp;
+
+// Runs body, compiled from a parallel for, over [start, end) on the current
+// VM's helpers, one contiguous range each, and combines their
+// accumulators into accumulators. The helpers read the VM's globals and
+// strings while it waits, so the body must not write to objects it did not
+// create. The ranges share the VM's fuel, and running out of it fails the
+// loop rather than pausing it. Returns an error message, or NULL.
+const char *runParallel(ObjFunction *body, Value start, Value end, int count,
+                        const uint8_t *ops, Value *accumulators);
+// The number of threads a parallel for uses; 0, the default, means one per
+// online processor.
+void setParallelism(VM *instance, int workers);
+// Stops the helpers' threads, which free their VMs.
+void freeParallelHelpers(VM *instance);
+
+#endif
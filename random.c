@@ -0,0 +1,208 @@
+#include <string.h>
+
+#include "array.h"
+#include "random.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RANDOM_X86
+#include <immintrin.h>
+#endif
+
+// Bytes produced by one step of all lanes.
+#define STEP_BYTES (RANDOM_LANES * sizeof(uint64_t))
+
+static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+static uint64_t splitMix(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t next(uint64_t s[4])
+{
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+// Advances s by 2^128 steps.
+static void jump(uint64_t s[4])
+{
+  static const uint64_t polynomial[] = {0x180ec6d33cfd0abaull,
+                                        0xd5a61266f0c9392cull,
+                                        0xa9582618e03fc9aaull,
+                                        0x39abdc4529b1661cull};
+  uint64_t t[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; i++)
+  {
+    for (int bit = 0; bit < 64; bit++)
+    {
+      if (polynomial[i] & (1ull << bit))
+      {
+        for (int w = 0; w < 4; w++)
+          t[w] ^= s[w];
+      }
+      next(s);
+    }
+  }
+  memcpy(s, t, sizeof(t));
+}
+
+void seedRandom(Random *random, uint64_t seed)
+{
+  for (int w = 0; w < 4; w++)
+    random->s[w] = splitMix(&seed);
+
+  uint64_t lane[4];
+  memcpy(lane, random->s, sizeof(lane));
+  for (int l = 0; l < RANDOM_LANES; l++)
+  {
+    jump(lane);
+    for (int w = 0; w < 4; w++)
+      random->lanes[w][l] = lane[w];
+  }
+}
+
+uint64_t randomNext(Random *random) { return next(random->s); }
+
+uint32_t randomBelow(Random *random, uint32_t bound)
+{
+  // Multiply-shift maps 32 random bits onto [0, bound). The few products
+  // whose low half falls under 2^32 mod bound would make some results more
+  // likely than others, so those are drawn again.
+  uint64_t product = (randomNext(random) >> 32) * (uint64_t)bound;
+  if ((uint32_t)product < bound)
+  {
+    uint32_t threshold = -bound % bound;
+    while ((uint32_t)product < threshold)
+      product = (randomNext(random) >> 32) * (uint64_t)bound;
+  }
+  return (uint32_t)(product >> 32);
+}
+
+float randomFloat(Random *random)
+{
+  return (float)(randomNext(random) >> 40) * 0x1p-24f;
+}
+
+// Lane kernels. Each step advances every lane once and writes STEP_BYTES:
+// the lanes' 64-bit outputs in lane order, or, for floats, each output's
+// low then high 32 bits scaled into [0, 1). Both kernels produce the same
+// bytes.
+
+static void fillScalar(uint64_t lanes[4][RANDOM_LANES], uint8_t *out,
+                       size_t steps, bool floats)
+{
+  for (size_t i = 0; i < steps; i++, out += STEP_BYTES)
+  {
+    for (int l = 0; l < RANDOM_LANES; l++)
+    {
+      uint64_t result = rotl(lanes[1][l] * 5, 7) * 9;
+      uint64_t t = lanes[1][l] << 17;
+      lanes[2][l] ^= lanes[0][l];
+      lanes[3][l] ^= lanes[1][l];
+      lanes[1][l] ^= lanes[2][l];
+      lanes[0][l] ^= lanes[3][l];
+      lanes[2][l] ^= t;
+      lanes[3][l] = rotl(lanes[3][l], 45);
+
+      if (floats)
+      {
+        float pair[2] = {(float)((uint32_t)result >> 8) * 0x1p-24f,
+                         (float)((uint32_t)(result >> 32) >> 8) * 0x1p-24f};
+        memcpy(out + l * sizeof(result), pair, sizeof(pair));
+      }
+      else
+      {
+        memcpy(out + l * sizeof(result), &result, sizeof(result));
+      }
+    }
+  }
+}
+
+#ifdef RANDOM_X86
+__attribute__((target("avx2"))) static __m256i rotlAvx2(__m256i x, int k)
+{
+  return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+}
+
+__attribute__((target("avx2"))) static void
+fillAvx2(uint64_t lanes[4][RANDOM_LANES], uint8_t *out, size_t steps,
+         bool floats)
+{
+  __m256i s0 = _mm256_load_si256((const __m256i *)lanes[0]);
+  __m256i s1 = _mm256_load_si256((const __m256i *)lanes[1]);
+  __m256i s2 = _mm256_load_si256((const __m256i *)lanes[2]);
+  __m256i s3 = _mm256_load_si256((const __m256i *)lanes[3]);
+  const __m256 scale = _mm256_set1_ps(0x1p-24f);
+
+  for (size_t i = 0; i < steps; i++, out += STEP_BYTES)
+  {
+    // AVX2 has no 64-bit multiply; x * 5 and x * 9 are a shift and an add.
+    __m256i x = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+    x = rotlAvx2(x, 7);
+    x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+
+    __m256i t = _mm256_slli_epi64(s1, 17);
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = rotlAvx2(s3, 45);
+
+    if (floats)
+    {
+      __m256 f = _mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8));
+      _mm256_storeu_ps((float *)out, _mm256_mul_ps(f, scale));
+    }
+    else
+    {
+      _mm256_storeu_si256((__m256i *)out, x);
+    }
+  }
+
+  _mm256_store_si256((__m256i *)lanes[0], s0);
+  _mm256_store_si256((__m256i *)lanes[1], s1);
+  _mm256_store_si256((__m256i *)lanes[2], s2);
+  _mm256_store_si256((__m256i *)lanes[3], s3);
+}
+#endif
+
+static void fillLanes(Random *random, uint8_t *out, size_t steps, bool floats)
+{
+#ifdef RANDOM_X86
+  if (arrayKernel() == ARRAY_KERNEL_AVX2)
+  {
+    fillAvx2(random->lanes, out, steps, floats);
+    return;
+  }
+#endif
+  fillScalar(random->lanes, out, steps, floats);
+}
+
+void randomFill(Random *random, ObjArray *array)
+{
+  size_t bytes =
+      (size_t)array->count * arrayElementSize(array->elementType);
+  bool floats = array->elementType == VAL_FLOAT;
+  size_t steps = bytes / STEP_BYTES;
+  fillLanes(random, array->elements, steps, floats);
+
+  size_t rest = bytes - steps * STEP_BYTES;
+  if (rest > 0)
+  {
+    _Alignas(32) uint8_t tail[STEP_BYTES];
+    fillLanes(random, tail, 1, floats);
+    memcpy(array->elements + steps * STEP_BYTES, tail, rest);
+  }
+}
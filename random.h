@@ -0,0 +1,32 @@
+#ifndef xasm_random_h
+#define xasm_random_h
+
+#include "common.h"
+#include "object.h"
+
+#define RANDOM_LANES 4
+#define RANDOM_DEFAULT_SEED 0x5851f42d4c957f2dull
+
+// xoshiro256** state. Single draws come from s; bulk fills run RANDOM_LANES
+// further generators side by side, each a 2^128-step jump apart, so they
+// vectorize without overlapping the main stream. lanes is word-major:
+// lanes[w][l] is word w of lane l.
+typedef struct
+{
+  uint64_t s[4];
+  _Alignas(32) uint64_t lanes[4][RANDOM_LANES];
+} Random;
+
+// The same seed always gives the same stream, on every kernel.
+void seedRandom(Random *random, uint64_t seed);
+uint64_t randomNext(Random *random);
+// Uniform in [0, bound), without modulo bias. bound must be positive.
+uint32_t randomBelow(Random *random, uint32_t bound);
+// Uniform in [0, 1) with 24 bits of precision.
+float randomFloat(Random *random);
+
+// Fills an array from the lane generators: floats in [0, 1), ints and bytes
+// over their whole range. Uses the AVX2 kernel when arrayKernel() selects it.
+void randomFill(Random *random, ObjArray *array);
+
+#endif
@@ -10,7 +10,7 @@ typedef struct {
   int line;
 } Scanner;
 
-Scanner scanner;
+static _Thread_local Scanner scanner;
 
 void initScanner(const char *source) {
   scanner.start = source;
@@ -133,7 +133,15 @@ static TokenType identifierType() {
       }
     }
   case 'd':
-    return checkKeyword(1, 1, "o", TOKEN_DO);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'e':
+        return checkKeyword(2, 4, "lete", TOKEN_DELETE);
+      case 'o':
+        return checkKeyword(2, 0, "", TOKEN_DO);
+      }
+    }
+    break;
   case 'e':
     return checkKeyword(1, 3, "lse", TOKEN_ELSE);
   case 'f':
@@ -149,13 +157,29 @@ static TokenType identifierType() {
     }
     break;
   case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'f':
+        return checkKeyword(2, 0, "", TOKEN_IF);
+      case 'n':
+        return checkKeyword(2, 0, "", TOKEN_IN);
+      }
+    }
+    break;
   case 'n':
     return checkKeyword(1, 2, "il", TOKEN_NIL);
   case 'o':
     return checkKeyword(1, 1, "r", TOKEN_OR);
   case 'p':
-    return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'a':
+        return checkKeyword(2, 6, "rallel", TOKEN_PARALLEL);
+      case 'r':
+        return checkKeyword(2, 3, "int", TOKEN_PRINT);
+      }
+    }
+    break;
   case 'r':
     return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
   case 's':
@@ -244,6 +268,10 @@ Token scanToken() {
     return makeToken(TOKEN_LEFT_BRACE);
   case '}':
     return makeToken(TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(TOKEN_RIGHT_BRACKET);
   case ';':
     return makeToken(TOKEN_SEMICOLON);
   case ',':
@@ -8,6 +8,8 @@ typedef enum
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -38,13 +40,16 @@ typedef enum
   TOKEN_AND,
   TOKEN_CLASS,
   TOKEN_CONST,
+  TOKEN_DELETE,
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
   TOKEN_FUN,
   TOKEN_IF,
+  TOKEN_IN,
   TOKEN_NIL,
   TOKEN_OR,
+  TOKEN_PARALLEL,
   TOKEN_PRINT,
   TOKEN_RETURN,
   TOKEN_SUPER,
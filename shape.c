@@ -0,0 +1,70 @@
+#include <stdio.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+#include "value.h"
+
+int shapeSlot(ObjShape *shape, ObjString *name)
+{
+    // Names are interned and records have few fields, so a scan of the
+    // pointers beats hashing. Inline caches make this the slow path anyway.
+    for (int slot = shape->slotCount - 1; slot >= 0; slot--)
+    {
+        if (shape->names[slot] == name)
+            return slot;
+    }
+    return -1;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name)
+{
+    Value child;
+    if (shape->transitions != NULL &&
+        mapGet(shape->transitions, OBJ_VAL(name), &child))
+        return (ObjShape *)AS_OBJ(child);
+
+    if (shape->transitions == NULL)
+        shape->transitions = newMap();
+    ObjShape *next = newShape(shape, name);
+    mapSet(shape->transitions, OBJ_VAL(name), OBJ_VAL(next));
+    return next;
+}
+
+void instanceAddField(ObjInstance *instance, ObjShape *next, Value value)
+{
+    int slot = next->slotCount - 1;
+    if (slot >= instance->capacity)
+    {
+        int capacity = GROW_CAPACITY(instance->capacity);
+        Value *fields = HEAP_ALLOCATE(Value, capacity, MEM_OBJECTS);
+        for (int i = 0; i < instance->shape->slotCount; i++)
+            fields[i] = instance->fields[i];
+        HEAP_FREE_ARRAY(Value, instance->fields, instance->capacity,
+                        MEM_OBJECTS);
+        instance->fields = fields;
+        instance->capacity = capacity;
+    }
+
+    instance->fields[slot] = value;
+    instance->shape = next;
+
+    // Later instances of the class start with room for this many fields.
+    ObjClass *klass = instance->klass;
+    if (next->slotCount > klass->slotHint)
+        klass->slotHint = next->slotCount;
+}
+
+void printInstance(ObjInstance *instance)
+{
+    printf("%s {", instance->klass->name->chars);
+    for (int slot = 0; slot < instance->shape->slotCount; slot++)
+    {
+        if (slot > 0)
+            printf(", ");
+        printf("%s: ", instance->shape->names[slot]->chars);
+        printValue(instance->fields[slot]);
+    }
+    printf("}");
+}
@@ -0,0 +1,17 @@
+#ifndef xasm_shape_h
+#define xasm_shape_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Returns the slot holding name in shape, or -1.
+int shapeSlot(ObjShape *shape, ObjString *name);
+// Returns the child of shape that adds name, creating it the first time.
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+// Moves instance to next, which must be a child of its shape, storing value
+// in the new slot.
+void instanceAddField(ObjInstance *instance, ObjShape *next, Value value);
+void printInstance(ObjInstance *instance);
+
+#endif
@@ -6,16 +6,291 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef SWISS_TABLE
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bit i of a group mask is set when slot i of the group matches.
+typedef uint32_t GroupMask;
+
+static GroupMask matchByte(const int8_t *group, int8_t byte)
+{
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] == byte)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted slots are the ones with the sign bit set.
+static GroupMask matchEmptyOrDeleted(const int8_t *group)
+{
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(control);
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        if (group[i] < 0)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static int lowestBit(GroupMask mask) { return __builtin_ctz(mask); }
+
+static int8_t hashFragment(uint32_t hash) { return (int8_t)(hash & 0x7f); }
+
+static uint32_t firstGroup(uint32_t hash, int capacity)
+{
+    return (hash >> 7) & (uint32_t)(capacity - 1) & ~(uint32_t)(TABLE_GROUP_WIDTH - 1);
+}
+
+// Groups are visited in triangular order, which reaches every group when
+// the number of groups is a power of two.
+#define FOR_EACH_GROUP(group, hash, capacity)                                 \
+    for (uint32_t group = firstGroup(hash, capacity), step_ = 0;              \
+         step_ < (uint32_t)(capacity);                                        \
+         step_ += TABLE_GROUP_WIDTH,                                          \
+                  group = (group + step_) & (uint32_t)((capacity) - 1))
+
+static int maxLoad(int capacity) { return capacity - capacity / 8; }
+
 void initTable(Table *table)
 {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+    table->growthLeft = 0;
 }
 
 void freeTable(Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
+    FREE_ARRAY(int8_t, table->control, table->capacity, MEM_TABLE_ENTRIES);
+    initTable(table);
+}
+
+static int findSlot(Table *table, ObjString *key)
+{
+    if (table->count == 0)
+        return -1;
+
+    int8_t fragment = hashFragment(key->hash);
+    FOR_EACH_GROUP(group, key->hash, table->capacity)
+    {
+        const int8_t *control = table->control + group;
+        for (GroupMask mask = matchByte(control, fragment); mask != 0;
+             mask &= mask - 1)
+        {
+            int slot = group + lowestBit(mask);
+            if (table->entries[slot].key == key)
+                return slot;
+        }
+
+        if (matchByte(control, CONTROL_EMPTY) != 0)
+            return -1;
+    }
+    return -1;
+}
+
+static int findInsertSlot(Table *table, uint32_t hash)
+{
+    FOR_EACH_GROUP(group, hash, table->capacity)
+    {
+        GroupMask mask = matchEmptyOrDeleted(table->control + group);
+        if (mask != 0)
+            return group + lowestBit(mask);
+    }
+    return -1; // Unreachable while growthLeft is respected.
+}
+
+static void adjustCapacity(Table *table, int capacity)
+{
+    Entry *oldEntries = table->entries;
+    int8_t *oldControl = table->control;
+    int oldCapacity = table->capacity;
+
+    table->entries = ALLOCATE(Entry, capacity, MEM_TABLE_ENTRIES);
+    table->control = ALLOCATE(int8_t, capacity, MEM_TABLE_ENTRIES);
+    table->capacity = capacity;
+    memset(table->control, CONTROL_EMPTY, capacity);
+
+    for (int i = 0; i < oldCapacity; i++)
+    {
+        if (oldControl[i] < 0)
+            continue;
+
+        int slot = findInsertSlot(table, oldEntries[i].key->hash);
+        table->control[slot] = oldControl[i];
+        table->entries[slot] = oldEntries[i];
+    }
+    table->growthLeft = maxLoad(capacity) - table->count;
+
+    FREE_ARRAY(Entry, oldEntries, oldCapacity, MEM_TABLE_ENTRIES);
+    FREE_ARRAY(int8_t, oldControl, oldCapacity, MEM_TABLE_ENTRIES);
+}
+
+bool tableGet(Table *table, ObjString *key, Value *value)
+{
+    int slot = findSlot(table, key);
+    if (slot < 0)
+        return false;
+
+    *value = table->entries[slot].value;
+    return true;
+}
+
+bool tableSet(Table *table, ObjString *key, Value value)
+{
+    int slot = findSlot(table, key);
+    if (slot >= 0)
+    {
+        table->entries[slot].value = value;
+        return false;
+    }
+
+    if (table->growthLeft == 0)
+    {
+        // Rehash in place when tombstones rather than live entries are what
+        // used the space up.
+        int capacity = table->capacity == 0 ? TABLE_GROUP_WIDTH
+                       : table->count < maxLoad(table->capacity) / 2
+                           ? table->capacity
+                           : table->capacity * 2;
+        adjustCapacity(table, capacity);
+    }
+
+    slot = findInsertSlot(table, key->hash);
+    if (table->control[slot] == CONTROL_EMPTY)
+        table->growthLeft--;
+
+    table->control[slot] = hashFragment(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
+}
+
+void tableReserve(Table *table, int count)
+{
+    int capacity = TABLE_GROUP_WIDTH;
+    while (maxLoad(capacity) < count)
+        capacity *= 2;
+    if (capacity > table->capacity)
+        adjustCapacity(table, capacity);
+}
+
+bool tableDelete(Table *table, ObjString *key)
+{
+    int slot = findSlot(table, key);
+    if (slot < 0)
+        return false;
+
+    // A lookup stops at a group holding an empty slot, so when this group
+    // already has one the slot can become empty instead of a tombstone.
+    uint32_t group = slot & ~(TABLE_GROUP_WIDTH - 1);
+    if (matchByte(table->control + group, CONTROL_EMPTY) != 0)
+    {
+        table->control[slot] = CONTROL_EMPTY;
+        table->growthLeft++;
+    }
+    else
+    {
+        table->control[slot] = CONTROL_DELETED;
+    }
+
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
+    return true;
+}
+
+void tableAddAll(Table *from, Table *to)
+{
+    for (int i = 0; i < from->capacity; i++)
+    {
+        if (from->control[i] >= 0)
+            tableSet(to, from->entries[i].key, from->entries[i].value);
+    }
+}
+
+void tableClone(Table *from, Table *to)
+{
+    // Copies the slots verbatim so the clone needs no rehashing.
+    if (to->capacity != from->capacity)
+    {
+        FREE_ARRAY(Entry, to->entries, to->capacity, MEM_TABLE_ENTRIES);
+        FREE_ARRAY(int8_t, to->control, to->capacity, MEM_TABLE_ENTRIES);
+        to->entries = NULL;
+        to->control = NULL;
+        if (from->capacity > 0)
+        {
+            to->entries = ALLOCATE(Entry, from->capacity, MEM_TABLE_ENTRIES);
+            to->control = ALLOCATE(int8_t, from->capacity, MEM_TABLE_ENTRIES);
+        }
+        to->capacity = from->capacity;
+    }
+
+    if (from->capacity > 0)
+    {
+        memcpy(to->entries, from->entries, sizeof(Entry) * from->capacity);
+        memcpy(to->control, from->control, from->capacity);
+    }
+    to->count = from->count;
+    to->growthLeft = from->growthLeft;
+}
+
+ObjString *tableFindString(Table *table, const char *chars,
+                           int length, uint32_t hash)
+{
+    if (table->count == 0)
+        return NULL;
+
+    int8_t fragment = hashFragment(hash);
+    FOR_EACH_GROUP(group, hash, table->capacity)
+    {
+        const int8_t *control = table->control + group;
+        for (GroupMask mask = matchByte(control, fragment); mask != 0;
+             mask &= mask - 1)
+        {
+            ObjString *key = table->entries[group + lowestBit(mask)].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0)
+                return key;
+        }
+
+        if (matchByte(control, CONTROL_EMPTY) != 0)
+            return NULL;
+    }
+    return NULL;
+}
+
+#else
+
+void initTable(Table *table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+void freeTable(Table *table)
+{
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
     initTable(table);
 }
 
@@ -67,7 +342,7 @@ bool tableGet(Table *table, ObjString *key, Value *value)
 
 static void adjustCapacity(Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
+    Entry *entries = ALLOCATE(Entry, capacity, MEM_TABLE_ENTRIES);
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
@@ -87,7 +362,7 @@ static void adjustCapacity(Table *table, int capacity)
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE_ENTRIES);
     table->entries = entries;
     table->capacity = capacity;
 }
@@ -113,6 +388,15 @@ bool tableSet(Table *table, ObjString *key, Value value)
     return isNewKey;
 }
 
+void tableReserve(Table *table, int count)
+{
+    int capacity = 8;
+    while (count > capacity * TABLE_MAX_LOAD)
+        capacity *= 2;
+    if (capacity > table->capacity)
+        adjustCapacity(table, capacity);
+}
+
 bool tableDelete(Table *table, ObjString *key)
 {
     if (table->count == 0)
@@ -142,6 +426,23 @@ void tableAddAll(Table *from, Table *to)
     }
 }
 
+void tableClone(Table *from, Table *to)
+{
+    // Copies the slots verbatim so the clone needs no rehashing.
+    if (to->capacity != from->capacity)
+    {
+        FREE_ARRAY(Entry, to->entries, to->capacity, MEM_TABLE_ENTRIES);
+        to->entries = from->capacity > 0
+                          ? ALLOCATE(Entry, from->capacity, MEM_TABLE_ENTRIES)
+                          : NULL;
+        to->capacity = from->capacity;
+    }
+
+    if (from->capacity > 0)
+        memcpy(to->entries, from->entries, sizeof(Entry) * from->capacity);
+    to->count = from->count;
+}
+
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash)
 {
@@ -170,4 +471,6 @@ ObjString *tableFindString(Table *table, const char *chars,
 
         index = (index + 1) % table->capacity;
     }
-}
\ No newline at end of file
+}
+
+#endif
@@ -6,17 +6,31 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+#ifdef SWISS_TABLE
+// Slots are probed a group at a time by matching a 7-bit hash fragment held
+// in a separate control byte per slot.
+#define TABLE_GROUP_WIDTH 16
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+#endif
+
 typedef struct
 {
     ObjString *key;
     Value value;
 } Entry;
 
+// Keys are compared by identity, so only interned strings may be used as
+// keys; see internString().
 typedef struct
 {
     int count;
     int capacity;
     Entry *entries;
+#ifdef SWISS_TABLE
+    int8_t *control;
+    int growthLeft;
+#endif
 } Table;
 
 void initTable(Table *table);
@@ -24,7 +38,10 @@ void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
+// Grows the table so count entries fit without another resize.
+void tableReserve(Table *table, int count);
 void tableAddAll(Table *from, Table *to);
+void tableClone(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
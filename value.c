@@ -19,7 +19,8 @@ void writeValueArray(ValueArray *array, Value value)
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
     array->values =
-        GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        GROW_ARRAY(Value, array->values, oldCapacity, array->capacity,
+                   MEM_CONSTANTS);
   }
 
   array->values[array->count] = value;
@@ -28,7 +29,7 @@ void writeValueArray(ValueArray *array, Value value)
 
 void freeValueArray(ValueArray *array)
 {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  FREE_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
   initValueArray(array);
 }
 
@@ -75,7 +76,7 @@ bool valuesEqual(Value a, Value b)
   case VAL_FLOAT:
     return AS_FLOAT(a) == AS_FLOAT(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    return objectsEqual(AS_OBJ(a), AS_OBJ(b));
   default:
     return false; // Unreachable.
   }
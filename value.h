@@ -5,6 +5,9 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjMap ObjMap;
+typedef struct ObjArray ObjArray;
+typedef struct ObjShape ObjShape;
 
 typedef enum
 {
@@ -16,17 +19,19 @@ typedef enum
   VAL_OBJ,
 } ValueType;
 
+typedef union
+{
+  bool boolean;
+  char byte;
+  int i;
+  float f;
+  Obj *obj;
+} ValueAs;
+
 typedef struct
 {
   ValueType type;
-  union
-  {
-    bool boolean;
-    char byte;
-    int i;
-    float f;
-    Obj *obj;
-  } as;
+  ValueAs as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
@@ -1,11 +1,23 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "array.h"
+#include "channel.h"
 #include "common.h"
 #include "compiler.h"
+#include "host.h"
+#include "map.h"
 #include "memory.h"
 #include "object.h"
+#include "parallel.h"
+#include "shape.h"
 #include "value.h"
 #include "vm.h"
 
@@ -13,12 +25,21 @@
 #include "debug.h"
 #endif
 
-VM vm;
+_Thread_local VM *vm = NULL;
+
+// Public entry points make the VM they are given current on the calling
+// thread and restore the previous one on the way out, so they nest: a host
+// function may run code on another VM.
+static VM *enterVM(VM *instance) {
+  VM *previous = vm;
+  vm = instance;
+  return previous;
+}
 
 static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.stackCount = 0;
-  vm.OverflowFlag = false;
+  vm->stackTop = vm->stack;
+  vm->stackCount = 0;
+  vm->frameCount = 0;
 }
 
 static void runtimeError(const char *format, ...) {
@@ -28,77 +49,543 @@ static void runtimeError(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction];
-  fprintf(stderr, "[line %d] in script\n", line);
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm->frames[i];
+    // A frame that overflowed the stack may not have saved its ip since it
+    // was entered.
+    size_t instruction = frame->ip > frame->chunk->code
+                             ? (size_t)(frame->ip - frame->chunk->code - 1)
+                             : 0;
+    fprintf(stderr, "[line %d] in ", 
+            getLine(frame->chunk, (int)instruction));
+    if (frame->function == NULL) {
+      fprintf(stderr, "script\n");
+    } else {
+      fprintf(stderr, "%s()\n", frame->function->name->chars);
+    }
+  }
 
   resetStack();
 }
 
-void initVM() {
+static struct sigaction previousSegv;
+static pthread_once_t overflowHandlerOnce = PTHREAD_ONCE_INIT;
+
+// A fault on the guard page of the stack of the VM running on this thread
+// is an overflow, which run() reports. Anything else goes to whatever
+// handled SIGSEGV before, which stays out of the way of overflows in other
+// threads; the default action is taken by letting the access fault again
+// without a handler, which ends the process.
+static void handleOverflow(int signal, siginfo_t *info, void *context) {
+  char *address = (char *)info->si_addr;
+  if (vm != NULL && vm->overflowJump != NULL) {
+    char *guard = (char *)(vm->stack + vm->stackSlots);
+    if (address >= guard && address < (char *)vm->stack + vm->stackBytes) {
+      // run() saves no signal mask, which would cost it a system call, so
+      // SIGSEGV is unblocked here for the next overflow.
+      sigset_t signals;
+      sigemptyset(&signals);
+      sigaddset(&signals, SIGSEGV);
+      pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+      siglongjmp(*vm->overflowJump, 1);
+    }
+  }
+
+  if (previousSegv.sa_flags & SA_SIGINFO) {
+    previousSegv.sa_sigaction(signal, info, context);
+  } else if (previousSegv.sa_handler != SIG_DFL &&
+             previousSegv.sa_handler != SIG_IGN) {
+    previousSegv.sa_handler(signal);
+  } else {
+    struct sigaction fallback;
+    memset(&fallback, 0, sizeof(fallback));
+    fallback.sa_handler = SIG_DFL;
+    sigemptyset(&fallback.sa_mask);
+    sigaction(SIGSEGV, &fallback, NULL);
+  }
+}
+
+static void installOverflowHandler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = handleOverflow;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &action, &previousSegv);
+}
+
+// Maps a stack of at least the given number of slots, rounded up to whole
+// pages, followed by an inaccessible guard page.
+static bool mapStack(VM *instance, size_t slots) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if (slots == 0 || slots > (SIZE_MAX - 2 * page) / sizeof(Value))
+    return false;
+
+  size_t bytes = (slots * sizeof(Value) + page - 1) / page * page;
+  char *memory =
+      mmap(NULL, bytes + page, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED)
+    return false;
+  if (mprotect(memory + bytes, page, PROT_NONE) < 0) {
+    munmap(memory, bytes + page);
+    return false;
+  }
+
+  instance->stack = (Value *)memory;
+  instance->stackSlots = bytes / sizeof(Value);
+  instance->stackBytes = bytes + page;
+  return true;
+}
+
+void initVM(VM *instance) {
+  VM *previous = enterVM(instance);
+  pthread_once(&overflowHandlerOnce, installOverflowHandler);
+  if (!mapStack(vm, STACK_DEFAULT_SLOTS))
+    exit(1);
+  vm->overflowJump = NULL;
   resetStack();
-  vm.objects = NULL;
+  vm->objects = NULL;
+  vm->functions = NULL;
+  initArena(&vm->heap);
+  memset(vm->heapBytes, 0, sizeof(vm->heapBytes));
+
+  initTable(&vm->globals);
+  initTable(&vm->strings);
+  seedRandom(&vm->random, RANDOM_DEFAULT_SEED);
+  vm->scheduler = (Scheduler){NULL, NULL, NULL, 0, NULL, false};
+  vm->channelWake = false;
+  vm->notifying = 0;
+  vm->wakeHandler = NULL;
+  vm->wakeData = NULL;
+  vm->fuel = INT64_MAX;
+  vm->suspendedChunk = NULL;
+  vm->hostSuspends = false;
+  vm->program = NULL;
+  vm->sharedStrings = NULL;
+  vm->programCaches = NULL;
+  vm->programCacheCount = 0;
+  vm->interns = NULL;
+  vm->compiling = false;
+  vm->parallelism = 0;
+  vm->helpers = NULL;
+  vm->helperCount = 0;
+  vm->lender = NULL;
+
+  vm->checkpoint.taken = false;
+  initTable(&vm->checkpoint.globals);
+  initTable(&vm->checkpoint.strings);
+  switchVM(previous);
+}
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+static void freeSuspendedChunk() {
+  if (vm->suspendedChunk == NULL)
+    return;
+  freeChunk(vm->suspendedChunk);
+  FREE(Chunk, vm->suspendedChunk, MEM_OTHER);
+  vm->suspendedChunk = NULL;
 }
 
-void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
+void freeVM(VM *instance) {
+  freeParallelHelpers(instance);
+  VM *previous = enterVM(instance);
+  freeSuspendedChunk();
+  freeTable(&vm->globals);
+  freeTable(&vm->strings);
+  freeTable(&vm->checkpoint.globals);
+  freeTable(&vm->checkpoint.strings);
+  FREE_ARRAY(FieldCache, vm->programCaches, vm->programCacheCount, MEM_OTHER);
   freeObjects();
+  munmap(vm->stack, vm->stackBytes);
+  vm->stack = NULL;
+  switchVM(previous == instance ? NULL : previous);
 }
 
-void push(Value value) {
-  if (vm.stackCount + 1 == STACK_MAX) {
-    vm.OverflowFlag = true;
-    return;
+bool setStackSize(VM *instance, size_t slots) {
+  if (instance->frameCount > 0)
+    return false;
+
+  Value *stack = instance->stack;
+  size_t bytes = instance->stackBytes;
+  if (!mapStack(instance, slots))
+    return false;
+  munmap(stack, bytes);
+
+  VM *previous = enterVM(instance);
+  resetStack();
+  switchVM(previous);
+  return true;
+}
+
+void switchVM(VM *instance) { vm = instance; }
+
+void useInternTable(VM *instance, InternTable *table) {
+  instance->interns = table;
+}
+
+void checkpointVM(VM *instance) {
+  VM *previous = enterVM(instance);
+  vm->checkpoint.heapMark = arenaMark(&vm->heap);
+  memcpy(vm->checkpoint.heapBytes, vm->heapBytes, sizeof(vm->heapBytes));
+  vm->checkpoint.objects = vm->objects;
+  vm->checkpoint.functions = vm->functions;
+  tableClone(&vm->globals, &vm->checkpoint.globals);
+  tableClone(&vm->strings, &vm->checkpoint.strings);
+  vm->checkpoint.random = vm->random;
+  vm->checkpoint.taken = true;
+  switchVM(previous);
+}
+
+void resetVM(VM *instance) {
+  VM *previous = enterVM(instance);
+  // Nothing is collected before a reset, so every object allocated since the
+  // checkpoint sits above the heap mark and goes away with the rewind.
+  if (vm->checkpoint.taken) {
+    releaseFunctions(vm->checkpoint.functions);
+    arenaRewind(&vm->heap, vm->checkpoint.heapMark);
+    releaseHeapBytes(vm->heapBytes, vm->checkpoint.heapBytes);
+    vm->objects = vm->checkpoint.objects;
+    tableClone(&vm->checkpoint.globals, &vm->globals);
+    tableClone(&vm->checkpoint.strings, &vm->strings);
+    vm->random = vm->checkpoint.random;
+  } else {
+    releaseFunctions(NULL);
+    arenaRewind(&vm->heap, (ArenaMark){NULL, 0});
+    releaseHeapBytes(vm->heapBytes, NULL);
+    vm->objects = NULL;
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
+    seedRandom(&vm->random, RANDOM_DEFAULT_SEED);
   }
-  *vm.stackTop = value;
-  vm.stackTop++;
-  vm.stackCount++;
+
+  // Neither are coroutines or an unfinished script; any left over are
+  // dropped.
+  freeSuspendedChunk();
+  vm->scheduler = (Scheduler){NULL, NULL, NULL, 0, NULL, false};
+  // The shapes the caches refer to may be gone.
+  if (vm->programCaches != NULL)
+    memset(vm->programCaches, 0,
+           sizeof(FieldCache) * vm->programCacheCount);
+  resetStack();
+  switchVM(previous);
+}
+
+void push(VM *vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+  vm->stackCount++;
 }
 
-Value pop() {
-  vm.stackCount--;
-  vm.stackTop--;
-  return *vm.stackTop;
+Value pop(VM *vm) {
+  vm->stackCount--;
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
 
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void concatenate() {
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
+  Obj *b = AS_OBJ(pop(vm));
+  Obj *a = AS_OBJ(pop(vm));
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  // Long results become ropes, so building a string piece by piece does not
+  // copy everything gathered so far on every step.
+  push(vm, OBJ_VAL(concatenateText(a, b)));
+}
+
+static bool arrayIndex(ObjArray *array, Value index, int *result) {
+  if (!IS_INT(index) && !IS_BYTE(index)) {
+    runtimeError("Array index must be an int.");
+    return false;
+  }
 
-  ObjString *result = takeString(chars, length);
-  push(OBJ_VAL(result));
+  *result = IS_INT(index) ? AS_INT(index) : AS_BYTE(index);
+  if (*result < 0 || *result >= array->count) {
+    runtimeError("Array index %d out of range [0, %d).", *result,
+                 array->count);
+    return false;
+  }
+  return true;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+static bool sameShape(ObjArray *a, ObjArray *b) {
+  if (a->elementType != b->elementType || a->count != b->count) {
+    runtimeError("Arrays must have the same type and length.");
+    return false;
+  }
+  return true;
+}
+
+// Runs one of the bulk array builtins on the operands at the top of the
+// stack and replaces them with the result.
+static bool arrayOp(ArrayOp op) {
+  bool binary = op != ARRAY_SUM && op != ARRAY_MIN && op != ARRAY_MAX;
+  Value target = peek(binary ? 1 : 0);
+  if (!IS_ARRAY(target)) {
+    runtimeError("Operand must be an array.");
+    return false;
+  }
+  ObjArray *array = AS_ARRAY(target);
+
+  Value result;
+  switch (op) {
+  case ARRAY_SUM:
+    result = arraySum(array);
+    break;
+  case ARRAY_MIN:
+  case ARRAY_MAX: {
+    Value min = NIL_VAL, max = NIL_VAL;
+    arrayRange(array, &min, &max);
+    result = op == ARRAY_MIN ? min : max;
+    break;
+  }
+  case ARRAY_DOT:
+  case ARRAY_ADD:
+  case ARRAY_MUL: {
+    if (!IS_ARRAY(peek(0))) {
+      runtimeError("Operands must be arrays.");
+      return false;
+    }
+    ObjArray *other = AS_ARRAY(peek(0));
+    if (!sameShape(array, other))
+      return false;
+    if (op == ARRAY_DOT)
+      result = arrayDot(array, other);
+    else if (op == ARRAY_ADD)
+      result = OBJ_VAL(arrayAdd(array, other));
+    else
+      result = OBJ_VAL(arrayMul(array, other));
+    break;
+  }
+  default:
+    if (!IS_NUMBER(peek(0))) {
+      runtimeError("Operand must be a number.");
+      return false;
+    }
+    if (op == ARRAY_FILL) {
+      arrayFill(array, peek(0));
+      result = target;
+    } else {
+      result = OBJ_VAL(arrayCompare(array, peek(0), op));
+    }
+    break;
+  }
+
+  if (binary)
+    pop(vm);
+  pop(vm);
+  push(vm, result);
+  return true;
+}
+
+// Runs one of the string builtins. Their results are views into the
+// operand, so nothing is copied.
+static bool stringOp(StringOp op) {
+  int arity = op == STRING_SUBSTRING ? 3 : op == STRING_SPLIT ? 2 : 1;
+  Value target = peek(arity - 1);
+  if (!IS_TEXT(target)) {
+    runtimeError("Operand must be a string.");
+    return false;
+  }
+  Obj *text = AS_OBJ(target);
+
+  Value result;
+  switch (op) {
+  case STRING_SUBSTRING: {
+    if (!IS_INT(peek(1)) || !IS_INT(peek(0))) {
+      runtimeError("Substring bounds must be ints.");
+      return false;
+    }
+    int start = AS_INT(peek(1));
+    int end = AS_INT(peek(0));
+    if (start < 0 || end < start || end > textLength(text)) {
+      runtimeError("Substring [%d, %d) out of range [0, %d).", start, end,
+                   textLength(text));
+      return false;
+    }
+    result = OBJ_VAL(sliceText(text, start, end - start));
+    break;
+  }
+  case STRING_SPLIT:
+    if (!IS_TEXT(peek(0)) || textLength(AS_OBJ(peek(0))) == 0) {
+      runtimeError("Separator must be a non-empty string.");
+      return false;
+    }
+    result = OBJ_VAL(splitText(text, AS_OBJ(peek(0))));
+    break;
+  default:
+    result = OBJ_VAL(trimText(text));
+    break;
+  }
+
+  for (int i = 0; i < arity; i++)
+    pop(vm);
+  push(vm, result);
+  return true;
+}
+
+// Checks the arguments of a host call against its signature and converts
+// them in place, so the host reads the declared representation directly.
+static bool hostArguments(HostFunction *host, Value *args) {
+  for (int i = 0; i < host->arity; i++) {
+    Value *arg = &args[i];
+    char type = host->signature[i];
+    if (type == 'v')
+      continue;
+
+    if (type == 's') {
+      if (!IS_TEXT(*arg)) {
+        runtimeError("Argument %d to '%s' must be a string.", i + 1,
+                      host->name);
+        return false;
+      }
+      *arg = OBJ_VAL(flattenText(AS_OBJ(*arg)));
+      continue;
+    }
+
+    ValueType expected = type == 'i'   ? VAL_INT
+                         : type == 'f' ? VAL_FLOAT
+                                       : VAL_BYTE;
+    if (arg->type == expected)
+      continue;
+    if (!IS_NUMBER(*arg)) {
+      runtimeError("Argument %d to '%s' must be a number.", i + 1,
+                   host->name);
+      return false;
+    }
+
+    float number = IS_FLOAT(*arg) ? AS_FLOAT(*arg)
+                   : IS_INT(*arg) ? (float)AS_INT(*arg)
+                                  : (float)AS_BYTE(*arg);
+    if (expected == VAL_FLOAT)
+      *arg = FLOAT_VAL(number);
+    else if (expected == VAL_INT)
+      *arg = INT_VAL(IS_INT(*arg) ? AS_INT(*arg) : (int)number);
+    else
+      *arg = BYTE_VAL((char)(IS_INT(*arg) ? AS_INT(*arg) : (int)number));
+  }
+  return true;
+}
+
+// Field caches are written as code runs, so for a shared chunk they come
+// from the VM rather than the chunk.
+static FieldCache *chunkCaches(Chunk *chunk) {
+  return chunk->shared ? vm->programCaches + chunk->cacheBase : chunk->caches;
+}
+
+static bool call(ObjFunction *function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+  if (vm->frameCount == FRAMES_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.code;
+  frame->slots = vm->stackTop - argCount - 1;
+  frame->caches = chunkCaches(&function->chunk);
+  return true;
+}
+
+static bool callValue(Value callee, int argCount) {
+  if (IS_FUNCTION(callee))
+    return call(AS_FUNCTION(callee), argCount);
+
+  if (IS_CLASS(callee)) {
+    if (argCount != 0) {
+      runtimeError("Expected 0 arguments but got %d.", argCount);
+      return false;
+    }
+    vm->stackTop[-1] = OBJ_VAL(newInstance(AS_CLASS(callee)));
+    return true;
+  }
+
+  runtimeError("Can only call functions and classes.");
+  return false;
+}
+
+static void enqueue(ObjCoroutine *coroutine) {
+  Scheduler *scheduler = &vm->scheduler;
+  coroutine->state = COROUTINE_READY;
+  coroutine->next = NULL;
+  if (scheduler->tail != NULL) {
+    scheduler->tail->next = coroutine;
+  } else {
+    scheduler->head = coroutine;
+  }
+  scheduler->tail = coroutine;
+}
+
+static bool wake(ObjCoroutine *coroutine, Value value) {
+  // One waiting on a channel is woken only by the channel.
+  if (coroutine->state != COROUTINE_PARKED || coroutine->channelWait)
+    return false;
+
+  vm->scheduler.parkedCount--;
+  coroutine->transfer = value;
+  enqueue(coroutine);
+  return true;
+}
+
+static InterpretResult execute() {
+  // The current frame, its ip and its slots live in locals so the compiler
+  // can keep them in registers. ip is written back to the frame before
+  // anything that may report an error, allocate or switch frames.
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  uint8_t *ip = frame->ip;
+  Value *slots = frame->slots;
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (frame->chunk->constants.values[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frameCount - 1];                                   \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_IP();                                                                 \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
 
-#define BINARY_OP(op, isComparison)                                            \
+#ifdef FUEL_METERING
+// Charged where a script can go on indefinitely: backward branches and
+// calls. ip must already point at the instruction to go on from.
+#define CHARGE_FUEL()                                                          \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (--vm->fuel < 0) {                                                      \
+      vm->fuel = 0;                                                            \
+      SAVE_IP();                                                               \
+      return INTERPRET_OUT_OF_FUEL;                                            \
     }                                                                          \
-    Value b = pop();                                                           \
-    Value a = pop();                                                           \
+  } while (false)
+#else
+#define CHARGE_FUEL()                                                          \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#define BINARY_OP(op, isComparison)                                            \
+  do {                                                                         \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))                            \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    Value b = pop(vm);                                                           \
+    Value a = pop(vm);                                                           \
     printf("\n");                                                              \
     switch (a.type) {                                                          \
     case VAL_INT: {                                                            \
@@ -118,13 +605,14 @@ static InterpretResult run() {
         break;                                                                 \
       }                                                                        \
       default:                                                                 \
+        SAVE_IP();                                                             \
         runtimeError("Operand must be a number.");                             \
         break;                                                                 \
       }                                                                        \
       if (isComparison)                                                        \
-        push(BOOL_VAL(va op vb));                                              \
+        push(vm, BOOL_VAL(va op vb));                                              \
       else                                                                     \
-        push(INT_VAL(va op vb));                                               \
+        push(vm, INT_VAL(va op vb));                                               \
       break;                                                                   \
     }                                                                          \
     case VAL_BYTE: {                                                           \
@@ -144,13 +632,14 @@ static InterpretResult run() {
         break;                                                                 \
       }                                                                        \
       default:                                                                 \
+        SAVE_IP();                                                             \
         runtimeError("Operand must be a number.");                             \
         break;                                                                 \
       }                                                                        \
       if (isComparison)                                                        \
-        push(BOOL_VAL(va op vb));                                              \
+        push(vm, BOOL_VAL(va op vb));                                              \
       else                                                                     \
-        push(BYTE_VAL(va op vb));                                              \
+        push(vm, BYTE_VAL(va op vb));                                              \
       break;                                                                   \
     }                                                                          \
     case VAL_FLOAT: {                                                          \
@@ -170,16 +659,18 @@ static InterpretResult run() {
         break;                                                                 \
       }                                                                        \
       default:                                                                 \
+        SAVE_IP();                                                             \
         runtimeError("Operand must be a number.");                             \
         break;                                                                 \
       }                                                                        \
       if (isComparison)                                                        \
-        push(BOOL_VAL(va op vb));                                              \
+        push(vm, BOOL_VAL(va op vb));                                              \
       else                                                                     \
-        push(FLOAT_VAL(va op vb));                                             \
+        push(vm, FLOAT_VAL(va op vb));                                             \
       break;                                                                   \
     }                                                                          \
     default:                                                                   \
+      SAVE_IP();                                                               \
       runtimeError("Operand must be a number.");                               \
       break;                                                                   \
     }                                                                          \
@@ -187,112 +678,418 @@ static InterpretResult run() {
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
       printf("          ");
       printf("[ ");
       printValue(*slot);
       printf(" ]\n");
     }
     printf("\n");
-    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    disassembleInstruction(frame->chunk, (int)(ip - frame->chunk->code));
 #endif
 
     uint8_t instruction;
     switch (instruction = READ_BYTE()) {
     case OP_RET: {
-      return INTERPRET_OK;
+      Value result = pop(vm);
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
+        pop(vm);
+        return INTERPRET_OK;
+      }
+
+      vm->stackTop = slots;
+      vm->stackCount = (int)(vm->stackTop - vm->stack);
+      push(vm, result);
+      LOAD_FRAME();
+      break;
     }
 
     // flow control
     case OP_JUMP: {
       uint16_t offset = READ_SHORT();
-      vm.ip += offset;
+      ip += offset;
       break;
     }
     case OP_JUMP_IF_TRUE: {
       uint16_t offset = READ_SHORT();
       if (!isFalsey(peek(0)))
-        vm.ip += offset;
+        ip += offset;
       break;
     }
     case OP_JUMP_IF_FALSE: {
       uint16_t offset = READ_SHORT();
       if (isFalsey(peek(0)))
-        vm.ip += offset;
+        ip += offset;
       break;
     }
     case OP_LOOP: {
       uint16_t offset = READ_SHORT();
-      vm.ip -= offset;
+      ip -= offset;
+      CHARGE_FUEL();
       break;
     }
 
     // scope management
     case OP_DEFINE_GLOBAL: {
       ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
+      SAVE_IP();
+      // A parallel for helper works on a copy of the globals, so the write
+      // would be lost; the compiler only catches it in the body itself.
+      if (vm->lender != NULL)
+        RUNTIME_ERROR("Can't define a global in a parallel for body.");
+      tableSet(&vm->globals, name, peek(0));
+      pop(vm);
       break;
     }
     case OP_GET_GLOBAL: {
       ObjString *name = READ_STRING();
       Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
+      if (!tableGet(&vm->globals, name, &value)) 
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+
+      push(vm, value);
       break;
     }
     case OP_SET_GLOBAL: {
       ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+      SAVE_IP();
+      if (vm->lender != NULL)
+        RUNTIME_ERROR("Can't assign to a global in a parallel for body.");
+      if (tableSet(&vm->globals, name, peek(0))) {
+        tableDelete(&vm->globals, name);
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
       }
       break;
     }
     case OP_GET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      push(vm.stack[slot]);
+      push(vm, slots[slot]);
       break;
     }
     case OP_SET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      vm.stack[slot] = peek(0);
+      slots[slot] = peek(0);
       break;
     }
 
       // stack manipulation
     case OP_YEET: {
       Value constant = READ_CONSTANT();
-      push(constant);
-      if (vm.OverflowFlag) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      push(vm, constant);
       break;
     }
     case OP_POP: {
-      pop();
+      pop(vm);
       break;
     }
 
-    case OP_NEG: {
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
+    // maps
+    case OP_MAP_NEW:
+      SAVE_IP();
+      push(vm, OBJ_VAL(newMap()));
+      break;
+    case OP_MAP_INSERT: {
+      SAVE_IP();
+      Value value = pop(vm);
+      Value key = pop(vm);
+      mapSet(AS_MAP(peek(0)), key, value);
+      break;
+    }
+    case OP_GET_INDEX: {
+      SAVE_IP();
+      if (IS_ARRAY(peek(1))) {
+        int index;
+        if (!arrayIndex(AS_ARRAY(peek(1)), peek(0), &index))
+          return INTERPRET_RUNTIME_ERROR;
+        pop(vm);
+        push(vm, arrayGet(AS_ARRAY(pop(vm)), index));
+        break;
+      }
+      if (!IS_MAP(peek(1))) 
+        RUNTIME_ERROR("Only maps and arrays can be indexed.");
+
+      Value key = pop(vm);
+      ObjMap *map = AS_MAP(pop(vm));
+      Value value;
+      if (!mapGet(map, key, &value))
+        value = NIL_VAL;
+      push(vm, value);
+      break;
+    }
+    case OP_SET_INDEX: {
+      SAVE_IP();
+      if (IS_ARRAY(peek(2))) {
+        int index;
+        if (!arrayIndex(AS_ARRAY(peek(2)), peek(1), &index))
+          return INTERPRET_RUNTIME_ERROR;
+        if (!IS_NUMBER(peek(0)))
+          RUNTIME_ERROR("Array elements must be numbers.");
+
+        Value value = pop(vm);
+        pop(vm);
+        arraySet(AS_ARRAY(pop(vm)), index, value);
+        push(vm, value);
+        break;
+      }
+      if (!IS_MAP(peek(2))) 
+        RUNTIME_ERROR("Only maps and arrays can be indexed.");
+
+      Value value = pop(vm);
+      Value key = pop(vm);
+      mapSet(AS_MAP(pop(vm)), key, value);
+      push(vm, value);
+      break;
+    }
+    case OP_DELETE_INDEX: {
+      SAVE_IP();
+      if (!IS_MAP(peek(1))) 
+        RUNTIME_ERROR("Only maps can be indexed.");
+
+      Value key = pop(vm);
+      mapDelete(AS_MAP(pop(vm)), key);
+      break;
+    }
+    case OP_MAP_NEXT: {
+      uint8_t slot = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      Value *loop = &slots[slot];
+      if (!IS_MAP(loop[0])) 
+        RUNTIME_ERROR("Can only iterate over maps.");
+
+
+      // Slots hold the map, the cursor, then the key and value variables.
+      int cursor = AS_INT(loop[1]);
+      if (mapNext(AS_MAP(loop[0]), &cursor, &loop[2], &loop[3])) {
+        loop[1] = INT_VAL(cursor);
+      } else {
+        ip += offset;
+      }
+      break;
+    }
+
+    // arrays
+    case OP_ARRAY_NEW: {
+      SAVE_IP();
+      ValueType elementType = (ValueType)READ_BYTE();
+      if (!IS_INT(peek(0)) || AS_INT(peek(0)) < 0) 
+        RUNTIME_ERROR("Array length must be a non-negative int.");
+
+      push(vm, OBJ_VAL(newArray(elementType, AS_INT(pop(vm)))));
+      break;
+    }
+    case OP_ARRAY_OP:
+      SAVE_IP();
+      if (!arrayOp((ArrayOp)READ_BYTE()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    // classes
+    case OP_CLASS:
+      SAVE_IP();
+      push(vm, OBJ_VAL(newClass(READ_STRING())));
+      break;
+    case OP_FIELD: {
+      SAVE_IP();
+      ObjClass *klass = AS_CLASS(peek(0));
+      klass->shape = shapeTransition(klass->shape, READ_STRING());
+      break;
+    }
+    case OP_GET_FIELD: {
+      ObjString *name = READ_STRING();
+      FieldCache *cache = &frame->caches[READ_SHORT()];
+      if (!IS_INSTANCE(peek(0))) 
+        RUNTIME_ERROR("Only instances have fields.");
+
+      ObjInstance *instance = AS_INSTANCE(peek(0));
+
+      // A parallel for helper runs the lender's own code alongside other
+      // helpers, so it leaves that code's caches alone.
+      FieldCache miss;
+      if (cache->shape != instance->shape) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot < 0) 
+          RUNTIME_ERROR("Undefined field '%s'.", name->chars);
+
+        if (vm->lender != NULL && !frame->chunk->shared)
+          cache = &miss;
+        cache->shape = instance->shape;
+        cache->next = NULL;
+        cache->slot = slot;
+      }
+
+      vm->stackTop[-1] = instance->fields[cache->slot];
+      break;
+    }
+    case OP_SET_FIELD: {
+      ObjString *name = READ_STRING();
+      FieldCache *cache = &frame->caches[READ_SHORT()];
+      SAVE_IP();
+      if (!IS_INSTANCE(peek(1))) 
+        RUNTIME_ERROR("Only instances have fields.");
+
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      Value value = peek(0);
+
+      FieldCache miss;
+      if (cache->shape != instance->shape) {
+        int slot = shapeSlot(instance->shape, name);
+        if (vm->lender != NULL && !frame->chunk->shared)
+          cache = &miss;
+        cache->shape = instance->shape;
+        if (slot >= 0) {
+          cache->next = NULL;
+          cache->slot = slot;
+        } else {
+          cache->next = shapeTransition(instance->shape, name);
+          cache->slot = cache->next->slotCount - 1;
+        }
+      }
+
+      if (cache->next == NULL)
+        instance->fields[cache->slot] = value;
+      else
+        instanceAddField(instance, cache->next, value);
+
+      pop(vm);
+      vm->stackTop[-1] = value;
+      break;
+    }
+    case OP_CALL: {
+      int argCount = READ_BYTE();
+      SAVE_IP();
+      if (!callValue(peek(argCount), argCount))
         return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      CHARGE_FUEL();
+      break;
+    }
+    case OP_RAND:
+      push(vm, FLOAT_VAL(randomFloat(&vm->random)));
+      break;
+    case OP_RANDSEED: {
+      Value seed = pop(vm);
+      if (!IS_INT(seed))
+        RUNTIME_ERROR("Seed must be an int.");
+      seedRandom(&vm->random, (uint64_t)(int64_t)AS_INT(seed));
+      push(vm, NIL_VAL);
+      break;
+    }
+    case OP_RANDMAX: {
+      Value bound = pop(vm);
+      if (!IS_INT(bound) || AS_INT(bound) <= 0)
+        RUNTIME_ERROR("Bound must be a positive int.");
+      push(vm, INT_VAL((int)randomBelow(&vm->random, (uint32_t)AS_INT(bound))));
+      break;
+    }
+    case OP_RANDRANGE: {
+      Value high = pop(vm);
+      Value low = pop(vm);
+      if (!IS_INT(low) || !IS_INT(high) || AS_INT(low) >= AS_INT(high))
+        RUNTIME_ERROR("Range must be two ints with low < high.");
+      uint32_t span = (uint32_t)AS_INT(high) - (uint32_t)AS_INT(low);
+      push(vm, INT_VAL((int)((uint32_t)AS_INT(low) +
+                         randomBelow(&vm->random, span))));
+      break;
+    }
+    case OP_RANDFILL:
+      if (!IS_ARRAY(peek(0)))
+        RUNTIME_ERROR("Operand must be an array.");
+      randomFill(&vm->random, AS_ARRAY(peek(0)));
+      break;
+    case OP_HOST: {
+      HostFunction *host = &hosts[READ_BYTE()];
+      Value *args = vm->stackTop - host->arity;
+      SAVE_IP();
+      if (!hostArguments(host, args))
+        return INTERPRET_RUNTIME_ERROR;
+
+      Value result = NIL_VAL;
+      if (!host->function(args, &result)) {
+        vm->hostSuspends = false;
+        RUNTIME_ERROR("%s", hostErrorMessage());
+      }
+      vm->stackTop = args;
+      vm->stackCount -= host->arity;
+      if (vm->hostSuspends) {
+        // Parked like halt(): the wake value is pushed as the result.
+        vm->hostSuspends = false;
+        vm->scheduler.running->state = COROUTINE_PARKED;
+        SAVE_IP();
+        return INTERPRET_YIELD;
       }
-      Value inp = pop();
+      push(vm, result);
+      break;
+    }
+    case OP_TAIL_CALL: {
+      int argCount = READ_BYTE();
+      SAVE_IP();
+      Value callee = peek(argCount);
+      if (!IS_FUNCTION(callee)) {
+        // Anything else is an ordinary call; the OP_RET after it returns
+        // the result.
+        if (!callValue(callee, argCount))
+          return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        CHARGE_FUEL();
+        break;
+      }
+
+      ObjFunction *function = AS_FUNCTION(callee);
+      if (argCount != function->arity)
+        RUNTIME_ERROR("Expected %d arguments but got %d.", function->arity,
+                      argCount);
+
+      // Reuse the current frame: slide the callee and its arguments down
+      // over it and restart at the callee's first instruction.
+      memmove(slots, vm->stackTop - argCount - 1,
+              (argCount + 1) * sizeof(Value));
+      vm->stackTop = slots + argCount + 1;
+      vm->stackCount = (int)(vm->stackTop - vm->stack);
+      frame->function = function;
+      frame->chunk = &function->chunk;
+      frame->caches = chunkCaches(&function->chunk);
+      ip = function->chunk.code;
+      SAVE_IP();
+      CHARGE_FUEL();
+      break;
+    }
+
+    case OP_STRING_OP:
+      SAVE_IP();
+      if (!stringOp((StringOp)READ_BYTE()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_LEN: {
+      Value value = peek(0);
+      int length;
+      if (IS_TEXT(value)) {
+        length = textLength(AS_OBJ(value));
+      } else if (IS_MAP(value)) {
+        length = AS_MAP(value)->count;
+      } else if (IS_ARRAY(value)) {
+        length = AS_ARRAY(value)->count;
+      } else 
+        RUNTIME_ERROR("Only strings, maps and arrays have a length.");
+
+      pop(vm);
+      push(vm, INT_VAL(length));
+      break;
+    }
+
+    case OP_NEG: {
+      if (!IS_NUMBER(peek(0))) 
+        RUNTIME_ERROR("Operand must be a number.");
+
+      Value inp = pop(vm);
       switch (inp.type) {
       case VAL_BYTE:
-        push(BYTE_VAL(-AS_BYTE(inp)));
+        push(vm, BYTE_VAL(-AS_BYTE(inp)));
         break;
       case VAL_INT:
-        push(INT_VAL(-AS_INT(inp)));
+        push(vm, INT_VAL(-AS_INT(inp)));
         break;
       case VAL_FLOAT:
-        push(FLOAT_VAL(-AS_FLOAT(inp)));
+        push(vm, FLOAT_VAL(-AS_FLOAT(inp)));
         break;
 
       default:
@@ -301,14 +1098,14 @@ static InterpretResult run() {
       break;
     }
     case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+        SAVE_IP();
         concatenate();
       } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
         BINARY_OP(+, false);
-      } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      } else 
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+
       break;
     }
     case OP_SUB: {
@@ -324,27 +1121,126 @@ static InterpretResult run() {
       break;
     }
 
+      // coroutines
+    case OP_SPAWN: {
+      SAVE_IP();
+      Value function = peek(0);
+      if (!IS_FUNCTION(function) || AS_FUNCTION(function)->arity != 0)
+        RUNTIME_ERROR("Can only spawn functions without parameters.");
+      ObjCoroutine *coroutine = newCoroutine(AS_FUNCTION(function));
+      enqueue(coroutine);
+      pop(vm);
+      push(vm, OBJ_VAL(coroutine));
+      break;
+    }
+    case OP_PAUSE:
+    case OP_HALT: {
+      ObjCoroutine *coroutine = vm->scheduler.running;
+      if (coroutine == NULL)
+        RUNTIME_ERROR("Can only %s inside a coroutine.",
+                      instruction == OP_PAUSE ? "pause" : "halt");
+      coroutine->state =
+          instruction == OP_PAUSE ? COROUTINE_READY : COROUTINE_PARKED;
+      SAVE_IP();
+      return INTERPRET_YIELD;
+    }
+    case OP_UNHALT: {
+      Value coroutine = pop(vm);
+      if (!IS_COROUTINE(coroutine))
+        RUNTIME_ERROR("Operand must be a coroutine.");
+      push(vm, BOOL_VAL(wake(AS_COROUTINE(coroutine), NIL_VAL)));
+      break;
+    }
+    case OP_SEND:
+    case OP_RECV: {
+      SAVE_IP();
+      Value target = peek(instruction == OP_SEND ? 1 : 0);
+      if (!IS_CHANNEL(target))
+        RUNTIME_ERROR("Operand must be a channel.");
+      Channel *channel = AS_CHANNEL(target);
+
+      bool sending = instruction == OP_SEND;
+      Value received;
+      ChannelResult result = sending ? channelSend(channel, peek(0))
+                                     : channelReceive(channel, &received);
+      if (result == CHANNEL_UNSENDABLE)
+        RUNTIME_ERROR("Can only send numbers, booleans, nil and strings.");
+      if (result == CHANNEL_OK) {
+        if (sending)
+          pop(vm);
+        pop(vm);
+        push(vm, sending ? NIL_VAL : received);
+        break;
+      }
+
+      // Full or empty: park until the other side notifies this VM, then
+      // run the instruction again.
+      ObjCoroutine *coroutine = vm->scheduler.running;
+      if (coroutine == NULL)
+        RUNTIME_ERROR("Can only wait on a channel inside a coroutine.");
+      ip--;
+      if (!channelWait(channel, sending))
+        break;
+      coroutine->state = COROUTINE_PARKED;
+      coroutine->channelWait = true;
+      coroutine->next = vm->scheduler.channelWaiters;
+      vm->scheduler.channelWaiters = coroutine;
+      SAVE_IP();
+      return INTERPRET_YIELD;
+    }
+
+      // parallel for
+    case OP_PARALLEL: {
+      ObjFunction *body = AS_FUNCTION(READ_CONSTANT());
+      int count = READ_BYTE();
+      const uint8_t *ops = ip;
+      ip += count;
+      // The bounds sit below the accumulators, which are combined in place.
+      Value *accumulators = vm->stackTop - count;
+      SAVE_IP();
+      const char *error = runParallel(body, accumulators[-2], accumulators[-1],
+                                      count, ops, accumulators);
+      if (error != NULL)
+        RUNTIME_ERROR("%s", error);
+      memmove(accumulators - 2, accumulators, sizeof(Value) * count);
+      vm->stackTop -= 2;
+      vm->stackCount -= 2;
+      break;
+    }
+    case OP_PARALLEL_DONE: {
+      // The accumulators follow the function and its two bounds.
+      int count = READ_BYTE();
+      for (int i = 0; i < count; i++)
+        vm->parallelResults[i] = slots[3 + i];
+      break;
+    }
+    case OP_EXIT:
+      // Ends the running coroutine, or the script outside of one.
+      resetStack();
+      return INTERPRET_OK;
+
       // literal
     case OP_NIL:
-      push(NIL_VAL);
+      push(vm, NIL_VAL);
       break;
     case OP_TRUE:
-      push(BOOL_VAL(true));
+      push(vm, BOOL_VAL(true));
       break;
     case OP_FALSE:
-      push(BOOL_VAL(false));
+      push(vm, BOOL_VAL(false));
       break;
 
     // boolean
     case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
+      push(vm, BOOL_VAL(isFalsey(pop(vm))));
       break;
 
     // comparison:
     case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+      SAVE_IP();
+      Value b = pop(vm);
+      Value a = pop(vm);
+      push(vm, BOOL_VAL(valuesEqual(a, b)));
       break;
     }
     case OP_GREATER:
@@ -357,7 +1253,8 @@ static InterpretResult run() {
 
     // system
     case OP_PRINT: {
-      printValue(pop());
+      SAVE_IP();
+      printValue(pop(vm));
       printf("\n");
       break;
     }
@@ -368,29 +1265,491 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef SAVE_IP
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef CHARGE_FUEL
 #undef BINARY_OP
 }
 
-InterpretResult interpretChunk(Chunk *chunk) {
-  vm.chunk = chunk;
-  vm.ip = vm.chunk->code;
+// Runs execute() with somewhere to land when a push hits the guard page.
+// The frames it leaves behind are reported from where their ips were last
+// saved.
+static InterpretResult run() {
+  sigjmp_buf jump;
+  sigjmp_buf *outer = vm->overflowJump;
+  InterpretResult result;
+  if (sigsetjmp(jump, 0) == 0) {
+    vm->overflowJump = &jump;
+    result = execute();
+  } else {
+    runtimeError("Stack overflow.");
+    result = INTERPRET_RUNTIME_ERROR;
+  }
+  vm->overflowJump = outer;
+  return result;
+}
+
+static InterpretResult runChunk(Chunk *chunk) {
+  // Slot 0 of the script frame stands in for the callee.
+  push(vm, NIL_VAL);
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = NULL;
+  frame->chunk = chunk;
+  frame->ip = chunk->code;
+  frame->slots = vm->stackTop - 1;
+  frame->caches = chunkCaches(chunk);
   return run();
 }
 
-InterpretResult interpret(const char *source) {
+// Copies the live stack and frames out of the VM, growing the coroutine's
+// arrays only when it is suspended deeper than ever before.
+static void saveCoroutine(ObjCoroutine *coroutine) {
+  if (coroutine->stackCapacity < vm->stackCount) {
+    int capacity = coroutine->stackCapacity;
+    while (capacity < vm->stackCount)
+      capacity = GROW_CAPACITY(capacity);
+    coroutine->stack = (Value *)heapReallocate(
+        coroutine->stack, sizeof(Value) * coroutine->stackCapacity,
+        sizeof(Value) * capacity, MEM_COROUTINE_STACKS);
+    coroutine->stackCapacity = capacity;
+  }
+  if (coroutine->frameCapacity < vm->frameCount) {
+    int capacity = coroutine->frameCapacity;
+    while (capacity < vm->frameCount)
+      capacity = GROW_CAPACITY(capacity);
+    coroutine->frames = (CallFrame *)heapReallocate(
+        coroutine->frames, sizeof(CallFrame) * coroutine->frameCapacity,
+        sizeof(CallFrame) * capacity, MEM_COROUTINE_STACKS);
+    coroutine->frameCapacity = capacity;
+  }
+
+  coroutine->stackCount = vm->stackCount;
+  memcpy(coroutine->stack, vm->stack, sizeof(Value) * vm->stackCount);
+  coroutine->frameCount = vm->frameCount;
+  memcpy(coroutine->frames, vm->frames, sizeof(CallFrame) * vm->frameCount);
+}
+
+static InterpretResult resume(ObjCoroutine *coroutine) {
+  if (vm->frameCount > 0 || coroutine->state == COROUTINE_RUNNING ||
+      coroutine->state == COROUTINE_DONE) {
+    fprintf(stderr, "Cannot resume this coroutine now.\n");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  if ((size_t)coroutine->stackCount > vm->stackSlots) {
+    fprintf(stderr, "Coroutine is deeper than the VM stack.\n");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  memcpy(vm->stack, coroutine->stack, sizeof(Value) * coroutine->stackCount);
+  vm->stackCount = coroutine->stackCount;
+  vm->stackTop = vm->stack + vm->stackCount;
+  memcpy(vm->frames, coroutine->frames,
+         sizeof(CallFrame) * coroutine->frameCount);
+  vm->frameCount = coroutine->frameCount;
+  if (!coroutine->started) {
+    vm->frames[0].slots = vm->stack;
+    vm->frames[0].caches = chunkCaches(vm->frames[0].chunk);
+    coroutine->started = true;
+  } else if (coroutine->channelWait || coroutine->preempted) {
+    coroutine->channelWait = false;
+    coroutine->preempted = false;
+  } else {
+    // The result of the pause() or halt() it is suspended in.
+    push(vm, coroutine->transfer);
+  }
+  coroutine->transfer = NIL_VAL;
+  coroutine->state = COROUTINE_RUNNING;
+  vm->scheduler.running = coroutine;
+
+  InterpretResult result = run();
+  vm->scheduler.running = NULL;
+  if (result == INTERPRET_OUT_OF_FUEL) {
+    coroutine->state = COROUTINE_READY;
+    coroutine->preempted = true;
+  } else if (result != INTERPRET_YIELD) {
+    coroutine->state = COROUTINE_DONE;
+    coroutine->stackCount = 0;
+    coroutine->frameCount = 0;
+    resetStack();
+    return result;
+  }
+
+  if (coroutine->state == COROUTINE_PARKED)
+    vm->scheduler.parkedCount++;
+  saveCoroutine(coroutine);
+  resetStack();
+  return result;
+}
+
+// Makes the coroutines waiting on channels ready to try again, if a
+// channel has notified the VM since the last time.
+static void takeChannelWakes() {
+  Scheduler *scheduler = &vm->scheduler;
+  if (scheduler->channelWaiters == NULL ||
+      !__atomic_exchange_n(&vm->channelWake, false, __ATOMIC_SEQ_CST))
+    return;
+
+  ObjCoroutine *coroutine = scheduler->channelWaiters;
+  scheduler->channelWaiters = NULL;
+  while (coroutine != NULL) {
+    ObjCoroutine *next = coroutine->next;
+    scheduler->parkedCount--;
+    enqueue(coroutine);
+    coroutine = next;
+  }
+}
+
+static InterpretResult schedule() {
+  Scheduler *scheduler = &vm->scheduler;
+  for (;;) {
+    takeChannelWakes();
+    if (scheduler->head == NULL)
+      break;
+    ObjCoroutine *coroutine = scheduler->head;
+    scheduler->head = coroutine->next;
+    if (scheduler->head == NULL)
+      scheduler->tail = NULL;
+    coroutine->next = NULL;
+
+    InterpretResult result = resume(coroutine);
+    if (result == INTERPRET_RUNTIME_ERROR) {
+      scheduler->failed = true;
+    } else if (result == INTERPRET_OUT_OF_FUEL) {
+      // It goes on first when the VM continues, so running out of fuel
+      // never changes the order coroutines run in.
+      coroutine->next = scheduler->head;
+      scheduler->head = coroutine;
+      if (scheduler->tail == NULL)
+        scheduler->tail = coroutine;
+      return result;
+    } else if (result == INTERPRET_YIELD &&
+               coroutine->state == COROUTINE_READY) {
+      enqueue(coroutine);
+    }
+  }
+
+  if (scheduler->failed) {
+    scheduler->failed = false;
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  return scheduler->parkedCount > 0 ? INTERPRET_YIELD : INTERPRET_OK;
+}
+
+InterpretResult interpretChunk(VM *instance, Chunk *chunk) {
+  VM *previous = enterVM(instance);
+  InterpretResult result = runChunk(chunk);
+  switchVM(previous);
+  return result;
+}
+
+InterpretResult interpret(VM *instance, const char *source) {
   Chunk chunk;
   initChunk(&chunk);
 
-  if (!compile(source, &chunk)) {
+  if (!compile(instance, source, &chunk)) {
     freeChunk(&chunk);
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+  VM *previous = enterVM(instance);
+  InterpretResult result = runChunk(&chunk);
+  if (result == INTERPRET_OUT_OF_FUEL) {
+    // The script frame goes on with the chunk's code later.
+    vm->suspendedChunk = ALLOCATE(Chunk, 1, MEM_OTHER);
+    *vm->suspendedChunk = chunk;
+    vm->frames[0].chunk = vm->suspendedChunk;
+  } else {
+    freeChunk(&chunk);
+  }
+  if (result == INTERPRET_OK)
+    result = schedule();
+  switchVM(previous);
+  return result;
+}
 
-  InterpretResult result = run();
+Program *compileProgram(const char *source) {
+  Program *program = ALLOCATE(Program, 1, MEM_OTHER);
+  initVM(&program->home);
+  initChunk(&program->chunk);
+  program->mapping = NULL;
+  program->mappingSize = 0;
+  if (!compile(&program->home, source, &program->chunk)) {
+    freeProgram(program);
+    return NULL;
+  }
+  finishProgram(program);
+  return program;
+}
+
+void finishProgram(Program *program) {
+  // Number the field caches of all the program's code consecutively, so a
+  // VM can hold them in one array.
+  program->chunk.shared = true;
+  program->cacheCount = program->chunk.cacheCount;
+  for (ObjFunction *function = program->home.functions; function != NULL;
+       function = function->nextFunction) {
+    Chunk *chunk = &function->chunk;
+    chunk->shared = true;
+    chunk->cacheBase = program->cacheCount;
+    program->cacheCount += chunk->cacheCount;
+  }
+}
+
+void freeProgram(Program *program) {
+  freeChunk(&program->chunk);
+  freeVM(&program->home);
+  if (program->mapping != NULL)
+    munmap(program->mapping, program->mappingSize);
+  FREE(Program, program, MEM_OTHER);
+}
+
+void loadProgram(VM *instance, Program *program) {
+  VM *previous = enterVM(instance);
+  if (vm->program != program) {
+    FREE_ARRAY(FieldCache, vm->programCaches, vm->programCacheCount,
+               MEM_OTHER);
+    vm->programCaches = ALLOCATE(FieldCache, program->cacheCount, MEM_OTHER);
+    for (int i = 0; i < program->cacheCount; i++)
+      vm->programCaches[i] = (FieldCache){NULL, NULL, 0};
+    vm->programCacheCount = program->cacheCount;
+    vm->sharedStrings = &program->home.strings;
+    vm->program = program;
+  }
+  switchVM(previous);
+}
+
+InterpretResult runProgram(VM *instance, Program *program) {
+  loadProgram(instance, program);
+  VM *previous = enterVM(instance);
+  InterpretResult result = runChunk(&program->chunk);
+  if (result == INTERPRET_OK)
+    result = schedule();
+  switchVM(previous);
+  return result;
+}
+
+void defineGlobal(VM *instance, const char *name, Value value) {
+  ObjString *key = copyString(instance, name, (int)strlen(name));
+  VM *previous = enterVM(instance);
+  tableSet(&vm->globals, key, value);
+  switchVM(previous);
+}
+
+InterpretResult callFunction(VM *instance, ObjFunction *function, int argCount,
+                             Value *args) {
+  VM *previous = enterVM(instance);
+  push(vm, OBJ_VAL(function));
+  for (int i = 0; i < argCount; i++)
+    push(vm, args[i]);
+  InterpretResult result =
+      call(function, argCount) ? run() : INTERPRET_RUNTIME_ERROR;
+  // Returning from the outermost frame leaves its arguments behind.
+  if (result == INTERPRET_OK)
+    resetStack();
+  switchVM(previous);
+  return result;
+}
+
+void setFuel(VM *instance, int64_t fuel) {
+  instance->fuel = fuel < 0 ? INT64_MAX : fuel;
+}
+
+InterpretResult continueVM(VM *instance) {
+  VM *previous = enterVM(instance);
+  InterpretResult result = INTERPRET_OK;
+  if (vm->frameCount > 0) {
+    result = run();
+    if (result != INTERPRET_OUT_OF_FUEL)
+      freeSuspendedChunk();
+  }
+  if (result == INTERPRET_OK)
+    result = schedule();
+  switchVM(previous);
+  return result;
+}
+
+void spawnCoroutine(VM *instance, ObjCoroutine *coroutine) {
+  VM *previous = enterVM(instance);
+  enqueue(coroutine);
+  switchVM(previous);
+}
 
-  freeChunk(&chunk);
+InterpretResult resumeCoroutine(VM *instance, ObjCoroutine *coroutine) {
+  VM *previous = enterVM(instance);
+  InterpretResult result = resume(coroutine);
+  switchVM(previous);
   return result;
 }
+
+bool wakeCoroutine(VM *instance, ObjCoroutine *coroutine, Value value) {
+  VM *previous = enterVM(instance);
+  bool woken = wake(coroutine, value);
+  switchVM(previous);
+  return woken;
+}
+
+ObjCoroutine *runningCoroutine(VM *instance) {
+  return instance->scheduler.running;
+}
+
+ObjCoroutine *suspendHostCall(VM *instance) {
+  if (instance->scheduler.running == NULL)
+    return NULL;
+  instance->hostSuspends = true;
+  return instance->scheduler.running;
+}
+
+void notifyVM(VM *instance) {
+  __atomic_store_n(&instance->channelWake, true, __ATOMIC_SEQ_CST);
+
+  // Counted so setWakeHandler() can wait for calls already under way.
+  __atomic_fetch_add(&instance->notifying, 1, __ATOMIC_SEQ_CST);
+  WakeHandler handler =
+      __atomic_load_n(&instance->wakeHandler, __ATOMIC_ACQUIRE);
+  void *data = __atomic_load_n(&instance->wakeData, __ATOMIC_ACQUIRE);
+  if (handler != NULL)
+    handler(instance, data);
+  __atomic_fetch_sub(&instance->notifying, 1, __ATOMIC_RELEASE);
+}
+
+void setWakeHandler(VM *instance, WakeHandler handler, void *data) {
+  __atomic_store_n(&instance->wakeHandler, NULL, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&instance->notifying, __ATOMIC_SEQ_CST) > 0)
+    ;
+  __atomic_store_n(&instance->wakeData, data, __ATOMIC_RELEASE);
+  __atomic_store_n(&instance->wakeHandler, handler, __ATOMIC_RELEASE);
+}
+
+InterpretResult runScheduler(VM *instance) {
+  VM *previous = enterVM(instance);
+  InterpretResult result = schedule();
+  switchVM(previous);
+  return result;
+}
+
+bool initVMPool(VMPool *pool, int count, const char *prelude) {
+  pool->vms = ALLOCATE(VM, count, MEM_OTHER);
+  pool->available = ALLOCATE(VM *, count, MEM_OTHER);
+  pool->count = count;
+  pool->availableCount = 0;
+
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    VM *instance = &pool->vms[i];
+    initVM(instance);
+    if (prelude != NULL && interpret(instance, prelude) != INTERPRET_OK)
+      ok = false;
+    checkpointVM(instance);
+    pool->available[pool->availableCount++] = instance;
+  }
+
+  if (!ok)
+    freeVMPool(pool);
+  return ok;
+}
+
+void freeVMPool(VMPool *pool) {
+  for (int i = 0; i < pool->count; i++)
+    freeVM(&pool->vms[i]);
+  if (vm >= pool->vms && vm < pool->vms + pool->count)
+    switchVM(NULL);
+
+  FREE_ARRAY(VM, pool->vms, pool->count, MEM_OTHER);
+  FREE_ARRAY(VM *, pool->available, pool->count, MEM_OTHER);
+  pool->vms = NULL;
+  pool->available = NULL;
+  pool->count = 0;
+  pool->availableCount = 0;
+}
+
+VM *acquireVM(VMPool *pool) {
+  if (pool->availableCount == 0)
+    return NULL;
+
+  return pool->available[--pool->availableCount];
+}
+
+void releaseVM(VMPool *pool, VM *instance) {
+  resetVM(instance);
+  pool->available[pool->availableCount++] = instance;
+}
+
+#define FUEL_BENCH_CHAIN 1024
+#define FUEL_BENCH_STEPS (FUEL_BENCH_CHAIN * FUEL_BENCH_CHAIN)
+
+// One backward branch and one call per step along a chain of map entries,
+// walked once for each of its entries. It uses no locals or arithmetic,
+// which would print.
+static const char *fuelBenchSource =
+    "var at = 0;\n"
+    "var inner = 0;\n"
+    "func step() { return next[inner]; }\n"
+    "while (!((at = next[at]) == nil) and !((inner = 0) == nil)) {\n"
+    "  while (!((inner = step()) == nil)) {}\n"
+    "}\n";
+
+// Runs the program to the end in turns of slice fuel (unmetered when
+// negative), and returns the best time per step of a few runs.
+static double fuelBenchRun(VM *instance, Program *program, int64_t slice,
+                           long *turns) {
+  double best = 0;
+  for (int run = 0; run < 3; run++) {
+    resetVM(instance);
+    *turns = 1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    setFuel(instance, slice);
+    InterpretResult result = runProgram(instance, program);
+    while (result == INTERPRET_OUT_OF_FUEL) {
+      (*turns)++;
+      setFuel(instance, slice);
+      result = continueVM(instance);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+                (double)(end.tv_nsec - start.tv_nsec);
+    if (run == 0 || ns < best)
+      best = ns;
+  }
+  return best / FUEL_BENCH_STEPS;
+}
+
+void benchmarkFuel(FILE *out) {
+  Program *program = compileProgram(fuelBenchSource);
+  if (program == NULL)
+    return;
+
+  VM *previous = vm;
+  VM *instance = ALLOCATE(VM, 1, MEM_OTHER);
+  initVM(instance);
+  loadProgram(instance, program);
+  switchVM(instance);
+  ObjMap *next = newMap();
+  for (int i = 0; i < FUEL_BENCH_CHAIN; i++)
+    mapSet(next, INT_VAL(i), i + 1 < FUEL_BENCH_CHAIN ? INT_VAL(i + 1)
+                                                      : NIL_VAL);
+  defineGlobal(instance, "next", OBJ_VAL(next));
+  checkpointVM(instance);
+
+#ifdef FUEL_METERING
+  fprintf(out, "fuel metering compiled in\n");
+#else
+  fprintf(out, "fuel metering compiled out\n");
+#endif
+  long turns;
+  double unmetered = fuelBenchRun(instance, program, -1, &turns);
+  fprintf(out, "%12s %8.2f ns/step\n", "unmetered", unmetered);
+  static const int64_t slices[] = {100, 1000, 10000, 100000};
+  for (size_t i = 0; i < sizeof(slices) / sizeof(slices[0]); i++) {
+    double ns = fuelBenchRun(instance, program, slices[i], &turns);
+    fprintf(out, "%12lld %8.2f ns/step, %ld turns, %+.1f%%\n",
+            (long long)slices[i], ns, turns,
+            (ns - unmetered) / unmetered * 100);
+  }
+
+  freeVM(instance);
+  FREE(VM, instance, MEM_OTHER);
+  freeProgram(program);
+  switchVM(previous);
+}
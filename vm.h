@@ -1,40 +1,246 @@
 #ifndef xasm_vm_h
 #define xasm_vm_h
 
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+
 #include "chunk.h"
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "parallel.h"
+#include "random.h"
 #include "table.h"
 
-#define STACK_MAX 256
+#define FRAMES_MAX 64
+// Slots in a VM stack unless setStackSize() says otherwise. Pages are only
+// committed once touched, so an unused stack costs address space alone.
+#define STACK_DEFAULT_SLOTS (64 * 1024)
+
+// Coroutines ready to run, in an intrusive FIFO through ObjCoroutine.next,
+// so queueing one never allocates.
+typedef struct
+{
+  ObjCoroutine *head;
+  ObjCoroutine *tail;
+  ObjCoroutine *running;
+  int parkedCount;
+  // Parked in send() or recv(), linked through next. They are all retried
+  // when a channel notifies the VM.
+  ObjCoroutine *channelWaiters;
+  // A coroutine failed since the scheduler last returned.
+  bool failed;
+} Scheduler;
+
+typedef void (*WakeHandler)(VM *instance, void *data);
 
 typedef struct
 {
-  Chunk *chunk;
-  uint8_t *ip;
-  Value stack[STACK_MAX];
+  ArenaMark heapMark;
+  size_t heapBytes[MEM_CATEGORY_COUNT];
+  Obj *objects;
+  ObjFunction *functions;
+  Table strings;
+  Table globals;
+  Random random;
+  bool taken;
+} VMCheckpoint;
+
+typedef struct Program Program;
+
+struct VM
+{
+  // Mapped with an inaccessible guard page right after its last slot, so a
+  // push past the end faults instead of being checked for.
+  Value *stack;
+  size_t stackSlots;
+  size_t stackBytes; // mapped, guard page included
+  // Where run() goes when the stack overflows; NULL while not running.
+  sigjmp_buf *overflowJump;
+  CallFrame frames[FRAMES_MAX];
+  int frameCount;
   int stackCount;
   Value *stackTop;
   Table strings;
   Table globals;
-  bool OverflowFlag;
+  Random random;
+  Scheduler scheduler;
+
+  // Units left before run() returns INTERPRET_OUT_OF_FUEL; one is charged per
+  // backward branch and per call. INT64_MAX when unmetered.
+  int64_t fuel;
+  // The code of a script interpret() left unfinished, kept for continueVM().
+  Chunk *suspendedChunk;
+  // Set by suspendHostCall() while a host function runs.
+  bool hostSuspends;
 
+  // Set by other threads through notifyVM().
+  bool channelWake;
+  int notifying;
+  WakeHandler wakeHandler;
+  void *wakeData;
+
+  // Set once the VM has run a shared Program: the program's interned
+  // strings, searched before the VM's own, and this VM's field caches for
+  // the program's code.
+  const Program *program;
+  Table *sharedStrings;
+  FieldCache *programCaches;
+  int programCacheCount;
+
+  // When set, the strings compiled are interned here rather than in
+  // strings; see useInternTable().
+  InternTable *interns;
+  // Set while compile() runs on the VM.
+  bool compiling;
+
+  // Parallel for: the helpers that run its ranges, each a VM and a thread
+  // kept from first use until the VM is freed, and, in a helper's VM, the
+  // VM it borrows globals and strings from and the accumulators its range
+  // ended with.
+  int parallelism;
+  ParallelHelper **helpers;
+  int helperCount;
+  VM *lender;
+  Value parallelResults[PARALLEL_ACCUMULATORS_MAX];
+
+  Arena heap;
+  size_t heapBytes[MEM_CATEGORY_COUNT];
   Obj *objects;
-} VM;
+  ObjFunction *functions;
+  VMCheckpoint checkpoint;
+};
+
+// A script compiled once and run by any number of VMs, on any threads, at
+// the same time. Its chunk, functions and strings are allocated in a VM of
+// its own that never executes anything, and nothing in it is written after
+// compileProgram() returns: VMs keep their field caches to themselves and
+// share the program's strings read-only. It must outlive every VM that ran
+// it, and a VM should run only one program between resets.
+struct Program
+{
+  VM home;
+  Chunk chunk;
+  int cacheCount;
+  // The bytecode file the code runs from, when loaded from one.
+  void *mapping;
+  size_t mappingSize;
+};
+
+typedef struct
+{
+  VM *vms;
+  VM **available;
+  int count;
+  int availableCount;
+} VMPool;
 
 typedef enum
 {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  // A coroutine paused or halted; see resumeCoroutine().
+  INTERPRET_YIELD,
+  // The VM's fuel ran out. The script stopped between two instructions and
+  // goes on from there with continueVM().
+  INTERPRET_OUT_OF_FUEL,
 } InterpretResult;
 
-extern VM vm;
+// The VM the calling thread is working on, which object allocation,
+// interning and memory accounting use. Each thread has its own. The
+// functions below that take a VM make it current while they run and then
+// restore the previous one, so independent VMs can run on separate threads
+// at the same time. Code that allocates outside of them, such as a
+// benchmark, selects a VM with switchVM().
+extern _Thread_local VM *vm;
 
-void initVM();
-void freeVM();
+void initVM(VM *instance);
+void freeVM(VM *instance);
 void freeObjects();
-InterpretResult interpretChunk(Chunk *chunk);
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop();
+void switchVM(VM *instance);
+void checkpointVM(VM *instance);
+void resetVM(VM *instance);
+// Makes the VM intern the strings it compiles, identifiers and literals, in
+// a table it may share with VMs on other threads, so equal constants are one
+// object across all of them. Strings built at runtime stay in the VM's own
+// table and go with its resets, so the shared table grows with the code
+// compiled rather than with the data scripts handle. Call it before the VM
+// has created any strings. The table must outlive the VM.
+void useInternTable(VM *instance, InternTable *table);
+InterpretResult interpretChunk(VM *instance, Chunk *chunk);
+InterpretResult interpret(VM *instance, const char *source);
+// Pushes without a bounds check: pushing past the end of the stack faults
+// on its guard page, and only inside run(), which host functions are called
+// from, is that caught and reported as a "Stack overflow." runtime error.
+// Elsewhere, as in callFunction() or a host's setup, an overflow ends the
+// process, so pushes there must stay within the stack.
+void push(VM *vm, Value value);
+Value pop(VM *vm);
+// Remaps the VM's stack to hold this many slots. Returns false when the VM
+// is running or the mapping fails, which leaves the stack as it was.
+// Suspended coroutines deeper than the new size can't be resumed.
+bool setStackSize(VM *instance, size_t slots);
+
+// Coroutines. A coroutine runs on the VM stack while it is resumed and
+// returns INTERPRET_YIELD when it calls pause() (it stays ready) or halt()
+// (it parks until woken). Resuming is only possible while the VM is not
+// running anything else.
+void spawnCoroutine(VM *instance, ObjCoroutine *coroutine);
+InterpretResult resumeCoroutine(VM *instance, ObjCoroutine *coroutine);
+// Makes a parked coroutine ready again; value becomes the result of its
+// halt(). Returns false if it was not parked.
+bool wakeCoroutine(VM *instance, ObjCoroutine *coroutine, Value value);
+ObjCoroutine *runningCoroutine(VM *instance);
+// Called by a host function to park the coroutine calling it once it
+// returns, instead of handing its result back; the value the coroutine is
+// later woken with becomes the result of the call. Returns the coroutine, or
+// NULL when the host function was not called from one.
+ObjCoroutine *suspendHostCall(VM *instance);
+// Runs ready coroutines round-robin until none is left. Returns
+// INTERPRET_YIELD when some are still parked, waiting for the host to wake
+// them, and INTERPRET_RUNTIME_ERROR when any of them failed.
+InterpretResult runScheduler(VM *instance);
+// Tells a VM, from any thread, that a channel its coroutines wait on has
+// changed. They are retried the next time its scheduler runs, and the VM's
+// wake handler, if any, is called on the notifying thread so the host can
+// arrange for that.
+void notifyVM(VM *instance);
+// Sets the handler notifyVM() calls. Once it returns, no call to the
+// previous handler is still running.
+void setWakeHandler(VM *instance, WakeHandler handler, void *data);
+
+Program *compileProgram(const char *source);
+// Marks the chunks of a program shared and numbers their field caches, once
+// its code and functions are all in place.
+void finishProgram(Program *program);
+void freeProgram(Program *program);
+// Prepares the VM to run program; runProgram() does this itself. A host
+// that defines globals for the program calls it first, so the names it
+// interns are the program's own strings.
+void loadProgram(VM *instance, Program *program);
+InterpretResult runProgram(VM *instance, Program *program);
+// Defines or overwrites a global, such as an input for the next script.
+void defineGlobal(VM *instance, const char *name, Value value);
+// Gives the VM this much fuel, replacing what it had left, or makes it
+// unmetered when fuel is negative. A host time-slices scripts by running
+// each until INTERPRET_OUT_OF_FUEL, refuelling it and calling continueVM()
+// when its turn comes again. A VM that ran out must be continued or reset
+// before it runs anything else.
+void setFuel(VM *instance, int64_t fuel);
+// Goes on with whatever ran out of fuel: the script or function that was
+// running, then the coroutines that are ready.
+InterpretResult continueVM(VM *instance);
+void benchmarkFuel(FILE *out);
+// Calls function with the given arguments and runs it to completion. The
+// VM must not be running anything else.
+InterpretResult callFunction(VM *instance, ObjFunction *function, int argCount,
+                             Value *args);
+
+bool initVMPool(VMPool *pool, int count, const char *prelude);
+void freeVMPool(VMPool *pool);
+VM *acquireVM(VMPool *pool);
+void releaseVM(VMPool *pool, VM *instance);
 
-#endif
\ No newline at end of file
+#endif
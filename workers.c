@@ -0,0 +1,548 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "workers.h"
+
+static _Thread_local Worker *currentWorker = NULL;
+static _Thread_local Job *runningJob = NULL;
+
+static uint64_t now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static void count(uint64_t *counter, uint64_t amount)
+{
+  __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// The owner's pop and the thieves' steal race only for the last job, and
+// settle it with a CAS on top. Sequentially consistent accesses to top and
+// bottom stand in for the usual fences.
+
+static bool dequePush(Deque *deque, Job *job)
+{
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= WORKER_DEQUE_CAPACITY)
+    return false;
+
+  __atomic_store_n(&deque->slots[bottom % WORKER_DEQUE_CAPACITY], job,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static Job *dequePop(Deque *deque)
+{
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+  if (top > bottom)
+  {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  Job *job = __atomic_load_n(&deque->slots[bottom % WORKER_DEQUE_CAPACITY],
+                             __ATOMIC_RELAXED);
+  if (top == bottom)
+  {
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      job = NULL;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return job;
+}
+
+static Job *dequeSteal(Deque *deque)
+{
+  long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+  if (top >= bottom)
+    return NULL;
+
+  // The owner may overwrite the slot once top moves on, but then the CAS
+  // fails and the job read here is dropped.
+  Job *job = __atomic_load_n(&deque->slots[top % WORKER_DEQUE_CAPACITY],
+                             __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return job;
+}
+
+static VM *newVM()
+{
+  VM *instance = ALLOCATE(VM, 1, MEM_OTHER);
+  initVM(instance);
+  checkpointVM(instance);
+  return instance;
+}
+
+static void deleteVM(VM *instance)
+{
+  freeVM(instance);
+  FREE(VM, instance, MEM_OTHER);
+}
+
+// Queues a job on the calling worker's deque when the calling thread is one
+// of the pool's workers, and on the shared queue otherwise or when asked to.
+static void enqueueJob(WorkerPool *pool, Job *job, bool shared)
+{
+  job->queuedAt = now();
+  __atomic_store_n(&job->state, JOB_QUEUED, __ATOMIC_RELAXED);
+
+  Worker *worker = currentWorker;
+  bool pushed = !shared && worker != NULL && worker->pool == pool &&
+                dequePush(&worker->deque, job);
+  if (!pushed)
+  {
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+      pool->tail->next = job;
+    else
+      __atomic_store_n(&pool->head, job, __ATOMIC_RELAXED);
+    pool->tail = job;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  // A worker going to sleep counts itself before it checks pending, and we
+  // count the job before checking for sleepers, so one of us sees the other.
+  __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static Job *takeShared(WorkerPool *pool)
+{
+  // Peek without the lock; a job missed here is counted in pending, so the
+  // worker looks again before it sleeps.
+  if (__atomic_load_n(&pool->head, __ATOMIC_RELAXED) == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  Job *job = pool->head;
+  if (job != NULL)
+  {
+    __atomic_store_n(&pool->head, job->next, __ATOMIC_RELAXED);
+    if (pool->head == NULL)
+      pool->tail = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
+
+static Job *findJob(Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  Job *job = dequePop(&worker->deque);
+  if (job == NULL)
+    job = takeShared(pool);
+
+  // Steal from the others, starting at a random one so thieves spread out.
+  if (job == NULL && pool->workerCount > 1)
+  {
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    int start = (int)(worker->seed % (uint32_t)pool->workerCount);
+    for (int i = 0; i < pool->workerCount && job == NULL; i++)
+    {
+      Worker *victim = &pool->workers[(start + i) % pool->workerCount];
+      if (victim != worker)
+        job = dequeSteal(&victim->deque);
+    }
+    if (job != NULL)
+      count(&worker->stats.steals, 1);
+  }
+
+  if (job != NULL)
+    __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  return job;
+}
+
+static void recordLatency(Worker *worker, uint64_t latency)
+{
+  int bucket = latency == 0 ? 0 : 64 - __builtin_clzll(latency);
+  if (bucket >= LATENCY_BUCKETS)
+    bucket = LATENCY_BUCKETS - 1;
+  count(&worker->stats.latencies[bucket], 1);
+  count(&worker->stats.latencyTotal, latency);
+  if (latency > __atomic_load_n(&worker->stats.latencyMax, __ATOMIC_RELAXED))
+    __atomic_store_n(&worker->stats.latencyMax, latency, __ATOMIC_RELAXED);
+}
+
+static void deliverWakes(Job *job)
+{
+  Wake *wakes = __atomic_exchange_n(&job->wakes, NULL, __ATOMIC_SEQ_CST);
+
+  // They were pushed newest first.
+  Wake *ordered = NULL;
+  while (wakes != NULL)
+  {
+    Wake *next = wakes->next;
+    wakes->next = ordered;
+    ordered = wakes;
+    wakes = next;
+  }
+
+  while (ordered != NULL)
+  {
+    Wake *next = ordered->next;
+    wakeCoroutine(job->vm, ordered->coroutine, ordered->value);
+    FREE(Wake, ordered, MEM_OTHER);
+    ordered = next;
+  }
+}
+
+// Queues a suspended job again. Only one of the threads that try wins.
+static void requeueJob(Job *job)
+{
+  JobState expected = JOB_SUSPENDED;
+  if (__atomic_compare_exchange_n(&job->state, &expected, JOB_QUEUED, false,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    enqueueJob(job->pool, job, false);
+}
+
+static void channelWoke(VM *instance, void *data)
+{
+  (void)instance;
+  requeueJob((Job *)data);
+}
+
+// Parks a job whose coroutines are all waiting. A wake that arrived while it
+// ran finds it RUNNING and leaves it to us, so we look for one after
+// publishing SUSPENDED.
+static void suspendJob(Job *job)
+{
+  __atomic_store_n(&job->state, JOB_SUSPENDED, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&job->wakes, __ATOMIC_SEQ_CST) != NULL ||
+      __atomic_load_n(&job->vm->channelWake, __ATOMIC_SEQ_CST))
+    requeueJob(job);
+}
+
+static void finishJob(Worker *worker, Job *job, InterpretResult result)
+{
+  WorkerPool *pool = worker->pool;
+  VM *instance = job->vm;
+  count(result == INTERPRET_OK ? &worker->stats.completed
+                               : &worker->stats.failed,
+        1);
+
+  // No channel may queue the job once the caller has it back.
+  setWakeHandler(instance, NULL, NULL);
+  // The job belongs to the caller again once done returns.
+  if (job->done != NULL)
+    job->done(job, result);
+
+  resetVM(instance);
+  if (worker->vm == NULL)
+    worker->vm = instance;
+  else if (worker->spareCount < WORKER_SPARE_VMS)
+    worker->spares[worker->spareCount++] = instance;
+  else
+    deleteVM(instance);
+
+  if (__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_SEQ_CST) == 0)
+  {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void runJob(Worker *worker, Job *job)
+{
+  recordLatency(worker, now() - job->queuedAt);
+  __atomic_store_n(&job->state, JOB_RUNNING, __ATOMIC_SEQ_CST);
+  runningJob = job;
+
+  InterpretResult result;
+  int64_t slice = job->slice > 0 ? job->slice : -1;
+  if (job->vm == NULL)
+  {
+    job->vm = worker->vm;
+    worker->vm = NULL;
+    setWakeHandler(job->vm, channelWoke, job);
+    loadProgram(job->vm, job->program);
+    if (job->input != NULL)
+    {
+      ObjString *input = copyString(job->vm, job->input, job->inputLength);
+      defineGlobal(job->vm, "input", OBJ_VAL(input));
+    }
+    if (job->setup != NULL)
+      job->setup(job, job->vm);
+    setFuel(job->vm, slice);
+    result = runProgram(job->vm, job->program);
+  }
+  else
+  {
+    deliverWakes(job);
+    setFuel(job->vm, slice);
+    result = continueVM(job->vm);
+  }
+  runningJob = NULL;
+
+  if (result == INTERPRET_YIELD || result == INTERPRET_OUT_OF_FUEL)
+  {
+    if (worker->vm == NULL)
+      worker->vm = worker->spareCount > 0 ? worker->spares[--worker->spareCount]
+                                          : newVM();
+  }
+  if (result == INTERPRET_YIELD)
+  {
+    count(&worker->stats.suspensions, 1);
+    suspendJob(job);
+    return;
+  }
+  if (result == INTERPRET_OUT_OF_FUEL)
+  {
+    count(&worker->stats.preemptions, 1);
+    enqueueJob(worker->pool, job, true);
+    return;
+  }
+  finishJob(worker, job, result);
+}
+
+static void *workerMain(void *arg)
+{
+  Worker *worker = (Worker *)arg;
+  WorkerPool *pool = worker->pool;
+  currentWorker = worker;
+
+  for (;;)
+  {
+    Job *job = findJob(worker);
+    if (job != NULL)
+    {
+      runJob(worker, job);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 &&
+           !pool->stopping)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    bool stop = pool->stopping &&
+                __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (stop)
+      break;
+  }
+
+  currentWorker = NULL;
+  return NULL;
+}
+
+void initWorkerPool(WorkerPool *pool, int workerCount)
+{
+  pool->workers = ALLOCATE(Worker, workerCount, MEM_OTHER);
+  pool->workerCount = workerCount;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stopping = false;
+  pool->pending = 0;
+  pool->outstanding = 0;
+  pool->sleepers = 0;
+  pool->submitted = 0;
+  pool->startedAt = now();
+
+  // Set every worker up before any starts, since they steal from each other.
+  for (int i = 0; i < workerCount; i++)
+  {
+    Worker *worker = &pool->workers[i];
+    memset(worker, 0, sizeof(Worker));
+    worker->pool = pool;
+    worker->index = i;
+    worker->vm = newVM();
+    worker->seed = 0x9e3779b9u * (uint32_t)(i + 1);
+  }
+  for (int i = 0; i < workerCount; i++)
+    pthread_create(&pool->workers[i].thread, NULL, workerMain,
+                   &pool->workers[i]);
+}
+
+void freeWorkerPool(WorkerPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->workerCount; i++)
+  {
+    Worker *worker = &pool->workers[i];
+    pthread_join(worker->thread, NULL);
+    deleteVM(worker->vm);
+    for (int j = 0; j < worker->spareCount; j++)
+      deleteVM(worker->spares[j]);
+  }
+
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  FREE_ARRAY(Worker, pool->workers, pool->workerCount, MEM_OTHER);
+  pool->workers = NULL;
+  pool->workerCount = 0;
+}
+
+void submitJob(WorkerPool *pool, Job *job)
+{
+  job->pool = pool;
+  job->vm = NULL;
+  job->wakes = NULL;
+  __atomic_fetch_add(&pool->submitted, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool->outstanding, 1, __ATOMIC_SEQ_CST);
+  enqueueJob(pool, job, false);
+}
+
+void waitWorkerPool(WorkerPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->outstanding, __ATOMIC_SEQ_CST) > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void wakeJob(WorkerPool *pool, Job *job, ObjCoroutine *coroutine,
+             Value value)
+{
+  // The job was submitted to pool and requeues itself there.
+  (void)pool;
+  Wake *wake = ALLOCATE(Wake, 1, MEM_OTHER);
+  wake->coroutine = coroutine;
+  wake->value = value;
+  wake->next = __atomic_load_n(&job->wakes, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&job->wakes, &wake->next, wake, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    ;
+
+  requeueJob(job);
+}
+
+Job *currentJob() { return runningJob; }
+
+void workerPoolStats(WorkerPool *pool, WorkerPoolStats *stats)
+{
+  memset(stats, 0, sizeof(WorkerPoolStats));
+  uint64_t latencies[LATENCY_BUCKETS] = {0};
+  uint64_t latencyTotal = 0;
+  uint64_t latencyMax = 0;
+  for (int i = 0; i < pool->workerCount; i++)
+  {
+    WorkerStats *worker = &pool->workers[i].stats;
+    stats->completed += __atomic_load_n(&worker->completed, __ATOMIC_RELAXED);
+    stats->failed += __atomic_load_n(&worker->failed, __ATOMIC_RELAXED);
+    stats->suspensions +=
+        __atomic_load_n(&worker->suspensions, __ATOMIC_RELAXED);
+    stats->preemptions +=
+        __atomic_load_n(&worker->preemptions, __ATOMIC_RELAXED);
+    stats->steals += __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+    latencyTotal += __atomic_load_n(&worker->latencyTotal, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&worker->latencyMax, __ATOMIC_RELAXED);
+    if (max > latencyMax)
+      latencyMax = max;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+      latencies[b] += __atomic_load_n(&worker->latencies[b], __ATOMIC_RELAXED);
+  }
+  stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+  stats->seconds = (double)(now() - pool->startedAt) / 1e9;
+  stats->jobsPerSecond = (double)(stats->completed + stats->failed) /
+                         (stats->seconds > 0 ? stats->seconds : 1);
+
+  uint64_t samples = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+    samples += latencies[b];
+  if (samples == 0)
+    return;
+
+  stats->meanLatency = (double)latencyTotal / (double)samples / 1e3;
+  stats->maxLatency = (double)latencyMax / 1e3;
+  uint64_t seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++)
+  {
+    seen += latencies[b];
+    // Bucket b holds latencies below 2^b nanoseconds.
+    double bound = (double)(1ull << (b < 63 ? b : 63)) / 1e3;
+    if (stats->p50Latency == 0 && seen * 2 >= samples)
+      stats->p50Latency = bound;
+    if (stats->p99Latency == 0 && seen * 100 >= samples * 99)
+      stats->p99Latency = bound;
+  }
+}
+
+void printWorkerPoolStats(FILE *out, const WorkerPoolStats *stats)
+{
+  fprintf(out,
+          "jobs: %llu submitted, %llu completed, %llu failed, %llu "
+          "suspensions, %llu preemptions, %llu steals\n",
+          (unsigned long long)stats->submitted,
+          (unsigned long long)stats->completed,
+          (unsigned long long)stats->failed,
+          (unsigned long long)stats->suspensions,
+          (unsigned long long)stats->preemptions,
+          (unsigned long long)stats->steals);
+  fprintf(out, "throughput: %.0f jobs/s over %.3f s\n", stats->jobsPerSecond,
+          stats->seconds);
+  fprintf(out,
+          "queue latency (us): mean %.1f, p50 < %.1f, p99 < %.1f, max %.1f\n",
+          stats->meanLatency, stats->p50Latency, stats->p99Latency,
+          stats->maxLatency);
+}
+
+#define BENCH_JOBS 100000
+
+static const char *benchSource =
+    "var greeting = \"hello \" + input;\n"
+    "var fields = {\"greeting\": greeting, \"input\": input};\n"
+    "var result = fields[\"greeting\"] + \"!\";\n";
+
+void benchmarkWorkers(FILE *out)
+{
+  Program *program = compileProgram(benchSource);
+  if (program == NULL)
+    return;
+
+  Job *jobs = malloc(sizeof(Job) * BENCH_JOBS);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxWorkers = cpus > 4 ? (int)cpus : 4;
+
+  for (int workers = 1; workers <= maxWorkers; workers *= 2)
+  {
+    WorkerPool pool;
+    initWorkerPool(&pool, workers);
+    for (int i = 0; i < BENCH_JOBS; i++)
+    {
+      jobs[i] = (Job){.program = program, .input = "world", .inputLength = 5};
+      submitJob(&pool, &jobs[i]);
+    }
+    waitWorkerPool(&pool);
+
+    WorkerPoolStats stats;
+    workerPoolStats(&pool, &stats);
+    fprintf(out, "%d workers (%ld cpus):\n", workers, cpus);
+    printWorkerPoolStats(out, &stats);
+    freeWorkerPool(&pool);
+  }
+
+  free(jobs);
+  freeProgram(program);
+}
@@ -0,0 +1,169 @@
+#ifndef xasm_workers_h
+#define xasm_workers_h
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Jobs a worker's deque holds before it spills into the shared queue.
+#define WORKER_DEQUE_CAPACITY 1024
+// VMs a worker keeps for later jobs once suspended jobs hand theirs back.
+#define WORKER_SPARE_VMS 4
+// Queue latencies are counted in power-of-two nanosecond buckets.
+#define LATENCY_BUCKETS 64
+
+typedef struct Job Job;
+typedef struct WorkerPool WorkerPool;
+typedef void (*JobSetup)(Job *job, VM *instance);
+typedef void (*JobDone)(Job *job, InterpretResult result);
+
+typedef enum
+{
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_SUSPENDED,
+} JobState;
+
+typedef struct Wake
+{
+  ObjCoroutine *coroutine;
+  Value value;
+  struct Wake *next;
+} Wake;
+
+// One run of a shared program. The caller owns the job: it fills in the
+// fields up to data, submits it, and keeps it and its input alive until
+// done has been called.
+struct Job
+{
+  Program *program;
+  // Defined as the string global "input" before the script runs, unless
+  // NULL.
+  const char *input;
+  int inputLength;
+  // Called on the worker thread before the script runs, to define further
+  // globals, such as the channels of a pipeline stage (see channelValue()).
+  JobSetup setup;
+  // Fuel the script gets each time it runs (see setFuel()), or 0 for no
+  // limit. A job that burns through it goes to the back of the shared queue,
+  // keeping its VM, so long scripts take turns with short ones.
+  int64_t slice;
+  // Called on the worker thread when the script has finished, before its VM
+  // is reset, so it may still read the script's globals through vm.
+  JobDone done;
+  void *data;
+
+  // Owned by the pool.
+  WorkerPool *pool;
+  VM *vm;
+  JobState state;
+  Wake *wakes;
+  Job *next;
+  uint64_t queuedAt;
+};
+
+typedef struct
+{
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t suspensions;
+  uint64_t preemptions;
+  uint64_t steals;
+  uint64_t latencyTotal;
+  uint64_t latencyMax;
+  uint64_t latencies[LATENCY_BUCKETS];
+} WorkerStats;
+
+// Work-stealing deque (Chase and Lev). The owning worker pushes and pops at
+// bottom; idle workers steal from top.
+typedef struct
+{
+  long top;
+  long bottom;
+  Job *slots[WORKER_DEQUE_CAPACITY];
+} Deque;
+
+typedef struct
+{
+  WorkerPool *pool;
+  int index;
+  pthread_t thread;
+  Deque deque;
+  // The VM the next new job runs on. Each is checkpointed empty, so a reset
+  // readies it for another job.
+  VM *vm;
+  VM *spares[WORKER_SPARE_VMS];
+  int spareCount;
+  uint32_t seed;
+  WorkerStats stats;
+} Worker;
+
+// A fixed set of threads running jobs, each on a VM of its own. A job is
+// queued on the submitting worker's deque, or on a shared queue when it
+// comes from outside the pool, and workers that run dry steal from each
+// other. A job whose coroutines are all parked when its script ends is
+// suspended: it keeps its VM, the worker takes another, and wakeJob(), or
+// a channel notifying its VM, queues it again on the worker that woke it.
+// A job that runs out of its slice of fuel is preempted the same way and
+// queued again behind everything else.
+struct WorkerPool
+{
+  Worker *workers;
+  int workerCount;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  // The shared queue, guarded by lock.
+  Job *head;
+  Job *tail;
+  bool stopping;
+
+  long pending;     // queued jobs, on any deque or the shared queue
+  long outstanding; // submitted jobs that have not finished
+  int sleepers;
+  uint64_t submitted;
+  uint64_t startedAt;
+};
+
+typedef struct
+{
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t suspensions;
+  uint64_t preemptions;
+  uint64_t steals;
+  double seconds;
+  double jobsPerSecond;
+  // Time from being queued to starting on a worker, in microseconds. The
+  // percentiles are bucket bounds, so they are accurate to a factor of two.
+  double meanLatency;
+  double p50Latency;
+  double p99Latency;
+  double maxLatency;
+} WorkerPoolStats;
+
+void initWorkerPool(WorkerPool *pool, int workerCount);
+// Stops the workers once the queued jobs have run. Suspended jobs must have
+// been woken and finished first.
+void freeWorkerPool(WorkerPool *pool);
+// Queues a job. Safe from any thread, including a job's own host functions
+// and done callback.
+void submitJob(WorkerPool *pool, Job *job);
+// Blocks until every submitted job has finished.
+void waitWorkerPool(WorkerPool *pool);
+// Wakes a parked coroutine of a suspended or running job, from any thread;
+// the job runs again with value as the result of the coroutine's halt().
+// value must not be an object from another VM.
+void wakeJob(WorkerPool *pool, Job *job, ObjCoroutine *coroutine,
+             Value value);
+// The job running on the calling thread, for host functions, or NULL.
+Job *currentJob();
+void workerPoolStats(WorkerPool *pool, WorkerPoolStats *stats);
+void printWorkerPoolStats(FILE *out, const WorkerPoolStats *stats);
+void benchmarkWorkers(FILE *out);
+
+#endif